@@ -0,0 +1,42 @@
+# Host tool: throughput benchmark of the connect/erase/program flow, see
+# src/bench/flashbench.cpp.  Run it against phytec-emulator or the module.
+
+QT += core
+QT -= gui
+
+TARGET = flash-bench
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG += c++11				# bootcode.cpp checks the boot code at compile time
+
+TEMPLATE = app
+
+SOURCES += ../src/bench/flashbench.cpp \
+    ../src/phytecmodule.cpp \
+    ../src/flashimage.cpp \
+    ../src/hexdecoder.cpp \
+    ../src/gpioline.cpp \
+    ../src/transport.cpp \
+    ../src/eventlog.cpp \
+    ../src/imagecache.cpp \
+    ../src/imagedelta.cpp \
+    ../src/bootcode.cpp \
+    ../src/crc.cpp \
+    ../src/rle.cpp
+
+HEADERS += ../src/h/phytecmodule.h \
+    ../src/h/phytecprotocol.h \
+    ../src/h/phytecdefs.h \
+    ../src/h/flashimage.h \
+    ../src/h/hexdecoder.h \
+    ../src/h/gpioline.h \
+    ../src/h/transport.h \
+    ../src/h/eventlog.h \
+    ../src/h/imagecache.h \
+    ../src/h/imagedelta.h \
+    ../src/h/bootcode.h \
+    ../src/h/crc.h \
+    ../src/h/rle.h
+
+INCLUDEPATH += ../src/h
+INCLUDEPATH += ../src
@@ -0,0 +1,25 @@
+# Host tool: sector delta between two firmware revisions, see
+# src/delta/flashdelta.cpp.  Plain C++, no Qt needed.
+
+TARGET = flash-delta
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+TEMPLATE = app
+
+SOURCES += ../src/delta/flashdelta.cpp \
+    ../src/imagedelta.cpp \
+    ../src/flashimage.cpp \
+    ../src/hexdecoder.cpp \
+    ../src/crc.cpp
+
+HEADERS += ../src/h/imagedelta.h \
+    ../src/h/flashimage.h \
+    ../src/h/hexdecoder.h \
+    ../src/h/phytecprotocol.h \
+    ../src/h/phytecdefs.h \
+    ../src/h/crc.h
+
+INCLUDEPATH += ../src/h
+INCLUDEPATH += ../src
@@ -0,0 +1,22 @@
+# Host tool: packs boot code into versioned loader files, see
+# src/loader/flashloader.cpp.  Plain C++, no Qt needed.
+
+TARGET = flash-loader
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG += c++11				# bootcode.cpp checks the boot code at compile time
+CONFIG -= qt
+
+TEMPLATE = app
+
+SOURCES += ../src/loader/flashloader.cpp \
+    ../src/bootcode.cpp \
+    ../src/crc.cpp
+
+HEADERS += ../src/h/bootcode.h \
+    ../src/h/phytecprotocol.h \
+    ../src/h/phytecdefs.h \
+    ../src/h/crc.h
+
+INCLUDEPATH += ../src/h
+INCLUDEPATH += ../src
@@ -0,0 +1,24 @@
+# Host tool: pseudo-terminal stand-in for the Phytec module, see
+# src/emulator/phytecemulator.cpp.  Plain C++, no Qt needed.
+
+TARGET = phytec-emulator
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG += c++11				# bootcode.cpp checks the boot code at compile time
+CONFIG -= qt
+
+TEMPLATE = app
+
+SOURCES += ../src/emulator/phytecemulator.cpp \
+    ../src/bootcode.cpp \
+    ../src/crc.cpp \
+    ../src/rle.cpp
+
+HEADERS += ../src/h/phytecprotocol.h \
+    ../src/h/phytecdefs.h \
+    ../src/h/bootcode.h \
+    ../src/h/crc.h \
+    ../src/h/rle.h
+
+INCLUDEPATH += ../src/h
+INCLUDEPATH += ../src
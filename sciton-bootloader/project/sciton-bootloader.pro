@@ -1,3 +1,7 @@
+# The command line flasher.  The flashing core comes from libsciton-flasher
+# (sciton-flasher.pro); build both through sciton.pro so the library is
+# there first.
+
 QT += core
 QT -= gui
 
@@ -8,15 +12,33 @@ CONFIG -= app_bundle
 TEMPLATE = app
 
 SOURCES += ../src/main.cpp \
-    ../src/phytecmodule.cpp
+    ../src/flashgroup.cpp \
+    ../src/imagecheck.cpp
 
-HEADERS += ../src/h/phytecmodule.h
+HEADERS += ../src/h/phytecmodule.h \
+    ../src/h/flashgroup.h \
+    ../src/h/phytecprotocol.h \
+    ../src/h/phytecdefs.h \
+    ../src/h/flashimage.h \
+    ../src/h/hexdecoder.h \
+    ../src/h/gpioline.h \
+    ../src/h/transport.h \
+    ../src/h/eventlog.h \
+    ../src/h/imagecache.h \
+    ../src/h/imagedelta.h \
+    ../src/h/bootcode.h \
+    ../src/h/imagecheck.h \
+    ../src/h/crc.h \
+    ../src/h/rle.h
 
 INCLUDEPATH += /opt/reach/1.6/sysroots/cortexa9hf-vfp-neon-reach-linux-gnueabi/usr/include
 INCLUDEPATH += /opt/reach/1.6/sysroots/cortexa9hf-vfp-neon-reach-linux-gnueabi/usr/include/c++/4.9.1
 INCLUDEPATH += ../src/h
 INCLUDEPATH += ../src
 
+LIBS += -L$$OUT_PWD -lsciton-flasher
+PRE_TARGETDEPS += $$OUT_PWD/libsciton-flasher.so
+
 linux-* {
 target.path = /home/root
 INSTALLS += target
@@ -0,0 +1,53 @@
+# Shared library of the flashing core, see src/h/flasher.h.  Applications
+# such as the qml-viewer link it to update the module in-process, with
+# progress per acknowledged block, instead of starting sciton-bootloader.
+
+QT += core
+QT -= gui
+
+TARGET = sciton-flasher
+VERSION = 1.0.0
+
+TEMPLATE = lib
+CONFIG += shared
+CONFIG += c++11				# bootcode.cpp checks the boot code at compile time
+
+SOURCES += ../src/flasher.cpp \
+    ../src/phytecmodule.cpp \
+    ../src/flashimage.cpp \
+    ../src/hexdecoder.cpp \
+    ../src/gpioline.cpp \
+    ../src/transport.cpp \
+    ../src/eventlog.cpp \
+    ../src/imagecache.cpp \
+    ../src/imagedelta.cpp \
+    ../src/bootcode.cpp \
+    ../src/crc.cpp \
+    ../src/rle.cpp
+
+HEADERS += ../src/h/flasher.h \
+    ../src/h/phytecmodule.h \
+    ../src/h/phytecprotocol.h \
+    ../src/h/phytecdefs.h \
+    ../src/h/flashimage.h \
+    ../src/h/hexdecoder.h \
+    ../src/h/gpioline.h \
+    ../src/h/transport.h \
+    ../src/h/eventlog.h \
+    ../src/h/imagecache.h \
+    ../src/h/imagedelta.h \
+    ../src/h/bootcode.h \
+    ../src/h/crc.h \
+    ../src/h/rle.h
+
+INCLUDEPATH += /opt/reach/1.6/sysroots/cortexa9hf-vfp-neon-reach-linux-gnueabi/usr/include
+INCLUDEPATH += /opt/reach/1.6/sysroots/cortexa9hf-vfp-neon-reach-linux-gnueabi/usr/include/c++/4.9.1
+INCLUDEPATH += ../src/h
+INCLUDEPATH += ../src
+
+linux-* {
+target.path = /usr/lib
+headers.files = $$HEADERS
+headers.path = /usr/include/sciton-flasher
+INSTALLS += target headers
+}
@@ -0,0 +1,10 @@
+# Everything the target runs: libsciton-flasher, then sciton-bootloader,
+# which links it.  Both build into this directory.
+
+TEMPLATE = subdirs
+
+SUBDIRS += flasher bootloader
+
+flasher.file = sciton-flasher.pro
+bootloader.file = sciton-bootloader.pro
+bootloader.depends = flasher
@@ -0,0 +1,495 @@
+/**
+  *****************************************************************************
+  * @file flashbench.cpp
+  * @brief Throughput benchmark of the complete flashing flow.
+  *
+  * Runs connect, erase and program against a port, either the real module
+  * or a phytec-emulator started for every run, and reports bytes/s,
+  * records/s, the time spent in every phase and the write acknowledge
+  * latency.  Images are real .H86 files or synthetic ones generated here.
+  *
+  *   flash-bench --emulator ./phytec-emulator --emu-arg --latency=1 \
+  *               --synthetic 262144 --pattern random --runs 3
+  *
+  * resume-check.sh next to this file uses --emu-link and --check-flash to
+  * interrupt an update, resume it and compare the emulator's flash with the
+  * image.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include <QtCore/QCoreApplication>
+#include <QElapsedTimer>
+#include <phytecmodule.h>
+#include <hexdecoder.h>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define BENCH_NAME "flash-bench"
+#define BENCH_RECORD_LEN 16			// bytes per synthetic data record
+#define BENCH_DECODE_ROUNDS 20		// passes over the image text for decode timing
+#define BENCH_FLASH_PAGE 256		// page of the emulator's flash file
+
+typedef enum {
+    PATTERN_RANDOM = 0,				// incompressible data, contiguous
+    PATTERN_SPARSE,					// random records with gaps between them
+    PATTERN_FILL					// long runs of one value, favours RLE writes
+} BENCH_PATTERN;
+
+typedef struct
+{
+    std::vector<const char *> images;
+    std::vector<const char *> emu_args;
+    const char *port;
+    const char *emulator;
+    const char *emu_link;				// fixed port name, keeps the journal across runs
+    const char *flash_file;				// emulator flash file compared after every run
+    u_int32_t synthetic;
+    BENCH_PATTERN pattern;
+    int runs;
+} BenchConfig;
+
+static BenchConfig cfg;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: " BENCH_NAME " [options] [IMAGE.H86 ...]\n"
+            "  --port DEVICE      flash through DEVICE (default " PHYTEC_DEBUG_PORT ")\n"
+            "  --emulator PATH    start PATH (phytec-emulator) for every run and use its pty\n"
+            "  --emu-arg ARG      pass ARG to the emulator, may be repeated\n"
+            "  --emu-link PATH    flash through the emulator's link PATH instead of its pty\n"
+            "  --check-flash FILE compare the emulator's --flash FILE with the image after every run\n"
+            "  --synthetic BYTES  also run a generated image of BYTES payload bytes\n"
+            "  --pattern NAME     random, sparse or fill (default random)\n"
+            "  --runs N           runs per image (default 1)\n");
+}
+
+static int parseArgs(int argc, char *argv[])
+{
+    cfg.port = PHYTEC_DEBUG_PORT;
+    cfg.emulator = NULL;
+    cfg.emu_link = NULL;
+    cfg.flash_file = NULL;
+    cfg.synthetic = 0;
+    cfg.pattern = PATTERN_RANDOM;
+    cfg.runs = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+
+        if (arg[0] != '-')
+        {
+            cfg.images.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+            return -1;
+        if (!strcmp(arg, "--port"))
+            cfg.port = argv[++i];
+        else if (!strcmp(arg, "--emulator"))
+            cfg.emulator = argv[++i];
+        else if (!strcmp(arg, "--emu-arg"))
+            cfg.emu_args.push_back(argv[++i]);
+        else if (!strcmp(arg, "--emu-link"))
+            cfg.emu_link = argv[++i];
+        else if (!strcmp(arg, "--check-flash"))
+            cfg.flash_file = argv[++i];
+        else if (!strcmp(arg, "--synthetic"))
+            cfg.synthetic = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(arg, "--runs"))
+            cfg.runs = atoi(argv[++i]);
+        else if (!strcmp(arg, "--pattern"))
+        {
+            arg = argv[++i];
+            if (!strcmp(arg, "random"))
+                cfg.pattern = PATTERN_RANDOM;
+            else if (!strcmp(arg, "sparse"))
+                cfg.pattern = PATTERN_SPARSE;
+            else if (!strcmp(arg, "fill"))
+                cfg.pattern = PATTERN_FILL;
+            else
+                return -1;
+        }
+        else
+            return -1;
+    }
+    if ((cfg.runs < 1) || (cfg.images.empty() && (cfg.synthetic == 0)))
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief      Write one Intel HEX record.
+ */
+static void writeRecord(FILE *fp, u_int8_t type, u_int16_t offset, const u_int8_t *data, int len)
+{
+    u_int8_t sum = len + (offset >> 8) + (offset & 0xFF) + type;
+
+    fprintf(fp, ":%02X%04X%02X", len, offset, type);
+    for (int i = 0; i < len; i++)
+    {
+        fprintf(fp, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(fp, "%02X\r\n", (u_int8_t)(0x100 - sum));
+}
+
+/**
+ * @brief      Generate a .H86 image of the given payload size in a temporary
+ *             file.  The name is returned in path, the caller unlinks it.
+ *
+ * @return     0 on success, -1 if the file can not be written.
+ */
+static int writeSynthetic(u_int32_t bytes, BENCH_PATTERN pattern, std::string &path)
+{
+    char name[] = "/tmp/flash-bench-XXXXXX";
+    u_int8_t data[BENCH_RECORD_LEN], segment[2] = { 0, 0 };
+    u_int32_t address = 0, n;
+    int fd = mkstemp(name);
+    FILE *fp;
+
+    if ((fd < 0) || ((fp = fdopen(fd, "w")) == NULL))
+        return -1;
+    path = name;
+
+    srand(1);
+    for (u_int32_t done = 0; done < bytes; done += n)
+    {
+        n = (bytes - done < BENCH_RECORD_LEN) ? bytes - done : BENCH_RECORD_LEN;
+        for (u_int32_t i = 0; i < n; i++)
+            data[i] = (pattern == PATTERN_FILL) ? (u_int8_t)((done >> 12) & 0x7F) : (u_int8_t)rand();
+
+        if (FlashImage::segmentOf(address) != segment[1] || done == 0)
+        {
+            segment[1] = FlashImage::segmentOf(address);
+            writeRecord(fp, 4, 0, segment, 2);
+        }
+        writeRecord(fp, 0, FlashImage::offsetOf(address), data, n);
+
+        address += BENCH_RECORD_LEN;
+        if ((pattern == PATTERN_SPARSE) && ((rand() & 3) == 0))
+            address += BENCH_RECORD_LEN * (1 + (rand() & 0x3F));
+        if (FlashImage::offsetOf(address) > 0x10000 - BENCH_RECORD_LEN)
+            address = (address + 0xFFFF) & ~0xFFFF;
+    }
+    writeRecord(fp, 1, 0, NULL, 0);
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * @brief      Start the emulator and read the pty it serves from its first
+ *             line of output.
+ *
+ * @return     The emulator pid, -1 if it did not start.
+ */
+static pid_t startEmulator(std::string &pty)
+{
+    std::vector<char *> args;
+    char line[256];
+    int fds[2];
+    pid_t pid;
+    FILE *fp;
+
+    if (pipe(fds) < 0)
+        return -1;
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        args.push_back((char *)cfg.emulator);
+        for (size_t i = 0; i < cfg.emu_args.size(); i++)
+            args.push_back((char *)cfg.emu_args[i]);
+        if (cfg.emu_link)
+        {
+            args.push_back((char *)"--link");
+            args.push_back((char *)cfg.emu_link);
+        }
+        args.push_back(NULL);
+        execv(cfg.emulator, &args[0]);
+        perror(BENCH_NAME ": emulator");
+        _exit(127);
+    }
+    close(fds[1]);
+    fp = fdopen(fds[0], "r");
+    if ((pid < 0) || (fp == NULL) || (fgets(line, sizeof(line), fp) == NULL))
+    {
+        if (fp)
+            fclose(fp);
+        if (pid > 0)
+        {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+    fclose(fp);
+    line[strcspn(line, "\r\n")] = 0;
+    pty = line;
+    return pid;
+}
+
+static void stopEmulator(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * @brief      Compare the flash file the emulator saved on exit with the
+ *             image.  The file holds 4 byte addresses, each followed by a
+ *             page of BENCH_FLASH_PAGE bytes; pages not in it are erased.
+ *
+ * @return     Number of image bytes the flash does not hold, -1 if the file
+ *             can not be read.
+ */
+static int checkFlash(const char *path, const FlashImage &image)
+{
+    std::map<u_int32_t, std::vector<u_int8_t> > pages;
+    std::vector<u_int8_t> page(BENCH_FLASH_PAGE);
+    FlashImage::BlockMap::const_iterator run;
+    u_int32_t address, first = 0;
+    int diffs = 0;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return -1;
+    while ((fread(&address, sizeof(address), 1, fp) == 1) && (fread(&page[0], 1, page.size(), fp) == page.size()))
+        pages[address] = page;
+    fclose(fp);
+
+    for (run = image.blocks().begin(); run != image.blocks().end(); ++run)
+    {
+        for (u_int32_t i = 0; i < run->second.size(); i++)
+        {
+            u_int32_t at = run->first + i;
+            std::map<u_int32_t, std::vector<u_int8_t> >::const_iterator p = pages.find(at & ~(BENCH_FLASH_PAGE - 1));
+            u_int8_t have = (p == pages.end()) ? 0xFF : p->second[at & (BENCH_FLASH_PAGE - 1)];
+
+            if ((have != run->second[i]) && (diffs++ == 0))
+                first = at;
+        }
+    }
+    if (diffs)
+        printf("    flash       %d bytes differ from the image, first at %06X\n", diffs, first);
+    else
+        printf("    flash       matches the image\n");
+    return diffs;
+}
+
+/**
+ * @brief      Value below which the given fraction of the samples lie.
+ */
+static u_int32_t percentile(const std::vector<u_int32_t> &sorted, double fraction)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t)(fraction * (sorted.size() - 1) + 0.5)];
+}
+
+static double rate(double amount, qint64 ms)
+{
+    return (ms > 0) ? amount * 1000.0 / ms : 0.0;
+}
+
+/**
+ * @brief      Time the decoding of the image text, SIMD and scalar paths
+ *             separately, and a full FlashImage::load().
+ */
+static void benchDecode(const char *path)
+{
+    std::vector<char> text;
+    std::vector<u_int8_t> out;
+    char buf[4096];
+    size_t n;
+    u_int8_t sum;
+    QElapsedTimer timer;
+    qint64 fast_ns, scalar_ns, load_ns;
+    FlashImage image;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (isxdigit((unsigned char)buf[i]))
+                text.push_back(buf[i]);
+        }
+    }
+    fclose(fp);
+    text.resize(text.size() & ~(size_t)1);
+    if (text.empty())
+        return;
+    out.resize(text.size() / 2);
+
+    timer.start();
+    for (int i = 0; i < BENCH_DECODE_ROUNDS; i++)
+        HexDecoder::decode(&text[0], &out[0], out.size(), &sum);
+    fast_ns = timer.nsecsElapsed();
+    timer.restart();
+    for (int i = 0; i < BENCH_DECODE_ROUNDS; i++)
+        HexDecoder::decodeScalar(&text[0], &out[0], out.size(), &sum);
+    scalar_ns = timer.nsecsElapsed();
+    timer.restart();
+    image.load(path);
+    load_ns = timer.nsecsElapsed();
+
+    printf("  decode %-6s %8.1f MB/s   scalar %8.1f MB/s   load %8.1f ms\n",
+           HexDecoder::implementation(),
+           (fast_ns > 0) ? text.size() * 1000.0 * BENCH_DECODE_ROUNDS / fast_ns : 0.0,
+           (scalar_ns > 0) ? text.size() * 1000.0 * BENCH_DECODE_ROUNDS / scalar_ns : 0.0,
+           load_ns / 1e6);
+}
+
+/**
+ * @brief      One complete flashing run of an image.
+ *
+ * @return     The updateModule() result, or a negative connect or setup error.
+ */
+static int benchRun(const char *path, int run)
+{
+    std::string pty;
+    std::vector<u_int32_t> acks;
+    const char *port = cfg.port;
+    PhytecModule *ptec = NULL;
+    pid_t emulator = -1;
+    qint64 total;
+    int ret;
+
+    if (cfg.emulator)
+    {
+        emulator = startEmulator(pty);
+        if (emulator < 0)
+        {
+            fprintf(stderr, BENCH_NAME ": could not start %s\n", cfg.emulator);
+            return -1;
+        }
+        port = cfg.emu_link ? cfg.emu_link : pty.c_str();
+    }
+
+    try
+    {
+        ptec = new PhytecModule(path, port);
+    }
+    catch (std::runtime_error &e)
+    {
+        fprintf(stderr, BENCH_NAME ": %s: %s\n", path, e.what());
+        stopEmulator(emulator);
+        return -1;
+    }
+
+    ret = ptec->connectModule();
+    if (ret == 0)
+        ret = ptec->updateModule();
+
+    const FlashStats &st = ptec->stats();
+    total = st.connect_ms + st.setup_ms + st.erase_ms + st.program_ms + st.verify_ms;
+    acks = st.ack_us;
+    std::sort(acks.begin(), acks.end());
+
+    printf("  run %d: %s\n", run, (ret == 0) ? "ok" : "FAILED");
+    if (ret != 0)
+        printf("    result %d\n", ret);
+    printf("    phases ms   parse %lld  connect %lld  setup %lld  erase %lld  program %lld  verify %lld  total %lld\n",
+           (long long)st.parse_ms, (long long)st.connect_ms, (long long)st.setup_ms,
+           (long long)st.erase_ms, (long long)st.program_ms, (long long)st.verify_ms, (long long)total);
+    printf("    program     %.0f bytes/s  %.0f records/s  %.0f line bytes/s  %u commands\n",
+           rate(st.bytes_programmed, st.program_ms),
+           rate((double)ptec->firmware().recordCount() * st.bytes_programmed / ptec->firmware().size(), st.program_ms),
+           rate(st.bytes_sent, st.program_ms), st.commands);
+    printf("    overall     %.0f bytes/s\n", rate(st.bytes_programmed, total));
+    printf("    pacing      turnaround %u us  window %d  gap %d us  %u blocks sent again\n",
+           st.turnaround_us, st.window, st.pace_us, st.retries);
+    printf("    ack us      p50 %u  p90 %u  p99 %u  max %u  (%u samples)\n",
+           percentile(acks, 0.50), percentile(acks, 0.90), percentile(acks, 0.99),
+           acks.empty() ? 0 : acks.back(), (u_int32_t)acks.size());
+    fflush(stdout);
+
+    delete ptec;
+    stopEmulator(emulator);
+    if (cfg.flash_file && (ret == 0))
+    {
+        FlashImage image;
+
+        if ((image.load(path) != NO_ERROR) || (checkFlash(cfg.flash_file, image) != 0))
+            ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief      Entry point of the flashing benchmark.
+ *
+ * @return     0 if every run succeeded.
+ */
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> paths;
+    std::string synthetic;
+    FlashImage image;
+    int failed = 0;
+
+    QCoreApplication app(argc, argv);
+
+    if (parseArgs(argc, argv) != 0)
+    {
+        usage();
+        return -1;
+    }
+
+    for (size_t i = 0; i < cfg.images.size(); i++)
+        paths.push_back(cfg.images[i]);
+    if (cfg.synthetic)
+    {
+        if (writeSynthetic(cfg.synthetic, cfg.pattern, synthetic) != 0)
+        {
+            fprintf(stderr, BENCH_NAME ": can not write the synthetic image\n");
+            return -1;
+        }
+        paths.push_back(synthetic);
+    }
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (image.load(paths[i].c_str()) != NO_ERROR)
+        {
+            fprintf(stderr, BENCH_NAME ": %s is not a valid image\n", paths[i].c_str());
+            failed++;
+            continue;
+        }
+        printf("%s: %u bytes in %u records, %u runs\n", paths[i].c_str(),
+               image.size(), image.recordCount(), (u_int32_t)image.blocks().size());
+        benchDecode(paths[i].c_str());
+        for (int run = 1; run <= cfg.runs; run++)
+        {
+            if (benchRun(paths[i].c_str(), run) != 0)
+                failed++;
+        }
+    }
+
+    if (!synthetic.empty())
+        unlink(synthetic.c_str());
+    return (failed == 0) ? 0 : 1;
+}
+
+/*! @} */
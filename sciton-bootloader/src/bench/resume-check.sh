@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Interrupted update check against phytec-emulator.
+#
+# Runs a full update that the emulator cuts off part way through, checks
+# that the journal was left behind, runs the update again on the same flash
+# file and checks that it resumed and that the flash now holds the image.
+#
+#   resume-check.sh ./flash-bench ./phytec-emulator IMAGE.H86 [FAIL_AFTER]
+#
+# FAIL_AFTER is the number of loader commands the emulator answers before
+# it goes silent (default 400).  The journal lives in /application, next to
+# the manifests, so this needs the same permissions as the boot loader.
+
+BENCH=$1
+EMULATOR=$2
+IMAGE=$3
+FAIL_AFTER=${4:-400}
+
+if [ -z "$BENCH" ] || [ -z "$EMULATOR" ] || [ -z "$IMAGE" ]; then
+    echo "Usage: $0 FLASH-BENCH PHYTEC-EMULATOR IMAGE.H86 [FAIL_AFTER]" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d /tmp/resume-check-XXXXXX) || exit 2
+NAME=$(basename "$WORK")
+LINK=$WORK/$NAME
+FLASH=$WORK/flash.bin
+JOURNAL=/application/sciton-bootloader.$NAME.journal
+trap 'rm -rf "$WORK"; rm -f "$JOURNAL" /application/sciton-bootloader.$NAME.manifest' EXIT
+
+# features 3C: no sector erase or sector CRCs, so the update is a full one
+# and keeps a journal
+set -- --emulator "$EMULATOR" --emu-link "$LINK" \
+    --emu-arg --flash --emu-arg "$FLASH" --emu-arg --features --emu-arg 3C
+
+echo "== interrupted after $FAIL_AFTER commands"
+if "$BENCH" "$@" --emu-arg --fail-after --emu-arg "$FAIL_AFTER" \
+        --emu-arg --nak-rate --emu-arg 0.05 --emu-arg --seed --emu-arg 3 \
+        "$IMAGE" > "$WORK/first.log" 2>&1; then
+    echo "FAIL: the update was not interrupted, raise the image size or lower FAIL_AFTER"
+    exit 1
+fi
+if [ ! -s "$JOURNAL" ]; then
+    echo "FAIL: no journal after the interrupted update"
+    exit 1
+fi
+echo "journal: $(cat "$JOURNAL")"
+
+echo "== resumed"
+"$BENCH" "$@" --check-flash "$FLASH" "$IMAGE" > "$WORK/second.log" 2>&1
+RET=$?
+grep -E "resume:|flash  " "$WORK/second.log"
+if [ $RET -ne 0 ]; then
+    echo "FAIL: the resumed update did not complete"
+    exit 1
+fi
+if ! grep -q "resume: continuing" "$WORK/second.log"; then
+    echo "FAIL: the second update started over"
+    exit 1
+fi
+if [ -e "$JOURNAL" ]; then
+    echo "FAIL: journal left after a completed update"
+    exit 1
+fi
+echo "PASS"
+exit 0
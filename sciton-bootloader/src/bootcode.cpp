@@ -1,6 +1,28 @@
-#include <unistd.h>
+/**
+  *****************************************************************************
+  * @file bootcode.cpp
+  * @brief Boot code sent to the bootstrap loader: the built-in level 1 and
+  *        level 2 loader, and versioned variants loaded from files.
+  *
+  *****************************************************************************
+  */
 
-static const u_int8_t boot_code[] = {
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "bootcode.h"
+#include "phytecdefs.h"
+#include "crc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define BOOTCODE_BUILTIN_CRC 0xFCBC		// CRC-16 of boot_code, checked at compile time
+
+static constexpr u_int8_t boot_code[] = {
         0xE7, 0xF0, 0x31, 0x00, 0xF7, 0xF0, 0xB0, 0xFE, 0xE6, 0xF0, 0x24, 0x00, 0xE6, 0x00, 0x80, 0x03,
         0x9A, 0xB7, 0xFE, 0x70, 0x7E, 0xB7, 0xA4, 0x00, 0xB2, 0xFE, 0x86, 0xF0, 0x23, 0x04, 0x3D, 0xF8,
         0xE6, 0x08, 0xD0, 0xF7, 0xE6, 0x0A, 0x00, 0xF6, 0xE6, 0x0B, 0xD0, 0xF7, 0xE6, 0x09, 0xD0, 0xF7,
@@ -66,4 +88,276 @@ static const u_int8_t boot_code[] = {
         0xF3, 0xF8, 0xB2, 0xFE, 0x00, 0xE4, 0xCB, 0x00, 0x9A, 0xB6, 0xFE, 0x70, 0x7E, 0xB6, 0xF6, 0xF4,
         0xB0, 0xFE, 0xCB, 0x00, 0x9A, 0xB6, 0xFE, 0x70, 0x7E, 0xB6, 0xC0, 0x84, 0xF6, 0xF4, 0xB0, 0xFE,
         0x00, 0xE4, 0xCB, 0x00, 0xE6, 0x00, 0x00, 0x00, 0xE6, 0xF3, 0x55, 0xAA, 0xE6, 0xF5, 0x54, 0x05,
-        0xE6, 0xF6, 0xAA, 0x0A, 0xCB, 0x00, 0xBB, 0xE1, 0xE0, 0x2F, 0x66, 0xFE, 0xFF, 0x00, 0xCB, 0x00};
\ No newline at end of file
+        0xE6, 0xF6, 0xAA, 0x0A, 0xCB, 0x00, 0xBB, 0xE1, 0xE0, 0x2F, 0x66, 0xFE, 0xFF, 0x00, 0xCB, 0x00};
+
+// CRC-16/CCITT as crc16_update() computes it, for the compiler: one bit,
+// byte and chunk at a time so the recursion stays within constexpr limits
+static constexpr u_int16_t crc16_bits(u_int16_t crc, int bits)
+{
+    return bits ? crc16_bits((crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1, bits - 1) : crc;
+}
+
+static constexpr u_int16_t crc16_bytes(u_int16_t crc, const u_int8_t *data, u_int32_t len)
+{
+    return len ? crc16_bytes(crc16_bits(crc ^ (*data << 8), 8), data + 1, len - 1) : crc;
+}
+
+static constexpr u_int16_t crc16_chunks(u_int16_t crc, const u_int8_t *data, u_int32_t chunks)
+{
+    return chunks ? crc16_chunks(crc16_bytes(crc, data, PHYTEC_BOOT_CHUNK), data + PHYTEC_BOOT_CHUNK, chunks - 1) : crc;
+}
+
+static_assert(sizeof(boot_code) % PHYTEC_BOOT_CHUNK == 0, "boot code is sent in whole chunks");
+static_assert(sizeof(boot_code) > PHYTEC_BOOT_CHUNK, "boot code holds no level 2 loader");
+static_assert(sizeof(boot_code) <= BOOTCODE_MAX_SIZE, "boot code does not fit the target");
+static_assert(crc16_chunks(CRC16_INIT, boot_code, sizeof(boot_code) / PHYTEC_BOOT_CHUNK) == BOOTCODE_BUILTIN_CRC,
+              "boot code changed: update BOOTCODE_BUILTIN_CRC and BOOTCODE_BUILTIN_VERSION");
+
+static void put16(std::vector<u_int8_t> &out, u_int16_t value)
+{
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+static u_int16_t get16(const u_int8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/**
+ * @brief      The boot code built into the flasher.
+ */
+BootCode::BootCode()
+{
+    assign(boot_code, sizeof(boot_code), PHYTEC_BSL_ID, BOOTCODE_BUILTIN_VERSION);
+    source = "built-in";
+}
+
+/**
+ * @brief      Read a boot code file.  Nothing is kept unless the file is
+ *             intact and the code it holds could be sent.
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be read,
+ *             ERR_FW_CHKSUM if its CRC is wrong, ERR_FW_DECODE if it is not
+ *             a boot code file or the code has an impossible length.
+ */
+int BootCode::load(const char *path)
+{
+    std::vector<u_int8_t> file;
+    u_int8_t chunk[256];
+    size_t n;
+    int status;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    while (((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) && (file.size() <= BOOTCODE_HEADER + BOOTCODE_MAX_SIZE + 2))
+        file.insert(file.end(), chunk, chunk + n);
+    n = ferror(fp);
+    fclose(fp);
+    if (n)
+        return -1;
+
+    if ((file.size() < BOOTCODE_HEADER + 2) || (file.size() > BOOTCODE_HEADER + BOOTCODE_MAX_SIZE + 2) ||
+        memcmp(&file[0], BOOTCODE_MAGIC, 8) || (get16(&file[8]) != BOOTCODE_FORMAT))
+        return ERR_FW_DECODE;
+    if (crc16_update(CRC16_INIT, &file[0], file.size() - 2) != get16(&file[file.size() - 2]))
+        return ERR_FW_CHKSUM;
+    if (get16(&file[14]) != file.size() - BOOTCODE_HEADER - 2)
+        return ERR_FW_DECODE;
+
+    status = assign(&file[BOOTCODE_HEADER], get16(&file[14]), file[12], get16(&file[10]));
+    if (status == NO_ERROR)
+        source = path;
+    return status;
+}
+
+/**
+ * @brief      Write the boot code file.
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be written.
+ */
+int BootCode::save(const char *path) const
+{
+    std::vector<u_int8_t> out;
+    int status;
+    FILE *fp;
+
+    out.insert(out.end(), BOOTCODE_MAGIC, BOOTCODE_MAGIC + 8);
+    put16(out, BOOTCODE_FORMAT);
+    put16(out, loader_version);
+    out.push_back(id);
+    out.push_back(0);					// reserved
+    put16(out, code.size());
+    out.insert(out.end(), code.begin(), code.end());
+    put16(out, crc16_update(CRC16_INIT, &out[0], out.size()));
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+        return -1;
+    status = (fwrite(&out[0], 1, out.size(), fp) == out.size()) ? NO_ERROR : -1;
+    if (fclose(fp) != 0)
+        status = -1;
+    return status;
+}
+
+/**
+ * @brief      Take boot code from memory, as assembled for the target.
+ *
+ * @param[in]  data     Level 1 code in the first PHYTEC_BOOT_CHUNK bytes,
+ *                      the level 2 loader after it
+ * @param[in]  len      Whole chunks, at least two, at most BOOTCODE_MAX_SIZE
+ * @param[in]  bsl_id   The bootstrap loader's answer on the target it runs on
+ * @param[in]  version  Version of the loader, the newest one is preferred
+ *
+ * @return     NO_ERROR on success, ERR_FW_DECODE if the length is wrong.
+ */
+int BootCode::assign(const u_int8_t *data, u_int32_t len, u_int8_t bsl_id, u_int16_t version)
+{
+    if ((len % PHYTEC_BOOT_CHUNK) || (len <= PHYTEC_BOOT_CHUNK) || (len > BOOTCODE_MAX_SIZE))
+        return ERR_FW_DECODE;
+
+    code.assign(data, data + len);
+    id = bsl_id;
+    loader_version = version;
+    crc = crc16_update(CRC16_INIT, data, len);
+    source.clear();
+    return NO_ERROR;
+}
+
+u_int8_t BootCode::bslId(void) const
+{
+    return id;
+}
+
+u_int16_t BootCode::version(void) const
+{
+    return loader_version;
+}
+
+/**
+ * @brief      CRC-16 of the code alone, the same for the built-in loader
+ *             and a file holding it.
+ */
+u_int16_t BootCode::checksum(void) const
+{
+    return crc;
+}
+
+u_int32_t BootCode::size(void) const
+{
+    return code.size();
+}
+
+const u_int8_t *BootCode::levelOne(void) const
+{
+    return &code[0];
+}
+
+const u_int8_t *BootCode::levelTwo(void) const
+{
+    return &code[PHYTEC_BOOT_CHUNK];
+}
+
+u_int32_t BootCode::levelTwoSize(void) const
+{
+    return code.size() - PHYTEC_BOOT_CHUNK;
+}
+
+const char *BootCode::origin(void) const
+{
+    return source.c_str();
+}
+
+/**
+ * @brief      A set holding the built-in boot code only.
+ */
+BootCodeSet::BootCodeSet()
+{
+    list.push_back(BootCode());
+}
+
+/**
+ * @brief      Add the boot code in a file, or in every BOOTCODE_SUFFIX file
+ *             of a directory.  Files that fail to load are left out, the
+ *             others are added.
+ *
+ * @return     NO_ERROR if everything was added, -1 if the path can not be
+ *             read, else the status of the first file that failed.
+ */
+int BootCodeSet::add(const char *path)
+{
+    std::vector<std::string> names;
+    struct dirent *entry;
+    struct stat st;
+    size_t len, i;
+    int status = NO_ERROR, ret;
+    DIR *dir;
+
+    if (stat(path, &st) != 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return addFile(path);
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        len = strlen(entry->d_name);
+        if ((len > strlen(BOOTCODE_SUFFIX)) &&
+            !strcmp(entry->d_name + len - strlen(BOOTCODE_SUFFIX), BOOTCODE_SUFFIX))
+            names.push_back(std::string(path) + "/" + entry->d_name);
+    }
+    closedir(dir);
+
+    // the same order on every run, whatever the directory's
+    std::sort(names.begin(), names.end());
+    for (i = 0; i < names.size(); i++)
+    {
+        ret = addFile(names[i].c_str());
+        if (status == NO_ERROR)
+            status = ret;
+    }
+    return status;
+}
+
+int BootCodeSet::addFile(const char *path)
+{
+    BootCode variant;
+    int status = variant.load(path);
+
+    if (status == NO_ERROR)
+        list.push_back(variant);
+    return status;
+}
+
+/**
+ * @brief      The boot code for a target: the newest version made for the
+ *             derivative its bootstrap loader identifies, the one added
+ *             first on a tie.
+ *
+ * @param[in]  bsl_id  The bootstrap loader's answer to the sync byte
+ *
+ * @return     The boot code, NULL if no variant runs on that target.
+ */
+const BootCode *BootCodeSet::select(u_int8_t bsl_id) const
+{
+    const BootCode *best = NULL;
+    size_t i;
+
+    for (i = 0; i < list.size(); i++)
+    {
+        if ((list[i].bslId() == bsl_id) && ((best == NULL) || (list[i].version() > best->version())))
+            best = &list[i];
+    }
+    return best;
+}
+
+const std::vector<BootCode> &BootCodeSet::variants(void) const
+{
+    return list;
+}
+
+/*! @} */
@@ -0,0 +1,148 @@
+/**
+  *****************************************************************************
+  * @file flashdelta.cpp
+  * @brief Builds the sector delta between two firmware revisions.
+  *
+  * Reads both images with the flasher's own parser and writes the changed
+  * sectors, with the CRC of every sector of both revisions, to a delta
+  * file that sciton-bootloader --delta applies to a module holding the
+  * base revision.
+  *
+  *   flash-delta G2H1_v41.H86 G2H1_v42.H86 G2H1_v41-v42.dlt
+  *   flash-delta --show G2H1_v41-v42.dlt
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "phytecprotocol.h"
+#include "phytecdefs.h"
+#include "flashimage.h"
+#include "imagedelta.h"
+
+#define DELTA_NAME "flash-delta"
+
+static void usage(void)
+{
+    printf("Usage: " DELTA_NAME " [--base ADDR] BASE NEW DELTA\n");
+    printf("       " DELTA_NAME " --show DELTA\n");
+    printf("       BASE and NEW are Intel HEX or S-records, or raw binaries loaded at --base ADDR\n");
+}
+
+/**
+ * @brief      Read one of the two images.
+ *
+ * @return     NO_ERROR on success, else the load status.
+ */
+static int loadImage(FlashImage &image, const char *path, long base)
+{
+    int status = (base >= 0) ? image.loadBinary(path, base) : image.load(path);
+
+    if (status < 0)
+        printf("%s: can not be read\n", path);
+    else if (status != NO_ERROR)
+        printf("%s: invalid at line %d ( status = %d )\n", path, image.errorLine(), status);
+    else
+        printf("%s: %s, %u bytes in %u runs, content crc %04X\n", path, image.formatName(),
+               image.size(), (u_int32_t)image.blocks().size(), image.contentChecksum());
+    return status;
+}
+
+/**
+ * @brief      List the sectors of a delta and what applying it writes.
+ */
+static void showDelta(const ImageDelta &delta)
+{
+    ImageDelta::SectorTable::const_iterator entry;
+    const char *what;
+
+    printf("base %04X -> new %04X, sector size %X\n",
+           delta.baseChecksum(), delta.targetChecksum(), delta.sectorSize());
+    for (entry = delta.sectors().begin(); entry != delta.sectors().end(); ++entry)
+    {
+        if (!(entry->second.flags & DELTA_CHANGED))
+            what = "same";
+        else if (!(entry->second.flags & DELTA_IN_TARGET))
+            what = "erased";
+        else if (!(entry->second.flags & DELTA_IN_BASE))
+            what = "added";
+        else
+            what = "changed";
+        printf("  sector %06X  %-7s  base %04X  new %04X  %u bytes\n", entry->first, what,
+               entry->second.base_crc, entry->second.target_crc,
+               delta.changes().bytesIn(entry->first, delta.sectorSize()));
+    }
+    printf("%u of %u sectors changed, %u bytes of data\n", delta.changedSectors(),
+           (u_int32_t)delta.sectors().size(), delta.changes().size());
+}
+
+int main(int argc, char *argv[])
+{
+    const char *paths[3];
+    FlashImage old_image, new_image;
+    ImageDelta delta;
+    struct stat st_new, st_delta;
+    char *end;
+    long base = -1;
+    int i, n = 0, status;
+    bool show = false;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--show"))
+            show = true;
+        else if (!strcmp(argv[i], "--base") && (i + 1 < argc))
+        {
+            base = strtol(argv[++i], &end, 0);
+            if ((*end != 0) || (base < 0) || (base >= PHYTEC_FLASH_SIZE))
+                n = -1;
+        }
+        else if ((argv[i][0] != '-') && (n >= 0) && (n < 3))
+            paths[n++] = argv[i];
+        else
+            n = -1;
+    }
+    if ((show && (n != 1)) || (!show && (n != 3)))
+    {
+        usage();
+        return -1;
+    }
+
+    if (show)
+    {
+        status = delta.load(paths[0]);
+        if (status != NO_ERROR)
+        {
+            printf("%s: %s\n", paths[0], (status < 0) ? "can not be read" : "not a valid delta");
+            return status;
+        }
+        showDelta(delta);
+        return 0;
+    }
+
+    if ((status = loadImage(old_image, paths[0], base)) != NO_ERROR)
+        return status;
+    if ((status = loadImage(new_image, paths[1], base)) != NO_ERROR)
+        return status;
+
+    delta.build(old_image, new_image, PHYTEC_SECTOR_SIZE);
+    showDelta(delta);
+    if (delta.save(paths[2]) != NO_ERROR)
+    {
+        printf("%s: can not be written\n", paths[2]);
+        return -1;
+    }
+    if ((stat(paths[1], &st_new) == 0) && (stat(paths[2], &st_delta) == 0))
+        printf("%s: %lld bytes, %lld for the full image\n", paths[2],
+               (long long)st_delta.st_size, (long long)st_new.st_size);
+    return 0;
+}
+
+/*! @} */
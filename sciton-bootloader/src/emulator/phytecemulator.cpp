@@ -0,0 +1,768 @@
+/**
+  *****************************************************************************
+  * @file phytecemulator.cpp
+  * @brief Pseudo-terminal stand-in for the Phytec module.
+  *
+  * Presents a pty that answers like the module's bootstrap loader and the
+  * level 2 loader, so sciton-bootloader can be run and timed without
+  * hardware.  Point the flasher at the printed slave name with --port.
+  * With --listen the module is served on a loopback TCP port instead, as a
+  * network serial bridge would; the printed tcp:HOST:PORT is the --port.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <deque>
+#include <vector>
+
+#include "phytecprotocol.h"
+#include "crc.h"
+#include "rle.h"
+#include "bootcode.h"
+
+#define EMU_FLASH_SIZE (1 << 24)		// segment byte and 16 bit offset
+#define EMU_PAGE 256					// granularity of the flash file
+#define EMU_DEFAULT_BAUD 230400
+
+typedef enum
+{
+    EMU_BSL_SYNC = 0,		// waiting for the bootstrap sync byte
+    EMU_BSL_L1,				// receiving the level 1 boot code
+    EMU_BSL_L2,				// receiving the rest of the boot code
+    EMU_L2_SYNC,			// waiting for the level 2 loader ping
+    EMU_LOADER				// level 2 loader running
+} EMU_STATE;
+
+typedef struct
+{
+    int latency_ms;			// turnaround of every command
+    int erase_ms;			// full erase time
+    int sector_erase_ms;	// single sector erase time
+    int max_baud;			// highest rate that really works, higher ones lose the link
+    double nak_rate;		// fraction of writes answered with NAK
+    double drop_rate;		// fraction of writes never answered
+    double bad_rate;		// fraction of writes acknowledged but programmed wrong
+    long fail_after;		// stop answering after this many loader commands, 0 = never
+    bool legacy;			// behave like the original loader
+    int features;			// feature flags reported to the capability query
+    int block;				// largest write block accepted
+    const char *link;		// symlink to the slave pty
+    const char *flash_path;	// file keeping the flash contents between runs
+    int listen_port;		// serve on this loopback TCP port instead of a pty, 0 = pty
+    bool verbose;
+} EmuConfig;
+
+typedef struct
+{
+    long long due_us;
+    std::vector<u_int8_t> bytes;
+    int new_baud;			// switch to this rate once sent, 0 = keep
+} EmuReply;
+
+static EmuConfig cfg;
+static BootCode boot_code;			// what the target expects, the built-in loader unless --loader
+static EMU_STATE state;
+static std::vector<u_int8_t> flash;
+static std::vector<u_int8_t> rx;
+static std::deque<EmuReply> replies;
+static int baud;
+static long long line_us;			// when the line is done with the bytes received so far
+static long long baud_deadline_us;	// an unconfirmed rate is dropped at this time, 0 = none
+static bool link_broken;			// rate above max_baud, nothing gets through
+static long commands;
+static long writes, naks, drops;
+static volatile sig_atomic_t quit;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long line_time_us(int bytes)
+{
+    return (long long)bytes * 10 * 1000000 / baud;	// 8N1, ten bits per byte
+}
+
+static bool chance(double rate)
+{
+    return (rate > 0) && (drand48() < rate);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    quit = 1;
+}
+
+/**
+ * @brief      Queue a reply.  It goes out after the command has crossed the
+ *             line, the loader's turnaround and any extra work, in order.
+ */
+static void reply(const u_int8_t *bytes, int len, int extra_ms, int new_baud = 0)
+{
+    EmuReply r;
+
+    r.due_us = line_us + (long long)(cfg.latency_ms + extra_ms) * 1000 + line_time_us(len);
+    if (!replies.empty() && (replies.back().due_us > r.due_us))
+        r.due_us = replies.back().due_us;
+    r.bytes.assign(bytes, bytes + len);
+    r.new_baud = new_baud;
+    replies.push_back(r);
+}
+
+static void reply1(u_int8_t b, int extra_ms = 0)
+{
+    reply(&b, 1, extra_ms);
+}
+
+static bool checksum_ok(const u_int8_t *cmd, int len)
+{
+    u_int8_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+        sum += cmd[i];
+    return sum == 0;
+}
+
+static u_int32_t cmd_address(const u_int8_t *cmd)
+{
+    return ((u_int32_t)cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+}
+
+/**
+ * @brief      Program flash the way NOR flash does: bits can only be
+ *             cleared, so writing over data that is not erased fails.
+ */
+static bool program(u_int32_t address, const u_int8_t *data, int len)
+{
+    int i;
+
+    // the loader addresses with 16 bit offsets
+    if ((address & 0xFFFF) + len > 0x10000)
+        return false;
+    for (i = 0; i < len; i++)
+    {
+        flash[address + i] &= data[i];
+        if (flash[address + i] != data[i])
+            return false;
+    }
+    return true;
+}
+
+static void load_flash(void)
+{
+    FILE *fp;
+    u_int32_t address;
+
+    flash.assign(EMU_FLASH_SIZE, 0xFF);
+    if (!cfg.flash_path || !(fp = fopen(cfg.flash_path, "rb")))
+        return;
+    while ((fread(&address, sizeof(address), 1, fp) == 1) && (address + EMU_PAGE <= EMU_FLASH_SIZE))
+    {
+        if (fread(&flash[address], 1, EMU_PAGE, fp) != EMU_PAGE)
+            break;
+    }
+    fclose(fp);
+}
+
+static void save_flash(void)
+{
+    FILE *fp;
+    u_int32_t address;
+    int i;
+
+    if (!cfg.flash_path || !(fp = fopen(cfg.flash_path, "wb")))
+        return;
+    for (address = 0; address < EMU_FLASH_SIZE; address += EMU_PAGE)
+    {
+        for (i = 0; (i < EMU_PAGE) && (flash[address + i] == 0xFF); i++)
+            ;
+        if (i < EMU_PAGE)
+        {
+            fwrite(&address, sizeof(address), 1, fp);
+            fwrite(&flash[address], 1, EMU_PAGE, fp);
+        }
+    }
+    fclose(fp);
+}
+
+/**
+ * @brief      Back to the state after a module reset.
+ */
+static void reset(void)
+{
+    if (commands && cfg.verbose)
+        fprintf(stderr, "emulator: session end, %ld commands, %ld writes, %ld NAK, %ld dropped\n",
+                commands, writes, naks, drops);
+    save_flash();
+    state = EMU_BSL_SYNC;
+    rx.clear();
+    replies.clear();
+    baud = EMU_DEFAULT_BAUD;
+    baud_deadline_us = 0;
+    link_broken = false;
+    commands = writes = naks = drops = 0;
+}
+
+/**
+ * @brief      Length of the loader command at the head of rx, 0 if more bytes
+ *             are needed to tell, -1 for a byte no loader command starts with.
+ */
+static int command_length(void)
+{
+    switch (rx[0])
+    {
+    case PHYTEC_CMD_ERASE:
+    case PHYTEC_CMD_QUERY:
+        return 2;
+    case PHYTEC_CMD_BAUD:
+        return 3;
+    case PHYTEC_CMD_SECTOR_ERASE:
+    case PHYTEC_CMD_SECTOR_CRC:
+        return 5;
+    case PHYTEC_CMD_READ:
+        return 6;
+    case PHYTEC_CMD_RANGE_CRC:
+        return 7;
+    case PHYTEC_CMD_WRITE:
+        return (rx.size() < 5) ? 0 : 6 + rx[4];
+    case PHYTEC_CMD_WRITE_RLE:
+        return (rx.size() < 6) ? 0 : 7 + rx[5];
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief      Carry out one complete level 2 loader command.
+ */
+static void loader_command(const u_int8_t *cmd, int len)
+{
+    u_int8_t buf[256 + 3];			// largest read reply
+    int features = cfg.legacy ? 0 : cfg.features;
+    int block = cfg.legacy ? PHYTEC_LEGACY_BLOCK : cfg.block;
+    u_int32_t address;
+    u_int16_t crc;
+    int n;
+
+    commands++;
+    baud_deadline_us = 0;			// a valid command confirms the current rate
+    if (cfg.fail_after && (commands > cfg.fail_after))
+        return;						// power lost, nothing answers any more
+
+    switch (cmd[0])
+    {
+    case PHYTEC_CMD_ERASE:
+        if (cmd[1] != PHYTEC_ERASE_ALL)
+        {
+            reply1(PHYTEC_NAK);
+            break;
+        }
+        flash.assign(EMU_FLASH_SIZE, 0xFF);
+        buf[0] = cmd[0];
+        buf[1] = cmd[1];
+        buf[2] = PHYTEC_ACK;
+        reply(buf, 3, cfg.erase_ms);
+        break;
+
+    case PHYTEC_CMD_QUERY:
+        if (cfg.legacy || !checksum_ok(cmd, len))
+            break;					// the original loader does not know the query
+        buf[0] = block;
+        buf[1] = features;
+        buf[2] = PHYTEC_ACK;
+        reply(buf, 3, 0);
+        break;
+
+    case PHYTEC_CMD_WRITE:
+    case PHYTEC_CMD_WRITE_RLE:
+        writes++;
+        if (chance(cfg.drop_rate))
+        {
+            drops++;
+            break;
+        }
+        address = cmd_address(cmd);
+        if (!checksum_ok(cmd, len) || (cmd[4] > block) || chance(cfg.nak_rate))
+        {
+            naks++;
+            reply1(PHYTEC_NAK);
+            break;
+        }
+        if (cmd[0] == PHYTEC_CMD_WRITE)
+            n = program(address, cmd + 5, cmd[4]) ? cmd[4] : -1;
+        else if (features & PHYTEC_FEATURE_RLE)
+        {
+            n = rle_unpack(cmd + 6, cmd[5], buf, block);
+            if ((n != cmd[4]) || !program(address, buf, n))
+                n = -1;
+        }
+        else
+            n = -1;
+        if (n < 0)
+            naks++;
+        else if (chance(cfg.bad_rate))
+            flash[address + (lrand48() % n)] &= 0xFE;	// a weak cell, the loader does not notice
+        reply1((n < 0) ? PHYTEC_NAK : PHYTEC_ACK);
+        break;
+
+    case PHYTEC_CMD_SECTOR_ERASE:
+        address = cmd_address(cmd) & ~(PHYTEC_SECTOR_SIZE - 1);
+        if (!(features & PHYTEC_FEATURE_SECTOR_ERASE) || !checksum_ok(cmd, len))
+        {
+            reply1(PHYTEC_NAK);
+            break;
+        }
+        memset(&flash[address], 0xFF, PHYTEC_SECTOR_SIZE);
+        reply1(PHYTEC_ACK, cfg.sector_erase_ms);
+        break;
+
+    case PHYTEC_CMD_SECTOR_CRC:
+        address = cmd_address(cmd) & ~(PHYTEC_SECTOR_SIZE - 1);
+        if (!(features & PHYTEC_FEATURE_SECTOR_CRC) || !checksum_ok(cmd, len))
+        {
+            reply1(PHYTEC_NAK);
+            break;
+        }
+        crc = crc16_update(CRC16_INIT, &flash[address], PHYTEC_SECTOR_SIZE);
+        buf[0] = crc >> 8;
+        buf[1] = crc & 0xFF;
+        buf[2] = PHYTEC_ACK;
+        reply(buf, 3, 0);
+        break;
+
+    case PHYTEC_CMD_RANGE_CRC:
+        // segment, offset (2 bytes), length (2 bytes), the range stays in the segment
+        address = cmd_address(cmd);
+        n = (cmd[4] << 8) | cmd[5];
+        if (!(features & PHYTEC_FEATURE_RANGE_CRC) || !checksum_ok(cmd, len) ||
+            (n == 0) || ((address & 0xFFFF) + n > 0x10000))
+        {
+            reply1(PHYTEC_NAK);
+            break;
+        }
+        crc = crc16_update(CRC16_INIT, &flash[address], n);
+        buf[0] = crc >> 8;
+        buf[1] = crc & 0xFF;
+        buf[2] = PHYTEC_ACK;
+        reply(buf, 3, 0);
+        break;
+
+    case PHYTEC_CMD_READ:
+        // segment, offset (2 bytes), length; the reply always has length + 3
+        // bytes so that the host can keep several reads in flight
+        address = cmd_address(cmd);
+        n = cmd[4];
+        if (!(features & PHYTEC_FEATURE_READ) || !checksum_ok(cmd, len) ||
+            (n == 0) || (n > block) || ((address & 0xFFFF) + n > 0x10000))
+        {
+            memset(buf, 0, n + 2);
+            buf[n + 2] = PHYTEC_NAK;
+            reply(buf, n + 3, 0);
+            break;
+        }
+        memcpy(buf, &flash[address], n);
+        crc = crc16_update(CRC16_INIT, buf, n);
+        buf[n] = crc >> 8;
+        buf[n + 1] = crc & 0xFF;
+        buf[n + 2] = PHYTEC_ACK;
+        reply(buf, n + 3, 0);
+        break;
+
+    case PHYTEC_CMD_BAUD:
+        n = cmd[1] * 115200;
+        if (!(features & PHYTEC_FEATURE_BAUD) || !checksum_ok(cmd, len) ||
+            ((n != 230400) && (n != 460800) && (n != 921600)))
+        {
+            reply1(PHYTEC_NAK);
+            break;
+        }
+        buf[0] = PHYTEC_ACK;
+        reply(buf, 1, 0, n);		// acknowledged at the old rate, then switch
+        break;
+    }
+}
+
+/**
+ * @brief      Consume received bytes as far as they form complete messages.
+ */
+static void process(void)
+{
+    int boot_l2 = boot_code.levelTwoSize();
+    int len;
+
+    while (!rx.empty())
+    {
+        switch (state)
+        {
+        case EMU_BSL_SYNC:
+            if (rx[0] == PHYTEC_BSL_SYNC)
+            {
+                reply1(boot_code.bslId());
+                state = EMU_BSL_L1;
+            }
+            rx.erase(rx.begin());
+            break;
+
+        case EMU_BSL_L1:
+            if ((int)rx.size() < PHYTEC_BOOT_CHUNK)
+                return;
+            if (memcmp(&rx[0], boot_code.levelOne(), PHYTEC_BOOT_CHUNK) == 0)
+            {
+                reply1(PHYTEC_BSL_L1_ACK);
+                state = EMU_BSL_L2;
+            }
+            else
+            {
+                reply1(0x00);
+                state = EMU_BSL_SYNC;
+            }
+            rx.erase(rx.begin(), rx.begin() + PHYTEC_BOOT_CHUNK);
+            break;
+
+        case EMU_BSL_L2:
+            if ((int)rx.size() < boot_l2)
+                return;
+            state = (memcmp(&rx[0], boot_code.levelTwo(), boot_l2) == 0) ? EMU_L2_SYNC : EMU_BSL_SYNC;
+            rx.erase(rx.begin(), rx.begin() + boot_l2);
+            break;
+
+        case EMU_L2_SYNC:
+            if (rx[0] == PHYTEC_BSL_SYNC)
+            {
+                reply1(PHYTEC_L2_READY);
+                state = EMU_LOADER;
+            }
+            rx.erase(rx.begin());
+            break;
+
+        case EMU_LOADER:
+            len = command_length();
+            if (len < 0)
+            {
+                rx.erase(rx.begin());	// unknown command byte, ignored
+                break;
+            }
+            if ((len == 0) || ((int)rx.size() < len))
+                return;
+            if (cfg.verbose)
+                fprintf(stderr, "emulator: command %02X, %d bytes\n", rx[0], len);
+            loader_command(&rx[0], len);
+            rx.erase(rx.begin(), rx.begin() + len);
+            break;
+        }
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: phytec-emulator [options]\n"
+            "  --link PATH        symlink PATH to the slave pty\n"
+            "  --flash FILE       keep the flash contents in FILE between runs\n"
+            "  --listen PORT      serve on 127.0.0.1:PORT instead of a pty, a new\n"
+            "                     connection resets the module\n"
+            "  --legacy           behave like the original loader (16 byte blocks, no query)\n"
+            "  --loader FILE      expect the boot code in FILE and identify as its target\n"
+            "  --features HEX     feature flags to report (default 3F)\n"
+            "  --block N          largest write block (default 240)\n"
+            "  --latency MS       command turnaround (default 1)\n"
+            "  --erase-ms MS      full erase time (default 2000)\n"
+            "  --sector-erase-ms MS  sector erase time (default 100)\n"
+            "  --max-baud N       rates above N lose the link (default 921600)\n"
+            "  --nak-rate P       fraction of writes answered with NAK\n"
+            "  --drop-rate P      fraction of writes never answered\n"
+            "  --bad-rate P       fraction of writes acknowledged but programmed wrong\n"
+            "  --fail-after N     stop answering after N loader commands\n"
+            "  --seed N           random seed for the fault injection\n"
+            "  -v                 log every command\n");
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    int i;
+
+    cfg.latency_ms = 1;
+    cfg.erase_ms = 2000;
+    cfg.sector_erase_ms = 100;
+    cfg.max_baud = 921600;
+    cfg.features = PHYTEC_FEATURE_SECTOR_ERASE | PHYTEC_FEATURE_SECTOR_CRC |
+                   PHYTEC_FEATURE_BAUD | PHYTEC_FEATURE_RLE | PHYTEC_FEATURE_RANGE_CRC |
+                   PHYTEC_FEATURE_READ;
+    cfg.block = 240;
+    srand48(1);
+
+    for (i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "--legacy"))
+            cfg.legacy = true;
+        else if (!strcmp(arg, "-v"))
+            cfg.verbose = true;
+        else if (!val)
+            return -1;
+        else
+        {
+            if (!strcmp(arg, "--link"))
+                cfg.link = val;
+            else if (!strcmp(arg, "--flash"))
+                cfg.flash_path = val;
+            else if (!strcmp(arg, "--listen"))
+                cfg.listen_port = atoi(val);
+            else if (!strcmp(arg, "--loader"))
+            {
+                if (boot_code.load(val) != 0)
+                {
+                    fprintf(stderr, "phytec-emulator: %s is no boot code file\n", val);
+                    return -1;
+                }
+            }
+            else if (!strcmp(arg, "--features"))
+                cfg.features = strtol(val, NULL, 16);
+            else if (!strcmp(arg, "--block"))
+                cfg.block = atoi(val);
+            else if (!strcmp(arg, "--latency"))
+                cfg.latency_ms = atoi(val);
+            else if (!strcmp(arg, "--erase-ms"))
+                cfg.erase_ms = atoi(val);
+            else if (!strcmp(arg, "--sector-erase-ms"))
+                cfg.sector_erase_ms = atoi(val);
+            else if (!strcmp(arg, "--max-baud"))
+                cfg.max_baud = atoi(val);
+            else if (!strcmp(arg, "--nak-rate"))
+                cfg.nak_rate = atof(val);
+            else if (!strcmp(arg, "--drop-rate"))
+                cfg.drop_rate = atof(val);
+            else if (!strcmp(arg, "--bad-rate"))
+                cfg.bad_rate = atof(val);
+            else if (!strcmp(arg, "--fail-after"))
+                cfg.fail_after = atol(val);
+            else if (!strcmp(arg, "--seed"))
+                srand48(atol(val));
+            else
+                return -1;
+            i++;
+        }
+    }
+    if ((cfg.block < PHYTEC_LEGACY_BLOCK) || (cfg.block > 255))
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief      Open the pty the flasher talks to and print the slave name.
+ *
+ * @return     The master side, -1 on failure.
+ */
+static int open_pty(void)
+{
+    struct termios tio;
+    const char *name;
+    int master, slave;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0) || !(name = ptsname(master)))
+    {
+        perror("phytec-emulator: pty");
+        return -1;
+    }
+
+    // raw slave until the flasher sets its own attributes
+    slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave >= 0)
+    {
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        close(slave);
+    }
+
+    if (cfg.link)
+    {
+        unlink(cfg.link);
+        if (symlink(name, cfg.link) < 0)
+            perror("phytec-emulator: symlink");
+    }
+    printf("%s\n", name);
+    fflush(stdout);
+    return master;
+}
+
+/**
+ * @brief      Listen on the loopback TCP port and print the flasher's port
+ *             name for it.
+ *
+ * @return     The listening socket, -1 on failure.
+ */
+static int open_listener(void)
+{
+    struct sockaddr_in addr;
+    int sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("phytec-emulator: socket");
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(cfg.listen_port);
+    if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(sock, 1) < 0))
+    {
+        perror("phytec-emulator: listen");
+        close(sock);
+        return -1;
+    }
+    printf("tcp:127.0.0.1:%d\n", cfg.listen_port);
+    fflush(stdout);
+    return sock;
+}
+
+int main(int argc, char *argv[])
+{
+    u_int8_t buf[4096];
+    struct pollfd pfd;
+    long long now, wait_us;
+    bool connected = false;
+    int master = -1, listener = -1, link, n, one = 1;
+
+    if (parse_args(argc, argv) < 0)
+    {
+        usage();
+        return -1;
+    }
+
+    if (cfg.listen_port)
+        listener = open_listener();
+    else
+        master = open_pty();
+    if ((master < 0) && (listener < 0))
+        return -1;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    load_flash();
+    reset();
+
+    // the pty is always there, a TCP link only while a flasher is connected
+    link = master;
+    while (!quit)
+    {
+        now = now_us();
+
+        // send whatever is due, in order
+        while (!replies.empty() && (replies.front().due_us <= now))
+        {
+            EmuReply &r = replies.front();
+
+            if (!link_broken && (link >= 0) && (write(link, &r.bytes[0], r.bytes.size()) < 0))
+                break;
+            if (r.new_baud)
+            {
+                baud = r.new_baud;
+                link_broken = (baud > cfg.max_baud);
+                baud_deadline_us = now + PHYTEC_BAUD_FALLBACK * 1000;
+            }
+            replies.pop_front();
+        }
+
+        // the loader drops a rate nobody talked to it at
+        if (baud_deadline_us && (now >= baud_deadline_us))
+        {
+            baud = EMU_DEFAULT_BAUD;
+            link_broken = false;
+            baud_deadline_us = 0;
+            rx.clear();
+        }
+
+        wait_us = 100000;
+        if (!replies.empty())
+            wait_us = replies.front().due_us - now;
+        if (baud_deadline_us && (baud_deadline_us - now < wait_us))
+            wait_us = baud_deadline_us - now;
+        if (wait_us < 0)
+            wait_us = 0;
+
+        pfd.fd = (link >= 0) ? link : listener;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, (int)((wait_us + 999) / 1000)) <= 0)
+            continue;
+
+        if (link < 0)
+        {
+            // a new connection is a module reset
+            link = accept(listener, NULL, NULL);
+            if (link >= 0)
+            {
+                setsockopt(link, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                reset();
+            }
+            continue;
+        }
+
+        n = (pfd.revents & POLLIN) ? read(link, buf, sizeof(buf)) : -1;
+        if (n <= 0)
+        {
+            // no slave open: the flasher has gone, the module gets reset
+            if (connected)
+                reset();
+            connected = false;
+            if (listener >= 0)
+            {
+                close(link);
+                link = -1;
+            }
+            else
+                usleep(20000);
+            continue;
+        }
+        connected = true;
+
+        now = now_us();
+        line_us = ((line_us > now) ? line_us : now) + line_time_us(n);
+        if (link_broken)
+            continue;				// garbage at a rate the UART can not do
+        rx.insert(rx.end(), buf, buf + n);
+        process();
+    }
+
+    reset();
+    if (cfg.link)
+        unlink(cfg.link);
+    if (link >= 0)
+        close(link);
+    if (listener >= 0)
+        close(listener);
+    return 0;
+}
+
+/*! @} */
@@ -0,0 +1,176 @@
+/**
+  *****************************************************************************
+  * @file eventlog.cpp
+  * @brief JSON lines record of every phase of a run, for fleet tooling.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "eventlog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+EventRecord::EventRecord(const char *name)
+{
+    event = name;
+}
+
+void EventRecord::key(const char *key)
+{
+    body += ",\"";
+    body += key;
+    body += "\":";
+}
+
+/**
+ * @brief      Add a string field, escaped as JSON requires.
+ */
+EventRecord &EventRecord::str(const char *key, const char *value)
+{
+    char esc[8];
+
+    this->key(key);
+    body += '"';
+    for (; *value; value++)
+    {
+        if ((*value == '"') || (*value == '\\'))
+        {
+            body += '\\';
+            body += *value;
+        }
+        else if ((unsigned char)*value < 0x20)
+        {
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*value);
+            body += esc;
+        }
+        else
+            body += *value;
+    }
+    body += '"';
+    return *this;
+}
+
+EventRecord &EventRecord::num(const char *key, long long value)
+{
+    char buf[24];
+
+    snprintf(buf, sizeof(buf), "%lld", value);
+    this->key(key);
+    body += buf;
+    return *this;
+}
+
+EventRecord &EventRecord::real(const char *key, double value)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%.1f", value);
+    this->key(key);
+    body += buf;
+    return *this;
+}
+
+EventRecord &EventRecord::flag(const char *key, bool value)
+{
+    this->key(key);
+    body += value ? "true" : "false";
+    return *this;
+}
+
+/**
+ * @brief      Add an address as a "0x..." string, the way the logs print
+ *             addresses.
+ */
+EventRecord &EventRecord::hex(const char *key, u_int32_t value)
+{
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "0x%06X", value);
+    return str(key, buf);
+}
+
+const std::string &EventRecord::fields(void) const
+{
+    return body;
+}
+
+const char *EventRecord::name(void) const
+{
+    return event.c_str();
+}
+
+EventLog::EventLog()
+{
+    fd = -1;
+    owned = false;
+}
+
+EventLog::~EventLog()
+{
+    if (owned && (fd >= 0))
+        close(fd);
+}
+
+/**
+ * @brief      Append the events to a file.
+ *
+ * @return     0 on success, -1 if the file can not be opened.
+ */
+int EventLog::open(const char *path)
+{
+    if (owned && (fd >= 0))
+        close(fd);
+    fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    owned = true;
+    return (fd < 0) ? -1 : 0;
+}
+
+/**
+ * @brief      Write the events to a descriptor the caller owns, e.g. a pipe
+ *             set up by the update script.
+ */
+void EventLog::attach(int log_fd)
+{
+    if (owned && (fd >= 0))
+        close(fd);
+    fd = log_fd;
+    owned = false;
+}
+
+bool EventLog::isOpen(void) const
+{
+    return fd >= 0;
+}
+
+/**
+ * @brief      Write one record as one line.
+ */
+void EventLog::write(const EventRecord &record)
+{
+    std::string line;
+    struct timeval now;
+    char head[64];
+
+    if (fd < 0)
+        return;
+
+    gettimeofday(&now, NULL);
+    snprintf(head, sizeof(head), "{\"t\":%ld.%03ld,\"event\":\"", (long)now.tv_sec, (long)(now.tv_usec / 1000));
+    line = head;
+    line += record.name();
+    line += '"';
+    line += record.fields();
+    line += "}\n";
+
+    if (::write(fd, line.data(), line.size()) < 0)
+        return;						// a lost event must not stop the update
+}
+
+/*! @} */
@@ -0,0 +1,203 @@
+/**
+  *****************************************************************************
+  * @file flasher.cpp
+  * @brief In-process API of the flashing core, see libsciton-flasher.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "flasher.h"
+
+#include <QEventLoop>
+#include <QTimer>
+
+/**
+ * @brief      Set up a flasher on a link the caller keeps.  Nothing is sent
+ *             until one of the runs is called.
+ *
+ * @param      transport  The link to the module, must outlive the flasher
+ * @param[in]  boot       The GPIO driving the module's boot pin
+ * @param[in]  reset      The GPIO driving the module's reset pin
+ */
+Flasher::Flasher(Transport *transport, u_int16_t boot, u_int16_t reset)
+{
+    link = transport;
+    boot_pin = boot;
+    reset_pin = reset;
+    callback = NULL;
+    context = NULL;
+    events = NULL;
+    loaders = NULL;
+    module = NULL;
+    current.state = FLASH_IDLE;
+    current.bytes_done = 0;
+    current.bytes_total = 0;
+    last_stats = FlashStats();
+}
+
+Flasher::~Flasher()
+{
+}
+
+/**
+ * @brief      Report progress to a function, NULL for none.  It is called
+ *             from the flasher's event loop, in the caller's thread.
+ */
+void Flasher::setCallback(FlashCallback function, void *function_context)
+{
+    callback = function;
+    context = function_context;
+}
+
+/**
+ * @brief      Record the runs in an event log, NULL for none.  The log must
+ *             outlive the flasher.
+ */
+void Flasher::setEventLog(EventLog *log)
+{
+    events = log;
+}
+
+/**
+ * @brief      Choose the boot code from these variants, NULL for the
+ *             built-in one.  The set must outlive the flasher.
+ */
+void Flasher::setLoaders(const BootCodeSet *variants)
+{
+    loaders = variants;
+}
+
+/**
+ * @brief      Write an image to the module: connect, erase what differs,
+ *             program and verify.
+ *
+ * @return     NO_ERROR on success, PHYTEC_RESULT_BUSY during another run,
+ *             else the result of the failed step.
+ */
+int Flasher::update(const FlashImage &image)
+{
+    if (module)
+        return PHYTEC_RESULT_BUSY;
+
+    PhytecModule target(&image, link, boot_pin, reset_pin);
+
+    return run(&target);
+}
+
+/**
+ * @brief      Apply a delta to a module holding its base revision.
+ *
+ * @return     NO_ERROR on success, PHYTEC_RESULT_WRONG_BASE if the module
+ *             runs another revision, PHYTEC_RESULT_BUSY during another run,
+ *             else the result of the failed step.
+ */
+int Flasher::applyDelta(const ImageDelta &delta)
+{
+    if (module)
+        return PHYTEC_RESULT_BUSY;
+
+    PhytecModule target(&delta.changes(), link, boot_pin, reset_pin);
+
+    target.setDelta(&delta);
+    return run(&target);
+}
+
+/**
+ * @brief      Read the module's flash back.
+ *
+ * @param[in]  start  The first address to read
+ * @param[in]  len    The number of bytes to read
+ * @param      out    Receives what was read, erased blocks left out
+ *
+ * @return     NO_ERROR on success, PHYTEC_RESULT_BUSY during another run,
+ *             else the result of the failed step.
+ */
+int Flasher::dump(u_int32_t start, u_int32_t len, FlashImage &out)
+{
+    if (module)
+        return PHYTEC_RESULT_BUSY;
+
+    PhytecModule target((const FlashImage *)NULL, link, boot_pin, reset_pin);
+    int result;
+
+    target.setDump(start, len);
+    result = run(&target);
+    if (result == NO_ERROR)
+        out = target.firmware();
+    return result;
+}
+
+/**
+ * @brief      Timing of the last run.
+ */
+const FlashStats &Flasher::stats(void) const
+{
+    return last_stats;
+}
+
+/**
+ * @brief      Abandon the run in progress, if any.  The run returns
+ *             PHYTEC_RESULT_CANCELLED.
+ */
+void Flasher::cancel(void)
+{
+    // never from inside the module's own call chain
+    if (module)
+        QTimer::singleShot(0, module, SLOT(cancel()));
+}
+
+/**
+ * @brief      Drive one module through its run in a local event loop.
+ */
+int Flasher::run(PhytecModule *run_module)
+{
+    QEventLoop loop;
+    int result;
+
+    module = run_module;
+    current.state = FLASH_IDLE;
+    current.bytes_done = 0;
+    current.bytes_total = 0;
+
+    module->setProgressLog(false);
+    module->setReleaseOnFinish(true);	// the module is deleted right after, without a wait
+    module->setEventLog(events);
+    if (loaders)
+        module->setLoaders(loaders);
+    connect(module, &PhytecModule::stateChanged, this, &Flasher::onState);
+    connect(module, &PhytecModule::transferred, this, &Flasher::onTransferred);
+    connect(module, &PhytecModule::finished, &loop, &QEventLoop::exit);
+    QTimer::singleShot(0, module, SLOT(start()));
+
+    result = loop.exec();
+    last_stats = module->stats();
+    module = NULL;
+    return result;
+}
+
+/**
+ * @brief      Hand the progress to the callback, which may cancel the run.
+ */
+void Flasher::report(void)
+{
+    if (callback && !callback(&current, context))
+        cancel();
+}
+
+void Flasher::onState(int state)
+{
+    current.state = (FLASH_STATE)state;
+    report();
+}
+
+void Flasher::onTransferred(u_int32_t done, u_int32_t total)
+{
+    current.bytes_done = done;
+    current.bytes_total = total;
+    report();
+}
+
+/*! @} */
@@ -0,0 +1,197 @@
+/**
+  *****************************************************************************
+  * @file flashgroup.cpp
+  * @brief Flashing of several Phytec modules at once.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "flashgroup.h"
+
+#include <QThread>
+
+#define FLASHGROUP_REPORT_STEP 10		// percent between progress lines of a target
+
+/**
+ * @brief      Set up one module per target.  Nothing is sent until start().
+ *
+ * @param[in]  shared   The parsed firmware image, must outlive the group
+ * @param[in]  list     The modules to flash
+ */
+FlashGroup::FlashGroup(const FlashImage *shared, const std::vector<FlashTarget> &list)
+{
+    PhytecModule *module;
+
+    image = shared;
+    targets = list;
+    running = 0;
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        module = new PhytecModule(image, targets[i].port.c_str(), targets[i].boot_pin, targets[i].reset_pin);
+        module->setProgressLog(false);		// one line per step below instead
+        module->setReleaseOnFinish(true);	// the targets hold their resets side by side
+        connect(module, &PhytecModule::progress, this, &FlashGroup::onProgress);
+        connect(module, &PhytecModule::finished, this, &FlashGroup::onFinished);
+        modules.push_back(module);
+    }
+    results.assign(modules.size(), 0);
+    reported.assign(modules.size(), -1);
+    done.assign(modules.size(), false);
+}
+
+/**
+ * @brief      Delete the modules.  A finished target already went through
+ *             its reset hold before it reported; only a group torn down
+ *             while targets were still running has to wait, and then
+ *             PHYTEC_RESET_HOLD once for all of them.
+ */
+FlashGroup::~FlashGroup()
+{
+    size_t i;
+    int held = 0;
+
+    for (i = 0; i < modules.size(); i++)
+    {
+        if (!done[i])
+        {
+            modules[i]->holdReset();
+            held++;
+        }
+    }
+    if (held)
+        QThread::msleep(PHYTEC_RESET_HOLD);
+    for (i = 0; i < modules.size(); i++)
+    {
+        if (!done[i])
+            modules[i]->endReset();
+        delete modules[i];
+    }
+}
+
+int FlashGroup::count( void ) const
+{
+    return modules.size();
+}
+
+/**
+ * @brief      Result of one target, as PhytecModule::finished() reported it.
+ */
+int FlashGroup::result( int target ) const
+{
+    return results[target];
+}
+
+const PhytecModule *FlashGroup::module( int target ) const
+{
+    return modules[target];
+}
+
+/**
+ * @brief      Apply a delta to every target instead of the image; the group
+ *             must have been set up with the delta's changes().
+ */
+void FlashGroup::setDelta( const ImageDelta *delta )
+{
+    for (size_t i = 0; i < modules.size(); i++)
+        modules[i]->setDelta(delta);
+}
+
+/**
+ * @brief      Let every target pick its boot code from one set.
+ */
+void FlashGroup::setLoaders( const BootCodeSet *loaders )
+{
+    for (size_t i = 0; i < modules.size(); i++)
+        modules[i]->setLoaders(loaders);
+}
+
+/**
+ * @brief      Record the events of every target in one log.
+ */
+void FlashGroup::setEventLog( EventLog *log )
+{
+    for (size_t i = 0; i < modules.size(); i++)
+        modules[i]->setEventLog(log);
+}
+
+/**
+ * @brief      Start every target.  finished() follows once the last one is
+ *             done.
+ */
+void FlashGroup::start( void )
+{
+    clock.start();
+    running = modules.size();
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        qDebug("%s: flashing with boot pin %d, reset pin %d", targets[i].port.c_str(),
+               targets[i].boot_pin, targets[i].reset_pin);
+        modules[i]->start();
+    }
+    if (modules.empty())
+        emit finished(0);
+}
+
+/**
+ * @brief      Abandon every target still flashing.
+ */
+void FlashGroup::cancel( void )
+{
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        if (!done[i])
+            modules[i]->cancel();
+    }
+}
+
+int FlashGroup::indexOf(QObject *module) const
+{
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        if (modules[i] == module)
+            return i;
+    }
+    return -1;
+}
+
+void FlashGroup::onProgress(int percent)
+{
+    int i = indexOf(sender());
+
+    if ((i < 0) || (percent / FLASHGROUP_REPORT_STEP == reported[i]))
+        return;
+    reported[i] = percent / FLASHGROUP_REPORT_STEP;
+    qDebug("%s: %d%% programmed", modules[i]->portName(), reported[i] * FLASHGROUP_REPORT_STEP);
+}
+
+/**
+ * @brief      One target is done.  Once all are, report the number that
+ *             failed.
+ */
+void FlashGroup::onFinished(int result)
+{
+    int i = indexOf(sender()), failures = 0;
+
+    if ((i < 0) || done[i])
+        return;
+
+    done[i] = true;
+    results[i] = result;
+    qDebug("%s: %s ( result %d after %d ms )", modules[i]->portName(),
+           (result == NO_ERROR) ? "done" : "FAILED", result, (int)clock.elapsed());
+
+    if (--running > 0)
+        return;
+
+    for (size_t t = 0; t < results.size(); t++)
+    {
+        if (results[t] != NO_ERROR)
+            failures++;
+    }
+    emit finished(failures);
+}
+
+/*! @} */
@@ -0,0 +1,729 @@
+/**
+  *****************************************************************************
+  * @file flashimage.cpp
+  * @brief In-memory sparse copy of a firmware image.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "flashimage.h"
+#include "hexdecoder.h"
+#include "crc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+FlashImage::FlashImage()
+{
+    clear();
+}
+
+/**
+ * @brief      Drop all data held by the image.
+ */
+void FlashImage::clear(void)
+{
+    runs.clear();
+    data_size = 0;
+    file_format = IMAGE_NONE;
+    base_address = 0;
+    has_start = false;
+    start_address = 0;
+    line_nr = 0;
+    records = 0;
+    memset(type_records, 0, sizeof(type_records));
+    overlapped.clear();
+    dropChecksums();
+}
+
+/**
+ * @brief      Forget the precomputed checksums, the data has changed.
+ */
+void FlashImage::dropChecksums(void)
+{
+    sums_sector_size = 0;
+    sector_sums.clear();
+    sums_block_size = 0;
+    block_sums.clear();
+    content_known = false;
+}
+
+/**
+ * @brief      Compute the sector, block and content checksums once, so
+ *             that later calls with the same sizes only copy them.  The
+ *             image cache stores them with the data.
+ */
+void FlashImage::precomputeChecksums(u_int32_t sector_size, u_int32_t block_size)
+{
+    dropChecksums();
+    sectorChecksums(sector_size, sector_sums);
+    blockChecksums(block_size, block_sums);
+    content_crc = contentChecksum();
+    sums_sector_size = sector_size;
+    sums_block_size = block_size;
+    content_known = true;
+}
+
+bool FlashImage::isEmpty(void) const
+{
+    return runs.empty();
+}
+
+const FlashImage::BlockMap &FlashImage::blocks(void) const
+{
+    return runs;
+}
+
+/**
+ * @brief      Number of payload bytes in the image.
+ */
+u_int32_t FlashImage::size(void) const
+{
+    return data_size;
+}
+
+/**
+ * @brief      Number of payload bytes the image holds in an address range.
+ */
+u_int32_t FlashImage::bytesIn(u_int32_t start, u_int32_t len) const
+{
+    BlockMap::const_iterator run = runs.upper_bound(start);
+    u_int32_t end = start + len, total = 0, lo, hi;
+
+    if (run != runs.begin())
+        --run;
+    for (; (run != runs.end()) && (run->first < end); ++run)
+    {
+        lo = (run->first > start) ? run->first : start;
+        hi = run->first + run->second.size();
+        if (hi > end)
+            hi = end;
+        if (hi > lo)
+            total += hi - lo;
+    }
+    return total;
+}
+
+/**
+ * @brief      Number of data records the image was read from.
+ */
+u_int32_t FlashImage::recordCount(void) const
+{
+    return records;
+}
+
+/**
+ * @brief      Number of records of one type the image was read from.
+ */
+u_int32_t FlashImage::recordsOfType(int type) const
+{
+    return ((type >= 0) && (type < FLASHIMAGE_RECORD_TYPES)) ? type_records[type] : 0;
+}
+
+IMAGE_FORMAT FlashImage::format(void) const
+{
+    return file_format;
+}
+
+const char *FlashImage::formatName(void) const
+{
+    switch (file_format)
+    {
+    case IMAGE_INTEL_HEX: return "Intel HEX";
+    case IMAGE_SREC: return "S-record";
+    case IMAGE_BINARY: return "binary";
+    default: return "none";
+    }
+}
+
+/**
+ * @brief      The file named an entry point.  The loader does not use it,
+ *             it is kept for reports.
+ */
+bool FlashImage::hasStartAddress(void) const
+{
+    return has_start;
+}
+
+u_int32_t FlashImage::startAddress(void) const
+{
+    return start_address;
+}
+
+/**
+ * @brief      Address ranges that more than one record wrote, in the order
+ *             they were found.  The later record's data is kept.
+ */
+const FlashImage::RangeList &FlashImage::overlaps(void) const
+{
+    return overlapped;
+}
+
+/**
+ * @brief      Line number (starting at 1) of the record that made load()
+ *             fail.
+ */
+int FlashImage::errorLine(void) const
+{
+    return line_nr;
+}
+
+/**
+ * @brief      CRC-16 of every flash sector the image puts data into.  Bytes
+ *             of a sector the image does not cover count as erased (0xFF),
+ *             which is what the sector holds after programming.
+ *
+ * @param[in]  sector_size  The sector size, a power of two up to 64k
+ * @param      sums         Receives the CRC of each sector by sector address
+ */
+void FlashImage::sectorChecksums(u_int32_t sector_size, SectorMap &sums) const
+{
+    std::vector<u_int8_t> sector(sector_size, 0xFF);
+    BlockMap::const_iterator run;
+    u_int32_t address, end, base, current = 0, n;
+    bool open = false;
+
+    if (sector_size == sums_sector_size)
+    {
+        sums = sector_sums;
+        return;
+    }
+
+    sums.clear();
+    for (run = runs.begin(); run != runs.end(); ++run)
+    {
+        end = run->first + run->second.size();
+        for (address = run->first; address < end; address += n)
+        {
+            base = address & ~(sector_size - 1);
+            if (!open || (base != current))
+            {
+                if (open)
+                    sums[current] = crc16_update(CRC16_INIT, &sector[0], sector_size);
+                sector.assign(sector_size, 0xFF);
+                current = base;
+                open = true;
+            }
+            n = ((end < base + sector_size) ? end : base + sector_size) - address;
+            memcpy(&sector[address - base], &run->second[address - run->first], n);
+        }
+    }
+    if (open)
+        sums[current] = crc16_update(CRC16_INIT, &sector[0], sector_size);
+}
+
+/**
+ * @brief      CRC-16 of every piece of a run within one aligned block, the
+ *             pieces a verification compares, keyed by their address.
+ *
+ * @param[in]  block_size  The block size, a power of two
+ * @param      sums        Receives the CRC of each piece
+ */
+void FlashImage::blockChecksums(u_int32_t block_size, SectorMap &sums) const
+{
+    BlockMap::const_iterator run;
+    u_int32_t address, end, limit;
+
+    if (block_size == sums_block_size)
+    {
+        sums = block_sums;
+        return;
+    }
+
+    sums.clear();
+    for (run = runs.begin(); run != runs.end(); ++run)
+    {
+        end = run->first + run->second.size();
+        for (address = run->first; address < end; address = limit)
+        {
+            limit = (address & ~(block_size - 1)) + block_size;
+            if (limit > end)
+                limit = end;
+            sums[address] = crc16_update(CRC16_INIT, &run->second[address - run->first], limit - address);
+        }
+    }
+}
+
+/**
+ * @brief      CRC-16 of an address range as the flash holds it once the
+ *             image is programmed; bytes the image does not cover count as
+ *             erased (0xFF).
+ */
+u_int16_t FlashImage::rangeChecksum(u_int32_t start, u_int32_t len) const
+{
+    u_int8_t blank[256];
+    BlockMap::const_iterator run = runs.upper_bound(start);
+    u_int32_t address = start, end = start + len, lo, hi, n;
+    u_int16_t crc = CRC16_INIT;
+
+    memset(blank, 0xFF, sizeof(blank));
+
+    if (run != runs.begin())
+        --run;
+    for (; (run != runs.end()) && (run->first < end) && (address < end); ++run)
+    {
+        hi = run->first + run->second.size();
+        if (hi <= address)
+            continue;
+        lo = (run->first > address) ? run->first : address;
+        for (; address < lo; address += n)
+        {
+            n = (lo - address < sizeof(blank)) ? lo - address : sizeof(blank);
+            crc = crc16_update(crc, blank, n);
+        }
+        if (hi > end)
+            hi = end;
+        crc = crc16_update(crc, &run->second[lo - run->first], hi - lo);
+        address = hi;
+    }
+    for (; address < end; address += n)
+    {
+        n = (end - address < sizeof(blank)) ? end - address : sizeof(blank);
+        crc = crc16_update(crc, blank, n);
+    }
+    return crc;
+}
+
+/**
+ * @brief      CRC-16 over the addresses and data of all runs, telling one
+ *             image from another.
+ */
+u_int16_t FlashImage::contentChecksum(void) const
+{
+    BlockMap::const_iterator run;
+    u_int8_t address[4];
+    u_int16_t crc = CRC16_INIT;
+
+    if (content_known)
+        return content_crc;
+
+    for (run = runs.begin(); run != runs.end(); ++run)
+    {
+        address[0] = run->first >> 24;
+        address[1] = run->first >> 16;
+        address[2] = run->first >> 8;
+        address[3] = run->first;
+        crc = crc16_update(crc, address, sizeof(address));
+        crc = crc16_update(crc, &run->second[0], run->second.size());
+    }
+    return crc;
+}
+
+/**
+ * @brief      Parse and checksum a complete Intel HEX or S-record file in
+ *             one pass, line by line; the first record decides the format.
+ *             Nothing is kept unless every record is valid and the end
+ *             record is present.
+ *
+ * @param[in]  path    The firmware file
+ * @param      errors  NULL to stop at the first bad record, else receives
+ *                     every bad record; the valid ones are kept then
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be read, else the
+ *             _GLOBAL_ERROR_CODES of the first bad record (see errorLine()).
+ */
+int FlashImage::load(const char *path, std::vector<RecordError> *errors)
+{
+    FILE *fp;
+    char *ln = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int status = NO_ERROR, first_error = NO_ERROR, first_line = 0;
+    RecordError bad;
+
+    clear();
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    while ((status != STATUS_FW_SUCCESS) && ((len = getline(&ln, &cap, fp)) > 0))
+    {
+        line_nr++;
+        while ((len > 0) && isspace((unsigned char)ln[len - 1]))
+            len--;
+        if (len == 0)
+            continue;				// tolerate empty lines
+
+        if (file_format == IMAGE_NONE)
+            file_format = (ln[0] == 'S') ? IMAGE_SREC : IMAGE_INTEL_HEX;
+        if (file_format == IMAGE_SREC)
+            status = parseSRecord(ln, len);
+        else
+            status = parseRecord(ln, len);
+        if ((status == NO_ERROR) || (status == STATUS_NO_WRITE) || (status == STATUS_FW_SUCCESS))
+            continue;
+        if (errors == NULL)
+            break;
+
+        bad.line = line_nr;
+        bad.status = status;
+        errors->push_back(bad);
+        if (first_error == NO_ERROR)
+        {
+            first_error = status;
+            first_line = line_nr;
+        }
+        status = NO_ERROR;			// go on with the next record
+    }
+
+    if (ln)
+        free(ln);
+    fclose(fp);
+
+    if ((status == NO_ERROR) || (status == STATUS_NO_WRITE))
+    {
+        line_nr++;
+        status = ERR_FW_DECODE;		// end record missing, file is truncated
+        if (errors)
+        {
+            bad.line = line_nr;
+            bad.status = status;
+            errors->push_back(bad);
+        }
+    }
+    else if (status == STATUS_FW_SUCCESS)
+        status = NO_ERROR;
+
+    if (first_error != NO_ERROR)
+    {
+        status = first_error;
+        line_nr = first_line;
+    }
+    if ((status != NO_ERROR) && (errors == NULL))
+    {
+        runs.clear();
+        data_size = 0;
+    }
+    return status;
+}
+
+/**
+ * @brief      Write one Intel HEX record.
+ */
+static void writeRecord(FILE *fp, u_int8_t type, u_int16_t offset, const u_int8_t *data, int len)
+{
+    u_int8_t sum = len + (offset >> 8) + (offset & 0xFF) + type;
+    int i;
+
+    fprintf(fp, ":%02X%04X%02X", len, offset, type);
+    for (i = 0; i < len; i++)
+    {
+        fprintf(fp, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(fp, "%02X\r\n", (u_int8_t)(0x100 - sum));
+}
+
+/**
+ * @brief      Write the image as an Intel HEX file that load() reads back:
+ *             a segment record ahead of every segment's data, data records
+ *             of FLASHIMAGE_HEX_RECORD bytes and the end record.
+ *
+ * @param[in]  path  The file to write
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be written.
+ */
+int FlashImage::save(const char *path) const
+{
+    BlockMap::const_iterator run;
+    u_int8_t segment[2] = {0, 0};
+    u_int32_t address, end;
+    int n, status;
+    bool first = true;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+
+    for (run = runs.begin(); run != runs.end(); ++run)
+    {
+        end = run->first + run->second.size();
+        if (first || (segmentOf(run->first) != segment[1]))
+        {
+            segment[1] = segmentOf(run->first);
+            writeRecord(fp, 4, 0, segment, 2);
+            first = false;
+        }
+        for (address = run->first; address < end; address += n)
+        {
+            n = (end - address > FLASHIMAGE_HEX_RECORD) ? FLASHIMAGE_HEX_RECORD : end - address;
+            writeRecord(fp, 0, offsetOf(address), &run->second[address - run->first], n);
+        }
+    }
+    writeRecord(fp, 1, 0, NULL, 0);
+
+    status = ferror(fp) ? -1 : NO_ERROR;
+    if (fclose(fp) != 0)
+        status = -1;
+    return status;
+}
+
+/**
+ * @brief      Copy an address range as the flash holds it once the image is
+ *             programmed; bytes the image does not cover are erased (0xFF).
+ *
+ * @param[in]  start  The address of the first byte
+ * @param[in]  len    The number of bytes
+ * @param      out    Receives len bytes
+ */
+void FlashImage::copyRange(u_int32_t start, u_int32_t len, u_int8_t *out) const
+{
+    BlockMap::const_iterator run = runs.upper_bound(start);
+    u_int32_t end = start + len, lo, hi;
+
+    memset(out, 0xFF, len);
+    if (run != runs.begin())
+        --run;
+    for (; (run != runs.end()) && (run->first < end); ++run)
+    {
+        lo = (run->first > start) ? run->first : start;
+        hi = run->first + run->second.size();
+        if (hi > end)
+            hi = end;
+        if (hi > lo)
+            memcpy(&out[lo - start], &run->second[lo - run->first], hi - lo);
+    }
+}
+
+/**
+ * @brief      Write an address range as a raw binary file, bytes the image
+ *             does not cover as erased (0xFF).
+ *
+ * @param[in]  path   The file to write
+ * @param[in]  start  The address of the first byte of the file
+ * @param[in]  len    The file length
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be written.
+ */
+int FlashImage::saveBinary(const char *path, u_int32_t start, u_int32_t len) const
+{
+    std::vector<u_int8_t> out(len);
+    int status;
+    FILE *fp;
+
+    copyRange(start, len, &out[0]);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+        return -1;
+    status = (fwrite(&out[0], 1, len, fp) == len) ? NO_ERROR : -1;
+    if (fclose(fp) != 0)
+        status = -1;
+    return status;
+}
+
+/**
+ * @brief      Decode one Intel HEX record and apply it to the image.
+ *
+ * @param[in]  record  The record text without line terminator
+ * @param[in]  len     The record text length
+ *
+ * @return     NO_ERROR for data, STATUS_NO_WRITE for a segment record,
+ *             STATUS_FW_SUCCESS for the end record, else an error code.
+ */
+int FlashImage::parseRecord(const char *record, int len)
+{
+    HexRecord rec;
+    int status = HexDecoder::decodeRecord(record, len, &rec);
+
+    if (status != NO_ERROR)
+        return status;
+
+    if (rec.type < FLASHIMAGE_RECORD_TYPES)
+        type_records[rec.type]++;
+    switch (rec.type)
+    {
+    case 0:									// data record
+        addData(base_address + rec.offset, rec.data(), rec.length);
+        records++;
+        return NO_ERROR;
+    case 1:									// end record
+        return STATUS_FW_SUCCESS;
+    case 2:									// extended segment address, paragraphs
+    case 4:									// extended linear address, upper 16 bits
+        if ((rec.length != 2) || (rec.offset != 0))
+            return ERR_FW_DECODE;
+        base_address = (rec.data()[0] << 8) | rec.data()[1];
+        base_address <<= (rec.type == 2) ? 4 : 16;
+        return STATUS_NO_WRITE;
+    case 3:									// start segment address, CS:IP
+    case 5:									// start linear address
+        if ((rec.length != 4) || (rec.offset != 0))
+            return ERR_FW_DECODE;
+        start_address = ((u_int32_t)rec.data()[0] << 24) | (rec.data()[1] << 16) |
+                        (rec.data()[2] << 8) | rec.data()[3];
+        if (rec.type == 3)
+            start_address = ((start_address >> 16) << 4) + (start_address & 0xFFFF);
+        has_start = true;
+        return STATUS_NO_WRITE;
+    default:
+        return ERR_FW_DECODE;				// only 00 to 05 are valid types
+    }
+}
+
+/**
+ * @brief      Decode one S-record and apply it to the image.  A count
+ *             record must match the data records read so far.
+ *
+ * @param[in]  record  The record text without line terminator
+ * @param[in]  len     The record text length
+ *
+ * @return     NO_ERROR for data, STATUS_NO_WRITE for a header or count
+ *             record, STATUS_FW_SUCCESS for a termination record, else an
+ *             error code.
+ */
+int FlashImage::parseSRecord(const char *record, int len)
+{
+    SRecord rec;
+    int status = HexDecoder::decodeSRecord(record, len, &rec);
+
+    if (status != NO_ERROR)
+        return status;
+
+    type_records[rec.type]++;
+    switch (rec.type)
+    {
+    case 0:									// header, free text
+        return STATUS_NO_WRITE;
+    case 1:									// data, 16, 24 or 32 bit address
+    case 2:
+    case 3:
+        addData(rec.address, rec.data(), rec.length);
+        records++;
+        return NO_ERROR;
+    case 5:									// count of the data records so far
+    case 6:
+        if ((rec.length != 0) || (rec.address != records))
+            return ERR_FW_DECODE;
+        return STATUS_NO_WRITE;
+    default:								// S7 to S9, termination with entry point
+        if (rec.length != 0)
+            return ERR_FW_DECODE;
+        start_address = rec.address;
+        has_start = true;
+        return STATUS_FW_SUCCESS;
+    }
+}
+
+/**
+ * @brief      Read a raw binary image, the file's first byte going to base.
+ *             The file is read in chunks straight into the runs; erased
+ *             padding is kept like any other data and skipped when writing.
+ *
+ * @param[in]  path  The firmware file
+ * @param[in]  base  The address of the file's first byte
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be read.
+ */
+int FlashImage::loadBinary(const char *path, u_int32_t base)
+{
+    u_int8_t chunk[FLASHIMAGE_BINARY_CHUNK];
+    u_int32_t address = base;
+    size_t n;
+    FILE *fp;
+    int status;
+
+    clear();
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    file_format = IMAGE_BINARY;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        addData(address, chunk, n);
+        address += n;
+    }
+    status = ferror(fp) ? -1 : NO_ERROR;
+    fclose(fp);
+
+    if (status != NO_ERROR)
+        clear();
+    return status;
+}
+
+/**
+ * @brief      Store data at a linear address, merging it with adjacent or
+ *             overlapping runs of the same segment.  Later data wins.
+ */
+void FlashImage::addData(u_int32_t address, const u_int8_t *data, int len)
+{
+    u_int32_t end, first, last, lo, hi;
+    BlockMap::iterator it, next;
+
+    if (len <= 0)
+        return;
+    if (content_known)
+        dropChecksums();
+
+    // 16 bit offsets wrap at the end of the segment, keep the runs apart
+    if (offsetOf(address) + len > 0x10000)
+    {
+        int head = 0x10000 - offsetOf(address);
+        addData(address, data, head);
+        addData(address + head, data + head, len - head);
+        return;
+    }
+    end = address + len;
+
+    it = runs.upper_bound(address);
+    next = it;
+    if (it != runs.begin())
+    {
+        --it;
+        if ((it->first + it->second.size() < address) || (segmentOf(it->first) != segmentOf(address)))
+            it = next;
+    }
+
+    // common case: the data extends the previous run and touches nothing else
+    if ((it != runs.end()) && (it->first + it->second.size() == address) &&
+        ((next == runs.end()) || (next->first > end) || (segmentOf(next->first) != segmentOf(address))))
+    {
+        it->second.insert(it->second.end(), data, data + len);
+        data_size += len;
+        return;
+    }
+
+    // general case: rebuild one run from everything the data touches
+    first = address;
+    last = end;
+    next = it;
+    while ((next != runs.end()) && (next->first <= end) && (segmentOf(next->first) == segmentOf(address)))
+    {
+        if (next->first < first)
+            first = next->first;
+        if (next->first + next->second.size() > last)
+            last = next->first + next->second.size();
+        ++next;
+    }
+
+    std::vector<u_int8_t> merged(last - first);
+    for (BlockMap::iterator r = it; r != next; ++r)
+    {
+        memcpy(&merged[r->first - first], &r->second[0], r->second.size());
+        data_size -= r->second.size();
+
+        // a run only touching the new data is merged, one sharing bytes is overwritten
+        lo = (r->first > address) ? r->first : address;
+        hi = r->first + r->second.size();
+        if (hi > end)
+            hi = end;
+        if (hi > lo)
+            overlapped.push_back(std::make_pair(lo, hi - lo));
+    }
+    memcpy(&merged[address - first], data, len);
+    data_size += merged.size();
+
+    runs.erase(it, next);
+    runs[first].swap(merged);
+}
+
+/*! @} */
@@ -0,0 +1,311 @@
+/**
+  *****************************************************************************
+  * @file gpioline.cpp
+  * @brief GPIO lines held open for the life of the flasher.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "gpioline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+GpioLine::GpioLine()
+{
+    fd = -1;
+    chardev = false;
+    number = 0;
+    direction = PIN_INPUT;
+    level = PIN_LOW;
+}
+
+GpioLine::~GpioLine()
+{
+    release();
+}
+
+/**
+ * @brief      Take the pin and drive it to its initial value.
+ *
+ * @param[in]  pin      The global pin number
+ * @param[in]  dir      The pin direction
+ * @param[in]  initial  The value of an output once requested
+ *
+ * @return     0 on success, -1 if neither interface gives out the pin.
+ */
+int GpioLine::request(u_int16_t pin, PIN_DIRECTION dir, PIN_VALUE initial)
+{
+    closeLine();
+    number = pin;
+    direction = dir;
+    level = initial;
+
+    if (requestCharDev(dir, initial) == 0)
+        return 0;
+    return requestSysfs(dir, initial);
+}
+
+/**
+ * @brief      Give the pin back.  A sysfs pin stays exported with its last
+ *             value.  The kernel does not promise anything about a line
+ *             once its handle is closed, so an output taken through the
+ *             character device is handed over to sysfs and driven to its
+ *             last value there: the module must stay out of reset and out
+ *             of boot mode after the flasher exits.
+ */
+void GpioLine::release(void)
+{
+    bool hand_over = chardev && (direction == PIN_OUTPUT) && (fd >= 0);
+
+    closeLine();
+    if (hand_over && (requestSysfs(PIN_OUTPUT, level) == 0))
+        closeLine();
+}
+
+/**
+ * @brief      Close the line handle or value file, leaving the pin as the
+ *             interface it came from leaves it.
+ */
+void GpioLine::closeLine(void)
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    chardev = false;
+}
+
+/**
+ * @brief      Drive the pin: one ioctl on the line handle or one write to
+ *             the sysfs value file.
+ *
+ * @return     0 on success, -1 on failure.
+ */
+int GpioLine::set(PIN_VALUE value)
+{
+    if (fd < 0)
+        return -1;
+
+#ifdef GPIOHANDLE_SET_LINE_VALUES_IOCTL
+    if (chardev)
+    {
+        struct gpiohandle_data data;
+
+        memset(&data, 0, sizeof(data));
+        data.values[0] = (value == PIN_HIGH) ? 1 : 0;
+        if (ioctl(fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0)
+            return -1;
+        level = value;
+        return 0;
+    }
+#endif
+    if (pwrite(fd, (value == PIN_HIGH) ? "1" : "0", 1, 0) != 1)
+        return -1;
+    level = value;
+    return 0;
+}
+
+/**
+ * @brief      Read the pin.
+ *
+ * @return     0 or 1, -1 on failure.
+ */
+int GpioLine::get(void)
+{
+    char pin_val;
+
+    if (fd < 0)
+        return -1;
+
+#ifdef GPIOHANDLE_GET_LINE_VALUES_IOCTL
+    if (chardev)
+    {
+        struct gpiohandle_data data;
+
+        if (ioctl(fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+            return -1;
+        return data.values[0] ? 1 : 0;
+    }
+#endif
+    if (pread(fd, &pin_val, 1, 0) != 1)
+        return -1;
+    return (pin_val == '0') ? 0 : 1;
+}
+
+bool GpioLine::isRequested(void) const
+{
+    return fd >= 0;
+}
+
+bool GpioLine::isCharDev(void) const
+{
+    return chardev;
+}
+
+u_int16_t GpioLine::pin(void) const
+{
+    return number;
+}
+
+/**
+ * @brief      Find the character device and line offset of a global pin
+ *             number.  Every chip in SYSFS_GPIO_DIR names its first pin in
+ *             base and its line count in ngpio, and lists its character
+ *             device under device/.
+ *
+ * @return     true if the chip holding the pin was found.
+ */
+bool GpioLine::findChip(u_int16_t pin, std::string &device, u_int32_t *offset)
+{
+    char path[PATH_MAX];
+    DIR *chips, *dev;
+    struct dirent *entry, *node;
+    unsigned int base, ngpio;
+    bool found = false;
+    FILE *fp;
+
+    chips = opendir(SYSFS_GPIO_DIR);
+    if (chips == NULL)
+        return false;
+
+    while (!found && ((entry = readdir(chips)) != NULL))
+    {
+        if (strncmp(entry->d_name, "gpiochip", 8))
+            continue;
+
+        base = ngpio = 0;
+        snprintf(path, sizeof(path), "%s/%s/base", SYSFS_GPIO_DIR, entry->d_name);
+        if ((fp = fopen(path, "r")) != NULL)
+        {
+            if (fscanf(fp, "%u", &base) != 1)
+                base = 0;
+            fclose(fp);
+        }
+        snprintf(path, sizeof(path), "%s/%s/ngpio", SYSFS_GPIO_DIR, entry->d_name);
+        if ((fp = fopen(path, "r")) != NULL)
+        {
+            if (fscanf(fp, "%u", &ngpio) != 1)
+                ngpio = 0;
+            fclose(fp);
+        }
+        if ((pin < base) || (pin >= base + ngpio))
+            continue;
+
+        // the sysfs name carries the base, the character device its index
+        snprintf(path, sizeof(path), "%s/%s/device", SYSFS_GPIO_DIR, entry->d_name);
+        if ((dev = opendir(path)) == NULL)
+            break;
+        while ((node = readdir(dev)) != NULL)
+        {
+            if (!strncmp(node->d_name, "gpiochip", 8))
+            {
+                device = std::string("/dev/") + node->d_name;
+                *offset = pin - base;
+                found = true;
+                break;
+            }
+        }
+        closedir(dev);
+        break;
+    }
+    closedir(chips);
+    return found;
+}
+
+/**
+ * @brief      Request the pin as a line handle of its GPIO chip.
+ *
+ * @return     0 on success, -1 if the kernel or the headers lack the
+ *             character device or the line is not available.
+ */
+int GpioLine::requestCharDev(PIN_DIRECTION dir, PIN_VALUE initial)
+{
+#ifdef GPIOHANDLE_REQUEST_OUTPUT
+    struct gpiohandle_request req;
+    std::string device;
+    u_int32_t offset;
+    int chip;
+
+    if (!findChip(number, device, &offset))
+        return -1;
+    chip = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+    if (chip < 0)
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffsets[0] = offset;
+    req.lines = 1;
+    req.flags = (dir == PIN_OUTPUT) ? GPIOHANDLE_REQUEST_OUTPUT : GPIOHANDLE_REQUEST_INPUT;
+    req.default_values[0] = (initial == PIN_HIGH) ? 1 : 0;
+    strncpy(req.consumer_label, GPIO_CONSUMER, sizeof(req.consumer_label) - 1);
+
+    if (ioctl(chip, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0)
+    {
+        close(chip);
+        return -1;
+    }
+    close(chip);					// the line handle lives on by itself
+
+    fd = req.fd;
+    chardev = true;
+    return 0;
+#else
+    (void)dir;
+    (void)initial;
+    return -1;
+#endif
+}
+
+/**
+ * @brief      Export the pin through sysfs and keep its value file open.
+ *
+ * @return     0 on success, -1 if the value file can not be opened.
+ */
+int GpioLine::requestSysfs(PIN_DIRECTION dir, PIN_VALUE initial)
+{
+    char path[PATH_MAX], value[8];
+
+    snprintf(value, sizeof(value), "%d", number);
+    writeSysfs(SYSFS_GPIO_DIR "/export", value);	// fails harmlessly if exported already
+
+    // "high"/"low" set direction and value in one step, without a glitch
+    snprintf(path, sizeof(path), "%s/gpio%d/direction", SYSFS_GPIO_DIR, number);
+    if (dir == PIN_OUTPUT)
+        writeSysfs(path, (initial == PIN_HIGH) ? "high" : "low");
+    else
+        writeSysfs(path, "in");
+
+    snprintf(path, sizeof(path), "%s/gpio%d/value", SYSFS_GPIO_DIR, number);
+    fd = open(path, ((dir == PIN_OUTPUT) ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    chardev = false;
+    return (fd < 0) ? -1 : 0;
+}
+
+/**
+ * @brief      Write a value to a sysfs attribute.
+ *
+ * @return     0 on success, -1 on failure.
+ */
+int GpioLine::writeSysfs(const char *path, const char *value)
+{
+    int fd, len = strlen(value), wrote;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    wrote = write(fd, value, len);
+    close(fd);
+    return (wrote == len) ? 0 : -1;
+}
+
+/*! @} */
@@ -0,0 +1,72 @@
+#ifndef BOOTCODE_H
+#define BOOTCODE_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include "phytecprotocol.h"
+
+#define BOOTCODE_MAGIC "SCTNBSL"		// 7 characters and the terminating 0
+#define BOOTCODE_FORMAT 1
+#define BOOTCODE_HEADER 16				// bytes ahead of the code
+#define BOOTCODE_MAX_SIZE 0x800			// most boot code the target's internal RAM takes
+#define BOOTCODE_SUFFIX ".bsl"			// loader files picked up from a directory
+#define BOOTCODE_BUILTIN_VERSION 1		// version of the loader built into the flasher
+
+/**
+ * One variant of the boot code: the level 1 code the bootstrap loader
+ * takes in its first PHYTEC_BOOT_CHUNK bytes, and the level 2 loader that
+ * code reads after it.  Each variant names the bootstrap identification
+ * byte of the derivative it runs on and carries a version, so a faster
+ * loader can be dropped next to the flasher instead of being built in.
+ *
+ * The file is big-endian: magic, format, loader version, bootstrap ID, a
+ * reserved byte, code length, the code, and a CRC-16 over all of it.
+ */
+class BootCode
+{
+public:
+    BootCode();
+
+    int load(const char *path);
+    int save(const char *path) const;
+    int assign(const u_int8_t *data, u_int32_t len, u_int8_t bsl_id, u_int16_t version);
+    u_int8_t bslId(void) const;
+    u_int16_t version(void) const;
+    u_int16_t checksum(void) const;
+    u_int32_t size(void) const;
+    const u_int8_t *levelOne(void) const;
+    const u_int8_t *levelTwo(void) const;
+    u_int32_t levelTwoSize(void) const;
+    const char *origin(void) const;
+
+private:
+    std::vector<u_int8_t> code;
+    u_int8_t id;
+    u_int16_t loader_version;
+    u_int16_t crc;						// CRC-16 of the code alone
+    std::string source;					// file it came from, "built-in" for the default
+};
+
+/**
+ * The boot code variants the flasher can send: the built-in one and any
+ * loaded from files.  The target's answer to the bootstrap sync selects
+ * among them.
+ */
+class BootCodeSet
+{
+public:
+    BootCodeSet();
+
+    int add(const char *path);
+    const BootCode *select(u_int8_t bsl_id) const;
+    const std::vector<BootCode> &variants(void) const;
+
+private:
+    std::vector<BootCode> list;
+
+    int addFile(const char *path);
+};
+
+#endif // BOOTCODE_H
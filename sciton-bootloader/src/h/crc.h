@@ -0,0 +1,10 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <sys/types.h>
+
+#define CRC16_INIT 0xFFFF
+
+u_int16_t crc16_update(u_int16_t crc, const u_int8_t *data, u_int32_t len);
+
+#endif // CRC_H
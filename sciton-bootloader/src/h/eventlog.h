@@ -0,0 +1,55 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <sys/types.h>
+#include <string>
+
+/**
+ * One event as a JSON object under construction.  Fields keep the order
+ * they are added in; keys are plain identifiers and are not escaped.
+ */
+class EventRecord
+{
+public:
+    EventRecord(const char *event);
+
+    EventRecord &str(const char *key, const char *value);
+    EventRecord &num(const char *key, long long value);
+    EventRecord &real(const char *key, double value);
+    EventRecord &flag(const char *key, bool value);
+    EventRecord &hex(const char *key, u_int32_t value);
+    const std::string &fields(void) const;
+    const char *name(void) const;
+
+private:
+    std::string event;
+    std::string body;			// ,"key":value pairs
+
+    void key(const char *key);
+};
+
+/**
+ * Machine readable progress: one JSON object per line, written with a
+ * single write() each so that several modules can share one log.  Every
+ * line carries the wall clock time "t" in seconds and the "event" name.
+ */
+class EventLog
+{
+public:
+    EventLog();
+    ~EventLog();
+
+    int open(const char *path);
+    void attach(int fd);
+    bool isOpen(void) const;
+    void write(const EventRecord &record);
+
+private:
+    int fd;						// log descriptor, -1 if none
+    bool owned;					// opened here, closed on destruction
+
+    EventLog(const EventLog &);
+    EventLog &operator=(const EventLog &);
+};
+
+#endif // EVENTLOG_H
@@ -0,0 +1,84 @@
+#ifndef FLASHER_H
+#define FLASHER_H
+
+#include <QObject>
+
+#include "phytecmodule.h"
+#include "flashimage.h"
+#include "imagedelta.h"
+#include "bootcode.h"
+#include "transport.h"
+#include "eventlog.h"
+
+/**
+ * Where a run stands, as handed to a FlashCallback.
+ */
+typedef struct
+{
+    FLASH_STATE state;					// step of the connect and update
+    u_int32_t bytes_done;				// bytes the target acknowledged, or a dump read
+    u_int32_t bytes_total;				// bytes the run writes or reads, 0 before programming
+} FlashProgress;
+
+/**
+ * Called on every state change and every acknowledged block.  Returning
+ * false cancels the run, which then ends with PHYTEC_RESULT_CANCELLED.
+ */
+typedef bool (*FlashCallback)(const FlashProgress *progress, void *context);
+
+/**
+ * In-process API of the flashing core, for applications that update the
+ * module themselves instead of starting sciton-bootloader.  The caller
+ * brings the parsed image, the link to the module and a callback; every
+ * call runs the whole connect and update in a local event loop, so the
+ * caller's own event loop keeps running, and returns its result.  One
+ * run at a time: a call made while another is in progress, from the
+ * callback or from a slot of the caller, returns PHYTEC_RESULT_BUSY.
+ *
+ *   FlashImage image;
+ *   Transport *link = Transport::create("/dev/ttymxc4");
+ *   Flasher flasher(link);
+ *
+ *   image.load("/run/media/sda1/G2H1.H86");
+ *   flasher.setCallback(showProgress, this);
+ *   result = flasher.update(image);
+ */
+class Flasher : public QObject
+{
+    Q_OBJECT
+
+private:
+    Transport *link;					// the caller's link to the module
+    u_int16_t boot_pin;					// GPIO on the module's boot pin
+    u_int16_t reset_pin;				// GPIO on the module's reset pin
+    FlashCallback callback;				// NULL for none
+    void *context;						// handed back to callback
+    EventLog *events;					// NULL for none
+    const BootCodeSet *loaders;			// NULL for the built-in boot code
+    PhytecModule *module;				// module of the run in progress
+    FlashProgress current;				// last progress reported
+    FlashStats last_stats;				// timing of the last run
+
+    int run(PhytecModule *run_module);
+    void report(void);
+
+private slots:
+    void onState(int state);
+    void onTransferred(u_int32_t done, u_int32_t total);
+
+public:
+    Flasher(Transport *transport, u_int16_t boot = PHYTEC_BOOT_PIN, u_int16_t reset = PHYTEC_RESET_PIN);
+    ~Flasher();
+    void setCallback(FlashCallback function, void *function_context);
+    void setEventLog(EventLog *log);
+    void setLoaders(const BootCodeSet *variants);
+    int update(const FlashImage &image);
+    int applyDelta(const ImageDelta &delta);
+    int dump(u_int32_t start, u_int32_t len, FlashImage &out);
+    const FlashStats &stats(void) const;
+
+public slots:
+    void cancel(void);
+};
+
+#endif // FLASHER_H
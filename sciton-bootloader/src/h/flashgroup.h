@@ -0,0 +1,67 @@
+#ifndef FLASHGROUP_H
+#define FLASHGROUP_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+#include <string>
+#include <vector>
+
+#include "phytecmodule.h"
+
+/**
+ * One module of a group: its serial device and the GPIOs on its boot and
+ * reset pins.
+ */
+typedef struct
+{
+    std::string port;
+    u_int16_t boot_pin;
+    u_int16_t reset_pin;
+} FlashTarget;
+
+/**
+ * Several modules flashed at the same time with one image.  Every target
+ * gets its own PhytecModule state machine; all of them run in the same
+ * event loop and share the parsed image, so adding a target costs one
+ * serial port and a few buffers, not another copy of the firmware.
+ */
+class FlashGroup : public QObject
+{
+    Q_OBJECT
+
+private:
+    const FlashImage *image;
+    std::vector<FlashTarget> targets;
+    std::vector<PhytecModule *> modules;
+    std::vector<int> results;			// result per target, valid once done
+    std::vector<int> reported;			// last progress step printed per target
+    std::vector<bool> done;
+    int running;						// targets still flashing
+    QElapsedTimer clock;
+
+    int indexOf(QObject *module) const;
+
+private slots:
+    void onProgress(int percent);
+    void onFinished(int result);
+
+public:
+    FlashGroup(const FlashImage *shared, const std::vector<FlashTarget> &list);
+    ~FlashGroup();
+    int count( void ) const;
+    int result( int target ) const;
+    const PhytecModule *module( int target ) const;
+    void setDelta( const ImageDelta *delta );
+    void setLoaders( const BootCodeSet *loaders );
+    void setEventLog( EventLog *log );
+
+public slots:
+    void start( void );
+    void cancel( void );
+
+signals:
+    void finished(int failures);
+};
+
+#endif // FLASHGROUP_H
@@ -0,0 +1,102 @@
+#ifndef FLASHIMAGE_H
+#define FLASHIMAGE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+
+#include "phytecdefs.h"
+
+#define FLASHIMAGE_HEX_RECORD 16	// data bytes per record written by save()
+#define FLASHIMAGE_RECORD_TYPES 10	// record types 0 to 9 of either text format
+#define FLASHIMAGE_BINARY_CHUNK 4096	// bytes read at a time from a raw binary
+
+/**
+ * File formats load() and loadBinary() read.
+ */
+typedef enum {
+    IMAGE_NONE = 0,				// nothing loaded
+    IMAGE_INTEL_HEX,			// Intel HEX, record types 00 to 05
+    IMAGE_SREC,					// Motorola S-records, S0 to S9
+    IMAGE_BINARY				// raw binary at a base address
+} IMAGE_FORMAT;
+
+/**
+ * In-memory copy of a firmware image.  The data is kept as runs of
+ * contiguous bytes keyed by their linear address (segment << 16 | offset).
+ * A run never crosses a segment boundary, so every run can be written with
+ * the loader's segment/offset addressing.
+ */
+class FlashImage
+{
+public:
+    typedef std::map<u_int32_t, std::vector<u_int8_t> > BlockMap;
+    typedef std::map<u_int32_t, u_int16_t> SectorMap;
+    typedef std::vector<std::pair<u_int32_t, u_int32_t> > RangeList;
+
+    /**
+     * A record load() found bad while checking the whole file.
+     */
+    typedef struct
+    {
+        int line;				// line number, starting at 1
+        int status;				// _GLOBAL_ERROR_CODES of the record
+    } RecordError;
+
+    FlashImage();
+
+    int load(const char *path, std::vector<RecordError> *errors = NULL);
+    int loadBinary(const char *path, u_int32_t base);
+    int save(const char *path) const;
+    int saveBinary(const char *path, u_int32_t start, u_int32_t len) const;
+    void addData(u_int32_t address, const u_int8_t *data, int len);
+    void clear(void);
+    bool isEmpty(void) const;
+    const BlockMap &blocks(void) const;
+    u_int32_t size(void) const;
+    u_int32_t bytesIn(u_int32_t start, u_int32_t len) const;
+    void copyRange(u_int32_t start, u_int32_t len, u_int8_t *out) const;
+    int errorLine(void) const;
+    u_int32_t recordCount(void) const;
+    u_int32_t recordsOfType(int type) const;
+    IMAGE_FORMAT format(void) const;
+    const char *formatName(void) const;
+    bool hasStartAddress(void) const;
+    u_int32_t startAddress(void) const;
+    const RangeList &overlaps(void) const;
+    void sectorChecksums(u_int32_t sector_size, SectorMap &sums) const;
+    void blockChecksums(u_int32_t block_size, SectorMap &sums) const;
+    void precomputeChecksums(u_int32_t sector_size, u_int32_t block_size);
+    u_int16_t rangeChecksum(u_int32_t start, u_int32_t len) const;
+    u_int16_t contentChecksum(void) const;
+
+    static u_int8_t segmentOf(u_int32_t address) { return (u_int8_t)(address >> 16); }
+    static u_int16_t offsetOf(u_int32_t address) { return (u_int16_t)(address & 0xFFFF); }
+
+private:
+    BlockMap runs;
+    u_int32_t data_size;		// payload bytes held in runs
+    IMAGE_FORMAT file_format;	// format the image was read from
+    u_int32_t base_address;		// added to record offsets, set by type 02 and 04 records
+    bool has_start;				// the file names an entry point
+    u_int32_t start_address;	// entry point from a type 03/05 or S7 to S9 record
+    int line_nr;				// line being parsed, reported on error
+    u_int32_t records;			// data records read
+    u_int32_t type_records[FLASHIMAGE_RECORD_TYPES];	// records read per type
+    RangeList overlapped;		// address and length of data written twice
+    u_int32_t sums_sector_size;	// sector size of sector_sums, 0 if not precomputed
+    SectorMap sector_sums;		// precomputed sectorChecksums()
+    u_int32_t sums_block_size;	// block size of block_sums, 0 if not precomputed
+    SectorMap block_sums;		// precomputed blockChecksums()
+    bool content_known;			// content_crc is precomputed
+    u_int16_t content_crc;		// precomputed contentChecksum()
+
+    friend class ImageCache;
+
+    void dropChecksums(void);
+    int parseRecord(const char *record, int len);
+    int parseSRecord(const char *record, int len);
+};
+
+#endif // FLASHIMAGE_H
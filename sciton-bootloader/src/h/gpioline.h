@@ -0,0 +1,58 @@
+#ifndef GPIOLINE_H
+#define GPIOLINE_H
+
+#include <sys/types.h>
+#include <string>
+
+#define SYSFS_GPIO_DIR "/sys/class/gpio"
+#define GPIO_CONSUMER "sciton-bootloader"	// owner shown by the GPIO character device
+
+typedef enum {
+	PIN_INPUT = 0,
+	PIN_OUTPUT
+} PIN_DIRECTION;
+
+typedef enum {
+	PIN_LOW = 0,
+	PIN_HIGH
+} PIN_VALUE;
+
+/**
+ * One GPIO, requested once and then driven through a descriptor held for
+ * its whole life.  Pins are given by their global (sysfs) number.  The line
+ * is taken from the GPIO character device of the chip it belongs to; where
+ * that is not available the sysfs value file is opened once instead.
+ * Released outputs keep their last value through sysfs.
+ */
+class GpioLine
+{
+public:
+    GpioLine();
+    ~GpioLine();
+
+    int request(u_int16_t pin, PIN_DIRECTION dir, PIN_VALUE initial);
+    void release(void);
+    int set(PIN_VALUE value);
+    int get(void);
+    bool isRequested(void) const;
+    bool isCharDev(void) const;
+    u_int16_t pin(void) const;
+
+private:
+    int fd;						// line handle or sysfs value file, -1 if none
+    bool chardev;				// fd is a character device line handle
+    u_int16_t number;			// global pin number
+    PIN_DIRECTION direction;	// as requested
+    PIN_VALUE level;			// last value driven, kept when released
+
+    void closeLine(void);
+    static bool findChip(u_int16_t pin, std::string &device, u_int32_t *offset);
+    int requestCharDev(PIN_DIRECTION dir, PIN_VALUE initial);
+    int requestSysfs(PIN_DIRECTION dir, PIN_VALUE initial);
+    static int writeSysfs(const char *path, const char *value);
+
+    GpioLine(const GpioLine &);
+    GpioLine &operator=(const GpioLine &);
+};
+
+#endif // GPIOLINE_H
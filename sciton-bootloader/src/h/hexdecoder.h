@@ -0,0 +1,56 @@
+#ifndef HEXDECODER_H
+#define HEXDECODER_H
+
+#include <sys/types.h>
+
+#include "phytecdefs.h"
+
+#define HEX_MAX_RECORD 260		// length, offset, type, 255 data bytes, checksum
+
+/**
+ * One decoded Intel HEX record.  raw holds the record bytes as they appear
+ * in the file, from the length byte up to and including the checksum.
+ */
+typedef struct
+{
+    u_int8_t length;
+    u_int16_t offset;
+    u_int8_t type;
+    u_int8_t raw[HEX_MAX_RECORD];
+
+    const u_int8_t *data(void) const { return raw + 4; }
+} HexRecord;
+
+/**
+ * One decoded Motorola S-record.  raw holds the record bytes from the count
+ * byte up to and including the checksum; the address takes 2, 3 or 4 bytes
+ * depending on the type.
+ */
+typedef struct
+{
+    u_int8_t type;					// record type digit, 0 to 9
+    u_int8_t length;				// data bytes
+    u_int8_t address_bytes;
+    u_int32_t address;
+    u_int8_t raw[HEX_MAX_RECORD];
+
+    const u_int8_t *data(void) const { return raw + 1 + address_bytes; }
+} SRecord;
+
+/**
+ * Intel HEX and S-record text decoding.  Characters are translated through a lookup
+ * table, with an SSE2 or NEON path for long runs, and every character is
+ * checked; nothing here depends on Qt so the decoder can be linked into
+ * tools and benchmarks as well as the flasher.
+ */
+class HexDecoder
+{
+public:
+    static int decodeRecord(const char *text, int len, HexRecord *rec);
+    static int decodeSRecord(const char *text, int len, SRecord *rec);
+    static int decode(const char *text, u_int8_t *out, int n, u_int8_t *sum);
+    static int decodeScalar(const char *text, u_int8_t *out, int n, u_int8_t *sum);
+    static const char *implementation(void);
+};
+
+#endif // HEXDECODER_H
@@ -0,0 +1,79 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <sys/types.h>
+#include <string>
+
+#include "flashimage.h"
+
+#define IMAGECACHE_DIR "/application/sciton-bootloader.cache"
+#define IMAGECACHE_MAGIC "SCTNIMG"		// 7 characters and the terminating 0
+#define IMAGECACHE_VERSION 1
+#define IMAGECACHE_KEEP 4				// cache files kept, the least recently used go
+
+/**
+ * Head of a cache file.  It is followed by a table of (address, length)
+ * per run, the sector and block CRC tables as (address, CRC) pairs and the
+ * run data, in that order.  The file is only read back on the host that
+ * wrote it, so the fields are in host byte order.
+ */
+typedef struct
+{
+    char magic[8];
+    u_int32_t version;
+    u_int32_t format;					// IMAGE_FORMAT of the source file
+    u_int64_t source_hash;				// FNV-1a of the source file and its base
+    u_int64_t payload_hash;				// FNV-1a of everything after this header
+    u_int32_t source_size;
+    u_int32_t runs;
+    u_int32_t data_size;
+    u_int32_t records;
+    u_int32_t sector_size;
+    u_int32_t sectors;
+    u_int32_t block_size;
+    u_int32_t blocks;
+    u_int32_t start_address;
+    u_int16_t content_crc;
+    u_int8_t has_start;
+    u_int8_t reserved;
+} ImageCacheHeader;
+
+/**
+ * An (address, length) or (address, CRC) pair of a cache file table.
+ */
+typedef struct
+{
+    u_int32_t address;
+    u_int32_t value;
+} ImageCacheEntry;
+
+/**
+ * Parsed firmware images kept as compact binary files named by the hash of
+ * their source.  Flashing the same file again maps the cache file and
+ * copies the runs and the precomputed checksums out of it instead of
+ * parsing the text.  A missing, stale or damaged cache file only costs a
+ * normal parse.
+ */
+class ImageCache
+{
+public:
+    ImageCache(const char *dir = IMAGECACHE_DIR);
+
+    int load(const char *path, long base, FlashImage &image, u_int32_t sector_size, u_int32_t block_size);
+    bool wasHit(void) const;
+
+    static u_int64_t hash(const u_int8_t *data, size_t len, u_int64_t seed);
+
+private:
+    std::string cache_dir;				// where the cache files live
+    bool hit;							// the last load() came from the cache
+
+    std::string cachePath(u_int64_t source_hash) const;
+    bool readCache(const std::string &file, u_int64_t source_hash, u_int32_t source_size,
+                   u_int32_t sector_size, u_int32_t block_size, FlashImage &image);
+    void writeCache(const std::string &file, u_int64_t source_hash, u_int32_t source_size,
+                    const FlashImage &image);
+    void prune(void);
+};
+
+#endif // IMAGECACHE_H
@@ -0,0 +1,28 @@
+#ifndef IMAGECHECK_H
+#define IMAGECHECK_H
+
+#include <sys/types.h>
+
+#include "flashimage.h"
+
+#define CHECK_FRAME_BYTES 7			// write command header and checksum, plus the ACK
+#define CHECK_CONNECT_MS 1100		// reset, wake delay, boot code upload and loader start
+#define CHECK_LEGACY_GAP_US 3000	// fixed delay of the original flasher after every block
+
+/**
+ * Write commands an update of a whole image takes with a given block
+ * size, cut the way PhytecModule cuts them.
+ */
+typedef struct
+{
+    u_int32_t blocks;				// write commands sent
+    u_int32_t blank;				// blocks left out because they are erased already
+    u_int32_t line_bytes;			// bytes on the line, commands and acknowledges
+    u_int32_t sectors;				// sectors erased by a full update
+} WritePlan;
+
+void planWrites(const FlashImage &image, int block_size, WritePlan *plan);
+u_int32_t lineTime(u_int32_t bytes, int baud);
+int checkImage(const char *path, long base, int baud, int block_size);
+
+#endif // IMAGECHECK_H
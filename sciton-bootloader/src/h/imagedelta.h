@@ -0,0 +1,68 @@
+#ifndef IMAGEDELTA_H
+#define IMAGEDELTA_H
+
+#include <sys/types.h>
+#include <map>
+#include <vector>
+
+#include "flashimage.h"
+
+#define IMAGEDELTA_MAGIC "SCTNDLT"		// 7 characters and the terminating 0
+#define IMAGEDELTA_VERSION 1
+#define IMAGEDELTA_HEADER 28			// bytes ahead of the sector table
+#define IMAGEDELTA_SECTOR_ENTRY 12		// bytes per sector table entry
+#define IMAGEDELTA_RUN_ENTRY 8			// bytes ahead of the data of every run
+
+#define DELTA_IN_BASE 0x01				// sector flags: the base image has data here
+#define DELTA_IN_TARGET 0x02			// sector flags: the new image has data here
+#define DELTA_CHANGED 0x04				// sector flags: contents differ, the delta carries them
+
+/**
+ * One flash sector either image uses, with its CRC-16 as the flash holds it
+ * under each revision (erased bytes as 0xFF, the loader's sector CRC).
+ */
+typedef struct
+{
+    u_int16_t base_crc;
+    u_int16_t target_crc;
+    u_int8_t flags;
+} DeltaSector;
+
+/**
+ * Difference between two revisions of the firmware, one flash sector at a
+ * time: the complete new contents of every sector that changed and the CRC
+ * of every sector either revision uses, so the flasher can confirm the
+ * target holds the base revision before it writes anything.
+ *
+ * The file is big-endian throughout: the header (magic, version, flags,
+ * sector size, content CRC of both images, sector and run counts), the
+ * sector table (address, base CRC, target CRC, flags), every run of new
+ * data as address, length and bytes, and a CRC-16 over all of it.
+ */
+class ImageDelta
+{
+public:
+    typedef std::map<u_int32_t, DeltaSector> SectorTable;
+
+    ImageDelta();
+
+    void build(const FlashImage &base, const FlashImage &target, u_int32_t sector_size);
+    int load(const char *path);
+    int save(const char *path) const;
+    u_int32_t sectorSize(void) const;
+    u_int16_t baseChecksum(void) const;
+    u_int16_t targetChecksum(void) const;
+    const SectorTable &sectors(void) const;
+    u_int32_t changedSectors(void) const;
+    const FlashImage &changes(void) const;
+    void targetChecksums(FlashImage::SectorMap &sums) const;
+
+private:
+    u_int32_t sector_size;				// 0 until built or loaded
+    u_int16_t base_crc;					// contentChecksum() of the base image
+    u_int16_t target_crc;				// contentChecksum() of the new image
+    SectorTable table;					// every sector either image uses
+    FlashImage data;					// new contents of the changed sectors
+};
+
+#endif // IMAGEDELTA_H
@@ -0,0 +1,17 @@
+#ifndef PHYTECDEFS_H
+#define PHYTECDEFS_H
+
+typedef enum
+{
+	NO_ERROR = 0,					// No Error, line written
+	STATUS_NO_WRITE,				// No Error, NO line written
+	STATUS_FW_SUCCESS,				// Final Firmware line OK
+	ERR_FW_BAD_LINE,				// Firmware line has bad cookie
+	ERR_FW_DECODE,					// Firmware line has bad record type
+	ERR_FW_CHKSUM,					// Firmware line has bad checksum
+	ERR_FW_VERIFY,					// Firmware verify error
+	ERR_FW_ACK,						// Firmware line not acknowledged
+	ERR_FW_CHAR,					// Firmware line has non-hex character
+} _GLOBAL_ERROR_CODES;
+
+#endif // PHYTECDEFS_H
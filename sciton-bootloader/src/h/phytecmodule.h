@@ -3,6 +3,10 @@
 
 #include <QObject>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QEventLoop>
 #include <QtSerialPort/QtSerialPort>
 
 #include <iostream>
@@ -11,67 +15,281 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <termios.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <deque>
+#include <string>
+
+#include "phytecdefs.h"
+#include "phytecprotocol.h"
+#include "flashimage.h"
+#include "gpioline.h"
+#include "transport.h"
+#include "eventlog.h"
+#include "imagedelta.h"
+#include "bootcode.h"
 
 #define MAX_BUF 256
-#define SYSFS_GPIO_DIR "/sys/class/gpio"
 
 #define PHYTEC_BOOT_PIN 175
 #define PHYTEC_RESET_PIN 42
 
 #define PHYTEC_DEBUG_PORT "/dev/ttymxc4"
+#define PHYTEC_DEFAULT_BAUD B230400		// rate of the bootstrap phase
 
+#define PHYTEC_WRITE_WINDOW 8			// most write commands ever in flight
+#define PHYTEC_PACE_PROBE 8				// blocks sent one at a time to measure the target
+#define PHYTEC_PACE_MAX 3000			// usec between write commands at most, the old fixed delay
+#define PHYTEC_PACE_STEP 250			// usec the gap starts from after a NAK
+#define PHYTEC_PACE_HOLD 8				// clean rounds the gap set by a NAK is kept before it narrows
+#define PHYTEC_WRITE_RETRIES 8			// times one NAKed block is sent again before giving up
+#define PHYTEC_TX_BATCH 16				// queued frames handed to one writev
+#define PHYTEC_TX_HIGH_WATER 1024		// bytes allowed in the driver's output queue
+#define PHYTEC_ACK_TIMEOUT 2000			// msec to wait for an acknowledge
+#define PHYTEC_QUERY_TIMEOUT 200		// msec a legacy loader is given to answer the query
+#define PHYTEC_MAX_BLOCK 240			// largest write block this host will send
+#define PHYTEC_ERASE_TIMEOUT 45000		// msec the target is given to erase the flash
+#define PHYTEC_SECTOR_TIMEOUT 5000		// msec the target is given per sector command
+#define PHYTEC_MANIFEST_DIR "/application"
+#define PHYTEC_MANIFEST_PATH PHYTEC_MANIFEST_DIR "/sciton-bootloader.manifest"
+#define PHYTEC_JOURNAL_PATH PHYTEC_MANIFEST_DIR "/sciton-bootloader.journal"
+#define PHYTEC_LOADER_DIR PHYTEC_MANIFEST_DIR "/loaders"	// boot code files besides the built-in one
+#define PHYTEC_JOURNAL_INTERVAL 500		// msec between journal updates while programming
+#define PHYTEC_RANGE_CHUNK 0x8000		// bytes covered by one range CRC command
+#define PHYTEC_VERIFY_BLOCK 0x1000		// bytes per block checked after programming
+#define PHYTEC_READ_RETRIES 3			// read blocks requested again after a bad CRC
+#define PHYTEC_BAUD_SETTLE 10			// msec for both UARTs to settle on a new rate
+#define PHYTEC_RESET_PULSE 10			// msec the reset line is held low
+#define PHYTEC_RESET_HOLD 1000			// msec reset is held when the module is released
+#define PHYTEC_WAKE_DELAY 500			// msec a freshly started loader needs before the sync byte
+#define PHYTEC_BSL_TIMEOUT 2100			// msec to wait for a bootstrap reply
+#define PHYTEC_RUN_TIMEOUT 400000		// msec for a whole connect and update
 
-typedef enum
-{
-	NO_ERROR = 0,					// No Error, line written
-	STATUS_NO_WRITE,				// No Error, NO line written
-	STATUS_FW_SUCCESS,				// Final Firmware line OK
-	ERR_FW_BAD_LINE,				// Firmware line has bad cookie
-	ERR_FW_DECODE,					// Firmware line has bad record type
-	ERR_FW_CHKSUM,					// Firmware line has bad checksum
-	ERR_FW_VERIFY,					// Firmware verify error
-} _GLOBAL_ERROR_CODES;
+#define PHYTEC_RESULT_TIMEOUT -4		// the whole run took longer than PHYTEC_RUN_TIMEOUT
+#define PHYTEC_RESULT_CANCELLED -8		// cancel() was called
+#define PHYTEC_RESULT_UNSUPPORTED -9	// the loader lacks a command the run needs
+#define PHYTEC_RESULT_WRONG_BASE -10	// the target does not hold the base revision of the delta
+#define PHYTEC_RESULT_BUSY -11			// a Flasher call came in while another one was running
 
-typedef enum {
-	PIN_INPUT = 0,
-	PIN_OUTPUT
-} PIN_DIRECTION;
+/**
+ * Timing of one flashing run, for benchmarks and logs.
+ */
+typedef struct
+{
+    qint64 parse_ms;					// reading and checking the image
+    qint64 connect_ms;					// bootstrap handshake and boot code upload
+    qint64 setup_ms;					// capability query, baud switch, sector planning
+    qint64 erase_ms;					// full or sector erase
+    qint64 program_ms;					// write commands up to the last acknowledge
+    qint64 verify_ms;					// block CRC readback
+    qint64 dump_ms;						// reading the flash back
+    u_int32_t bytes_programmed;			// image bytes covered by write commands
+    u_int32_t bytes_sent;				// write command bytes put on the line
+    u_int32_t commands;					// write commands sent
+    u_int32_t bytes_read;				// flash bytes read back by a dump
+    std::vector<u_int32_t> ack_us;		// send to acknowledge time of every write command
+    u_int32_t turnaround_us;			// fastest send to acknowledge time seen
+    int window;							// write commands in flight at the end
+    int pace_us;						// gap between write commands at the end
+    u_int32_t retries;					// write commands sent again after a NAK
+    u_int32_t blocks_verified;			// blocks compared by CRC after programming
+    std::vector<u_int32_t> verify_failed;	// addresses of the blocks that differ
+} FlashStats;
 
+/**
+ * Steps of a connect and update.  Every state waits for either a reply from
+ * the target or its deadline in state_timer; nothing blocks.
+ */
 typedef enum {
-	PIN_LOW = 0,
-	PIN_HIGH
-} PIN_VALUE;
+    FLASH_IDLE = 0,						// nothing started
+    FLASH_RESET,						// reset held low, boot pin high
+    FLASH_WAKE,							// bootstrap loader starting
+    FLASH_BSL_ID,						// sync sent, waiting for the identification byte
+    FLASH_BOOT_L1,						// level 1 boot code sent, waiting for its ack
+    FLASH_BOOT_L2,						// rest of the boot code going out, then loader start
+    FLASH_L2_SYNC,						// sync sent, waiting for the level 2 loader
+    FLASH_CONNECTED,					// level 2 loader running, update not started
+    FLASH_QUERY,						// capability query sent
+    FLASH_BAUD_REQUEST,					// baud command sent at the old rate
+    FLASH_BAUD_SETTLE,					// both sides moving to the new rate
+    FLASH_BAUD_TEST,					// test query at the new rate
+    FLASH_BAUD_FALLBACK,				// waiting for the loader to drop back
+    FLASH_BAUD_RECHECK,					// test query at the default rate
+    FLASH_RESUME_CHECK,					// checking what an interrupted update wrote
+    FLASH_SECTOR_CRC,					// reading the target's sector CRCs
+    FLASH_ERASE,						// full erase running
+    FLASH_SECTOR_ERASE,					// erasing the changed sectors
+    FLASH_PROGRAM,						// write commands in flight
+    FLASH_VERIFY,						// comparing block CRCs with the image
+    FLASH_DUMP,							// read commands in flight
+    FLASH_RELEASE,						// reset held before the module starts its application
+    FLASH_DONE							// finished, see result
+} FLASH_STATE;
 
 class PhytecModule : public QObject
 {
+    Q_OBJECT
+
 private:
-	int sciton_sio_fd;
-	struct termios tio;
-	speed_t sioTtyRate;
-	u_int8_t Current_Segment;
-	u_int16_t line_nr;
-    FILE *fw_file_ptr;
-    int fw_file_size;
-
-	void initSerial( void );
+    Transport *link;							// UART, emulator pty or TCP bridge to the module
+    bool link_owned;							// link was created here, not handed in
+    FlashImage image;							// image parsed by this module
+    const FlashImage *fw;						// image being flashed, own or shared
+    std::string port_name;						// serial device of the module
+    u_int16_t boot_pin;							// GPIO on the module's boot pin
+    u_int16_t reset_pin;						// GPIO on the module's reset pin
+    GpioLine boot_line;							// boot pin, held from construction on
+    GpioLine reset_line;						// reset pin, held from construction on
+    std::string manifest_path;					// sector CRCs of the last image flashed here
+    std::string journal_path;					// progress of an interrupted update
+    bool progress_log;							// log every block's percentage
+    bool gpio_released;							// reset let go, the application runs
+    bool release_on_finish;						// the run ends with the reset hold
+    EventLog *events;							// machine readable record of the run, NULL for none
+    const ImageDelta *delta;					// delta being applied, NULL for a whole image
+    int base_mismatches;						// unchanged sectors of a delta not on the base revision
+    const BootCodeSet *loaders;					// boot code variants to choose from
+    const BootCode *boot_code;					// variant sent to this target, NULL until identified
+    FLASH_STATE state;							// step of the connect and update
+    int result;									// outcome once state is FLASH_DONE
+    bool update_requested;						// go on to update once connected
+    bool dump_requested;						// read the flash instead of updating it
+    QSocketNotifier *rx_notifier;				// serial port readable
+    QSocketNotifier *tx_notifier;				// serial port writable, enabled while tx_frames holds data
+    QTimer state_timer;							// deadline or delay of the current state
+    QTimer run_timer;							// guard over the whole run
+    QEventLoop *waiting_loop;					// local loop of connectModule()/updateModule()
+    FLASH_STATE waiting_for;					// state that ends waiting_loop
+    std::deque<std::vector<u_int8_t> > tx_frames;	// frames queued for the port
+    size_t tx_pos;								// bytes of the first frame already written
+    QTimer tx_timer;							// resumes sending once the driver queue has drained
+    std::vector<u_int8_t> rx_buf;				// bytes received, not yet consumed
+    QElapsedTimer phase;						// time spent in the current phase
+    QElapsedTimer run_clock;					// time since the run started
+    int acks_pending;							// write or read commands sent, not yet answered
+    int ack_head;								// oldest entry in ack_records
+    int ack_errors;								// write commands that failed for good
+    u_int32_t ack_records[PHYTEC_WRITE_WINDOW];	// addresses of the blocks in flight
+    u_int32_t ack_ends[PHYTEC_WRITE_WINDOW];	// end addresses of the blocks in flight
+    int max_block;								// largest write block the loader accepts
+    u_int8_t loader_features;					// feature flags reported by the loader
+    u_int8_t block[PHYTEC_MAX_BLOCK + 7];		// write command being sent
+    unsigned int baud_step;						// rate being tried by the baud switch
+    FlashImage::SectorMap sums;					// CRC of every sector of the image
+    FlashImage::SectorMap crc_candidates;		// sectors whose target CRC is needed
+    FlashImage::SectorMap::const_iterator crc_next;	// next sector CRC to read
+    u_int16_t erased_crc;						// CRC of an erased sector
+    std::set<u_int32_t> dirty;					// sectors to erase and program
+    std::set<u_int32_t>::const_iterator erase_next;	// next sector to erase
+    bool differential;							// only the dirty sectors are written
+    FlashImage::BlockMap::const_iterator prog_run;	// run being programmed
+    u_int32_t prog_address;						// next address to program
+    std::map<u_int8_t, u_int32_t> journal_ends;	// per segment: end offset of the acknowledged data
+    std::map<u_int8_t, u_int32_t> acked_ends;	// per segment: end offset of the highest block acknowledged
+    bool journal_active;						// the journal follows this update
+    u_int16_t image_crc;						// identifies the image in the journal
+    QElapsedTimer journal_timer;				// time since the journal was written
+    u_int32_t resume_address;					// programming starts here, 0 for a fresh update
+    std::vector<std::pair<u_int32_t, u_int32_t> > check_ranges;	// ranges to compare by CRC
+    size_t check_next;							// next range to compare
+    FlashImage::SectorMap verify_sums;			// image CRC of every verify block
+    u_int32_t dump_start;						// first address a dump reads
+    u_int32_t dump_end;							// end of the range a dump reads
+    u_int32_t dump_next;						// next address to read
+    std::vector<std::pair<u_int32_t, u_int32_t> > dump_retry;	// blocks to read again
+    int read_errors;							// read replies with a bad CRC or NAK
+    u_int32_t bytes_total;						// bytes this update programs
+    u_int32_t bytes_remaining;					// bytes left to program
+    u_int32_t bytes_done;						// bytes acknowledged, or read back by a dump
+    FlashStats run_stats;						// timing of this run
+    QElapsedTimer ack_clock;					// time base of ack_sent
+    qint64 ack_sent[PHYTEC_WRITE_WINDOW];		// send time of the blocks in flight
+    int window;									// write commands allowed in flight now
+    int pace_us;								// gap kept between write commands
+    QTimer pace_timer;							// ends the gap before the next write command
+    qint64 last_sent;							// ack_clock nsec of the last write command
+    u_int32_t turnaround_us;					// fastest send to acknowledge time seen
+    int round_acks;								// clean acknowledges since the last adjustment
+    u_int32_t round_worst;						// slowest acknowledge in that round, usec
+    int pace_hold;								// clean rounds left before the gap may narrow
+    std::map<u_int32_t, int> block_naks;		// per block address: NAKs it got so far
+    std::vector<std::pair<u_int32_t, u_int32_t> > write_retry;	// NAKed blocks to send again
+    u_int32_t write_failed;						// lowest block that failed for good, 0xFFFFFFFF for none
+    QElapsedTimer reply_timer;					// started when a command is sent
+
+    void init(const char* port, u_int16_t boot, u_int16_t reset);
+	void initSerial( const char* port );
+    void initLink( void );
 	void initGPIO( void );
 	void initGPIOPin( u_int16_t pin_number, PIN_DIRECTION pin_dir, PIN_VALUE pin_val );
 	void releaseGPIOPin( u_int16_t pin_number );
-	void gpio_export(u_int16_t pin_number);
-	void gpio_unexport(u_int16_t pin_number);
-	void gpio_set_direction(u_int16_t pin_number, PIN_DIRECTION pin_dir );
-	void gpio_set_value(u_int16_t pin_number, PIN_VALUE pin_val );
-	int  gpio_get_value(u_int16_t pin_number );
-	u_int8_t hex2nibble(u_int8_t c);
-	u_int8_t hex2byte(u_int8_t *ptr);
-	u_int8_t write_fw_hex_record(u_int8_t *record);
-	u_int16_t hex2short(u_int8_t* ptr);
+    GpioLine *lineFor(u_int16_t pin_number);
 	void add_checksum(u_int8_t *buffer, u_int8_t len);
-    int	read_fw_hex_line( char *line );
-    int pollRx(int fd, int timeoutVal);
+    void enterState(FLASH_STATE next, int timeoutVal);
+    void finish(int code);
+    int runUntil(FLASH_STATE stop);
+    bool linkOpen(void) const;
+    void queueTx(const u_int8_t *data, int len);
+    int drainTime(int bytes);
+    bool takeReply(u_int8_t *reply, int len);
+    void flushRx(int queue);
+    void processRx(void);
+    void beginBootstrap(void);
+    void loaderReady(void);
+    void beginUpdate(void);
+    void sendQuery(void);
+    void queryReply(const u_int8_t *reply);
+    void setSerialRate(speed_t rate);
+    void tryBaud(void);
+    void baudTestReply(const u_int8_t *reply);
+    void beginResume(void);
+    void requestRangeCrc(FLASH_STATE purpose);
+    void rangeCrcReply(const u_int8_t *reply);
+    void beginVerify(void);
+    void endVerify(void);
+    void linkReady(void);
+    void beginDump(void);
+    bool nextRead(u_int32_t *address, int *len);
+    void fillReads(void);
+    void takeReads(void);
+    void endDump(void);
+    void beginPlan(void);
+    void requestSectorCrc(void);
+    void sectorCrcReply(const u_int8_t *reply);
+    void beginDeltaCheck(void);
+    void checkDeltaSector(u_int32_t sector, bool known, u_int16_t crc);
+    void endDeltaCheck(void);
+    void sendSectorCommand(u_int8_t cmd, u_int32_t sector);
+    void beginErase(void);
+    void eraseNextSector(void);
+    void beginProgram(void);
+    bool nextBlock(u_int32_t *address, int *len);
+    void fillWindow(void);
+    void takeAcks(void);
+    void advanceJournal(void);
+    void adjustPace(bool nak, u_int32_t sample_us, int len);
+    void endProgram(void);
+    bool writeBlock(u_int32_t address, const u_int8_t *data, int len);
+    bool readManifest(FlashImage::SectorMap &sums);
+    void writeManifest(const FlashImage::SectorMap &sums);
+    bool readJournal(std::map<u_int8_t, u_int32_t> &ends);
+    void writeJournal(void);
+    EventRecord event(const char *name) const;
+    void logEvent(const EventRecord &record);
+    void logBaud(const char *outcome);
+
+private slots:
+    void onReadable(void);
+    void onWritable(void);
+    void onDeadline(void);
+    void onRunTimeout(void);
 
 public:
-	PhytecModule(const char* path);
+	PhytecModule(const char* path, const char* port = PHYTEC_DEBUG_PORT,
+                 u_int16_t boot = PHYTEC_BOOT_PIN, u_int16_t reset = PHYTEC_RESET_PIN);
+	PhytecModule(const FlashImage *shared, const char* port, u_int16_t boot, u_int16_t reset);
+	PhytecModule(const FlashImage *shared, Transport *transport, u_int16_t boot, u_int16_t reset);
 	~PhytecModule();
     bool bIsFileOpened(void);
     u_int16_t sendSerial(const char *str);
@@ -84,8 +302,29 @@ public:
     int updateModule( void );
     int initFWFile( const char* path );
     void releaseGPIO( void );
+    void holdReset( void );
+    void endReset( void );
     void releaseFWFile( void );
+    const FlashStats &stats( void ) const;
+    const FlashImage &firmware( void ) const;
+    FLASH_STATE currentState( void ) const;
+    const char *portName( void ) const;
+    void setProgressLog(bool on);
+    void setReleaseOnFinish(bool on);
+    void setDump(u_int32_t start, u_int32_t len);
+    void setDelta(const ImageDelta *changes);
+    void setLoaders(const BootCodeSet *variants);
+    void setEventLog(EventLog *log);
+
+public slots:
+    void start( void );
+    void cancel( void );
 
+signals:
+    void progress(int percent);
+    void transferred(u_int32_t done, u_int32_t total);
+    void stateChanged(int state);
+    void finished(int result);
 };
 
 #endif // PHYTECMODULE_H
@@ -0,0 +1,47 @@
+#ifndef PHYTECPROTOCOL_H
+#define PHYTECPROTOCOL_H
+
+// Serial protocol between the host and the Phytec module.  The CPU's
+// bootstrap loader takes the level 1 boot code, which pulls in the level 2
+// loader (see bootcode.h); every later command is handled by the level 2 loader.
+// Nothing in here depends on Qt so that target emulators can share it.
+
+#define PHYTEC_BSL_SYNC 0x00			// host: bootstrap sync / loader ping
+#define PHYTEC_BSL_ID 0xD5				// bootstrap loader: answer to sync on this derivative
+#define PHYTEC_BSL_L1_ACK 0x31			// level 1 boot code: received
+#define PHYTEC_L2_READY 0x01			// level 2 loader: answer to ping
+#define PHYTEC_BOOT_CHUNK 32			// boot code is sent in chunks of this size
+
+#define PHYTEC_ACK 0x06					// level 2 loader: command accepted
+#define PHYTEC_NAK 0x15					// level 2 loader: command rejected
+
+// Opcodes of the stock level 2 loader, from the dispatcher in boot_code:
+// 08 and 0A are handled there but never sent by this host, 09 erases and
+// 0B writes.  Commands added for upgraded loaders take opcodes the stock
+// one ignores, so a loader built on it keeps every stock meaning.
+#define PHYTEC_CMD_STOCK_08 0x08		// stock level 2 loader: reserved, not sent
+#define PHYTEC_CMD_ERASE 0x09			// level 2 loader: erase, followed by PHYTEC_ERASE_ALL
+#define PHYTEC_ERASE_ALL 0xF7
+#define PHYTEC_CMD_STOCK_0A 0x0A		// stock level 2 loader: reserved, not sent
+#define PHYTEC_CMD_WRITE 0x0B			// level 2 loader: write block
+#define PHYTEC_CMD_SECTOR_CRC 0x0C		// level 2 loader: CRC-16 of one sector
+#define PHYTEC_CMD_RANGE_CRC 0x0D		// level 2 loader: CRC-16 of an address range
+#define PHYTEC_CMD_QUERY 0x0E			// level 2 loader: report capabilities
+#define PHYTEC_CMD_BAUD 0x0F			// level 2 loader: switch baud rate
+#define PHYTEC_CMD_READ 0x10			// level 2 loader: read block, data, CRC-16, ACK
+#define PHYTEC_CMD_SECTOR_ERASE 0x11	// level 2 loader: erase one sector
+#define PHYTEC_CMD_WRITE_RLE 0x1B		// level 2 loader: write run length coded block
+
+#define PHYTEC_FEATURE_SECTOR_ERASE 0x01	// loader features: single sector erase
+#define PHYTEC_FEATURE_SECTOR_CRC 0x02	// loader features: sector CRC report
+#define PHYTEC_FEATURE_BAUD 0x04		// loader features: baud rate switch
+#define PHYTEC_FEATURE_RLE 0x08			// loader features: run length coded writes
+#define PHYTEC_FEATURE_RANGE_CRC 0x10	// loader features: range CRC report
+#define PHYTEC_FEATURE_READ 0x20		// loader features: flash readback
+
+#define PHYTEC_LEGACY_BLOCK 16			// largest write block of the original loader
+#define PHYTEC_SECTOR_SIZE 0x4000		// flash sector size, power of two up to 64k
+#define PHYTEC_FLASH_SIZE 0x100000		// flash fitted to the module, from address 0
+#define PHYTEC_BAUD_FALLBACK 500		// msec after which the loader drops an unconfirmed rate
+
+#endif // PHYTECPROTOCOL_H
@@ -0,0 +1,13 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include <sys/types.h>
+
+// Run length coding used for compressed write blocks.  A control byte c
+// below 0x80 is followed by c + 1 literal bytes; c from 0x80 up repeats
+// the next byte c - 0x7E times (2 to 129).
+
+int rle_pack(const u_int8_t *in, int len, u_int8_t *out, int max_out);
+int rle_unpack(const u_int8_t *in, int len, u_int8_t *out, int max_out);
+
+#endif // RLE_H
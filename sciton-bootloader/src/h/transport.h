@@ -0,0 +1,91 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <string>
+
+#define TRANSPORT_TCP_PREFIX "tcp:"			// port names of the form tcp:HOST:PORT
+
+/**
+ * Byte stream between the flasher and the module.  PhytecModule only sees
+ * this interface; the implementations differ in how the link is opened,
+ * whether the line rate means anything and how received data is dropped.
+ * Every transport is non-blocking and has a descriptor the event loop can
+ * wait on.
+ */
+class Transport
+{
+public:
+    virtual ~Transport();
+
+    static Transport *create(const char *port);
+
+    virtual int open(void) = 0;
+    void close(void);
+    int fd(void) const;
+    const char *name(void) const;
+    int rate(void) const;
+
+    virtual ssize_t send(const struct iovec *iov, int count);
+    virtual ssize_t receive(u_int8_t *buf, size_t len);
+    virtual int setRate(speed_t speed);
+    virtual void flush(int queue);
+    virtual int outQueue(void);
+
+protected:
+    Transport(const char *port);
+
+    int handle;							// descriptor of the link, -1 if closed
+    std::string port_name;				// device or address the link goes to
+    int bits_per_second;				// line rate, 0 if the link has none
+};
+
+/**
+ * The module's UART.  Raw 8N1 with the rate switched through termios.
+ */
+class SerialTransport : public Transport
+{
+public:
+    SerialTransport(const char *port);
+
+    virtual int open(void);
+    virtual int setRate(speed_t speed);
+    virtual void flush(int queue);
+
+protected:
+    struct termios tio;					// line settings, kept for rate changes
+
+    int openTty(void);
+};
+
+/**
+ * The slave side of a pseudo-terminal, as served by phytec-emulator.  The
+ * line settings are applied like on a UART, but a pty has no line rate of
+ * its own; the emulator paces itself.
+ */
+class PtyTransport : public SerialTransport
+{
+public:
+    PtyTransport(const char *port);
+
+    virtual int open(void);
+};
+
+/**
+ * A TCP connection to a network serial bridge or to phytec-emulator
+ * --listen.  The line rate is the bridge's business, rate changes
+ * are only recorded.
+ */
+class TcpTransport : public Transport
+{
+public:
+    TcpTransport(const char *port);
+
+    virtual int open(void);
+};
+
+int speedToRate(speed_t speed);
+
+#endif // TRANSPORT_H
@@ -0,0 +1,281 @@
+/**
+  *****************************************************************************
+  * @file hexdecoder.cpp
+  * @brief Table driven Intel HEX decoder with SSE2 and NEON paths.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "hexdecoder.h"
+
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HEX_SIMD_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_SIMD_SSE2
+#endif
+
+#define HEX_INVALID 0xF0		// set in the table for every non-hex character
+
+// nibble value of every character, HEX_INVALID for non-hex characters
+static const u_int8_t hex_nibble[256] = {
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+        0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0
+};
+
+/**
+ * @brief      Decode pairs of hex characters with the lookup table.
+ *
+ * @param[in]  text  The hex characters, 2 * n of them
+ * @param      out   The decoded bytes
+ * @param[in]  n     The number of bytes to decode
+ * @param      sum   Running 8 bit sum of the decoded bytes
+ *
+ * @return     0 on success, -1 if a non-hex character was found.
+ */
+int HexDecoder::decodeScalar(const char *text, u_int8_t *out, int n, u_int8_t *sum)
+{
+    const u_int8_t *p = (const u_int8_t *)text;
+    u_int8_t err = 0, s = *sum, h, l;
+    int i;
+
+    // no branch per character, the invalid marks are collected and checked once
+    for (i = 0; i < n; i++)
+    {
+        h = hex_nibble[p[2 * i]];
+        l = hex_nibble[p[2 * i + 1]];
+        err |= h | l;
+        out[i] = (h << 4) | l;
+        s += out[i];
+    }
+
+    *sum = s;
+    return (err & HEX_INVALID) ? -1 : 0;
+}
+
+/**
+ * @brief      Decode pairs of hex characters, 32 characters at a time with
+ *             SIMD where available, the rest with the lookup table.
+ *
+ * @param[in]  text  The hex characters, 2 * n of them
+ * @param      out   The decoded bytes
+ * @param[in]  n     The number of bytes to decode
+ * @param      sum   Running 8 bit sum of the decoded bytes
+ *
+ * @return     0 on success, -1 if a non-hex character was found.
+ */
+int HexDecoder::decode(const char *text, u_int8_t *out, int n, u_int8_t *sum)
+{
+    int i = 0;
+
+#if defined(HEX_SIMD_NEON)
+    const uint8x16_t zero = vdupq_n_u8('0');
+    const uint8x16_t lower = vdupq_n_u8(0x20);
+    const uint8x16_t alpha = vdupq_n_u8('a');
+    const uint8x16_t ten = vdupq_n_u8(10);
+    const uint8x16_t six = vdupq_n_u8(6);
+    uint8x16_t valid = vdupq_n_u8(0xFF);
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        // vld2 splits the high and the low nibble characters
+        uint8x16x2_t c = vld2q_u8((const u_int8_t *)text + 2 * i);
+        uint8x16_t hd = vsubq_u8(c.val[0], zero);
+        uint8x16_t ha = vsubq_u8(vorrq_u8(c.val[0], lower), alpha);
+        uint8x16_t ld = vsubq_u8(c.val[1], zero);
+        uint8x16_t la = vsubq_u8(vorrq_u8(c.val[1], lower), alpha);
+        uint8x16_t hdm = vcltq_u8(hd, ten), ham = vcltq_u8(ha, six);
+        uint8x16_t ldm = vcltq_u8(ld, ten), lam = vcltq_u8(la, six);
+        uint8x16_t h = vbslq_u8(hdm, hd, vaddq_u8(ha, ten));
+        uint8x16_t l = vbslq_u8(ldm, ld, vaddq_u8(la, ten));
+        uint8x16_t b = vorrq_u8(vshlq_n_u8(h, 4), l);
+
+        valid = vandq_u8(valid, vandq_u8(vorrq_u8(hdm, ham), vorrq_u8(ldm, lam)));
+        acc = vaddq_u32(acc, vpaddlq_u16(vpaddlq_u8(b)));
+        vst1q_u8(out + i, b);
+    }
+    if (i)
+    {
+        uint8x8_t v = vand_u8(vget_low_u8(valid), vget_high_u8(valid));
+        uint64x2_t s = vpaddlq_u32(acc);
+
+        v = vpmin_u8(v, v);
+        v = vpmin_u8(v, v);
+        v = vpmin_u8(v, v);
+        if (vget_lane_u8(v, 0) != 0xFF)
+            return -1;
+        *sum += (u_int8_t)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+    }
+#elif defined(HEX_SIMD_SSE2)
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i alpha = _mm_set1_epi8('a');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i five = _mm_set1_epi8(5);
+    const __m128i ten = _mm_set1_epi8(10);
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    __m128i valid = _mm_set1_epi8((char)0xFF);
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i b[2];
+        int k;
+
+        for (k = 0; k < 2; k++)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i *)(text + 2 * i + 16 * k));
+            __m128i d = _mm_sub_epi8(c, zero);
+            __m128i a = _mm_sub_epi8(_mm_or_si128(c, lower), alpha);
+            // unsigned d <= 9 and a <= 5, there is no unsigned compare in SSE2
+            __m128i dm = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);
+            __m128i am = _mm_cmpeq_epi8(_mm_min_epu8(a, five), a);
+            __m128i nib = _mm_or_si128(_mm_and_si128(dm, d), _mm_and_si128(am, _mm_add_epi8(a, ten)));
+
+            valid = _mm_and_si128(valid, _mm_or_si128(dm, am));
+            // each 16 bit lane holds high nibble | low nibble << 8
+            b[k] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nib, 4), low_byte), _mm_srli_epi16(nib, 8));
+        }
+        b[0] = _mm_packus_epi16(b[0], b[1]);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(b[0], _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i *)(out + i), b[0]);
+    }
+    if (i)
+    {
+        if (_mm_movemask_epi8(valid) != 0xFFFF)
+            return -1;
+        *sum += (u_int8_t)(_mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4));
+    }
+#endif
+
+    return decodeScalar(text + 2 * i, out + i, n - i, sum);
+}
+
+/**
+ * @brief      Decode and checksum one Intel HEX record in a single pass.
+ *
+ *             +--------+--------+------+-------+--------+------(n bytes)------+----------+
+ *             | RECORD | RECLEN |    OFFSET    | RECORD |                     | CHECKSUM |
+ *             |  MARK  |  (n)   |   (2 BYTES)  |  TYPE  |        DATA         |          |
+ *             |  ':'   |        |              |        |                     |          |
+ *             +--------+--------+------+-------+--------+------(n bytes)------+----------+
+ *
+ * @param[in]  text  The record text without line terminator
+ * @param[in]  len   The record text length
+ * @param      rec   The decoded record
+ *
+ * @return     NO_ERROR, ERR_FW_BAD_LINE if the mark is missing or the length
+ *             does not match, ERR_FW_CHAR for a non-hex character or
+ *             ERR_FW_CHKSUM.
+ */
+int HexDecoder::decodeRecord(const char *text, int len, HexRecord *rec)
+{
+    u_int8_t sum = 0;
+    int n;
+
+    if ((len < 11) || (text[0] != ':'))
+        return ERR_FW_BAD_LINE;
+
+    if (decodeScalar(text + 1, rec->raw, 1, &sum) < 0)
+        return ERR_FW_CHAR;
+    n = rec->raw[0] + 5;
+    if (len != 2 * n + 1)
+        return ERR_FW_BAD_LINE;
+
+    if (decode(text + 3, rec->raw + 1, n - 1, &sum) < 0)
+        return ERR_FW_CHAR;
+    if (sum)
+        return ERR_FW_CHKSUM;			// checksum should be 0
+
+    rec->length = rec->raw[0];
+    rec->offset = (rec->raw[1] << 8) | rec->raw[2];
+    rec->type = rec->raw[3];
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Decode and checksum one Motorola S-record in a single pass.
+ *
+ *             +---+------+-------+--------(2, 3 or 4 bytes)--+---(n bytes)---+----------+
+ *             | S | TYPE | COUNT |          ADDRESS          |     DATA      | CHECKSUM |
+ *             +---+------+-------+---------------------------+---------------+----------+
+ *
+ *             COUNT covers address, data and checksum; the checksum is the
+ *             ones' complement of the sum of count, address and data.
+ *
+ * @param[in]  text  The record text without line terminator
+ * @param[in]  len   The record text length
+ * @param      rec   The decoded record
+ *
+ * @return     NO_ERROR, ERR_FW_BAD_LINE if the mark is missing or the length
+ *             does not match, ERR_FW_DECODE for the reserved type S4,
+ *             ERR_FW_CHAR for a non-hex character or ERR_FW_CHKSUM.
+ */
+int HexDecoder::decodeSRecord(const char *text, int len, SRecord *rec)
+{
+    // address bytes of S0 to S9, 0 for the reserved S4
+    static const u_int8_t address_bytes[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+    u_int8_t sum = 0;
+    int n, i;
+
+    if ((len < 4) || (text[0] != 'S') || (text[1] < '0') || (text[1] > '9'))
+        return ERR_FW_BAD_LINE;
+    rec->type = text[1] - '0';
+    rec->address_bytes = address_bytes[rec->type];
+    if (rec->address_bytes == 0)
+        return ERR_FW_DECODE;
+
+    if (decodeScalar(text + 2, rec->raw, 1, &sum) < 0)
+        return ERR_FW_CHAR;
+    n = rec->raw[0];
+    if ((len != 2 * n + 4) || (n < rec->address_bytes + 1))
+        return ERR_FW_BAD_LINE;
+
+    if (decode(text + 4, rec->raw + 1, n, &sum) < 0)
+        return ERR_FW_CHAR;
+    if (sum != 0xFF)
+        return ERR_FW_CHKSUM;
+
+    rec->address = 0;
+    for (i = 0; i < rec->address_bytes; i++)
+        rec->address = (rec->address << 8) | rec->raw[1 + i];
+    rec->length = n - rec->address_bytes - 1;
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Name of the decode path compiled in, for logs and benchmarks.
+ */
+const char *HexDecoder::implementation(void)
+{
+#if defined(HEX_SIMD_NEON)
+    return "neon";
+#elif defined(HEX_SIMD_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+/*! @} */
@@ -0,0 +1,318 @@
+/**
+  *****************************************************************************
+  * @file imagecache.cpp
+  * @brief Binary cache of parsed firmware images, keyed by content hash.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "imagecache.h"
+#include "phytecdefs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define IMAGECACHE_SUFFIX ".img"
+
+ImageCache::ImageCache(const char *dir)
+{
+    cache_dir = dir;
+    hit = false;
+}
+
+/**
+ * @brief      The last load() copied the image out of a cache file instead
+ *             of parsing the source.
+ */
+bool ImageCache::wasHit(void) const
+{
+    return hit;
+}
+
+/**
+ * @brief      64 bit FNV-1a hash, continued from seed.
+ */
+u_int64_t ImageCache::hash(const u_int8_t *data, size_t len, u_int64_t seed)
+{
+    u_int64_t h = seed;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= data[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+std::string ImageCache::cachePath(u_int64_t source_hash) const
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "/%016llx" IMAGECACHE_SUFFIX, (unsigned long long)source_hash);
+    return cache_dir + name;
+}
+
+/**
+ * @brief      Load a firmware file through the cache.  The source is hashed
+ *             together with the base address; a cache file of that hash
+ *             with checksums for the same sector and block sizes is used
+ *             as it is, otherwise the source is parsed, its checksums are
+ *             computed and a new cache file is written for the next run.
+ *
+ * @param[in]  path         The firmware file
+ * @param[in]  base         The address of a raw binary, negative for a text
+ *                          format
+ * @param      image        Receives the image
+ * @param[in]  sector_size  The sector size of the precomputed sector CRCs
+ * @param[in]  block_size   The block size of the precomputed block CRCs
+ *
+ * @return     NO_ERROR on success, else what FlashImage::load() or
+ *             FlashImage::loadBinary() returned for the source.
+ */
+int ImageCache::load(const char *path, long base, FlashImage &image, u_int32_t sector_size, u_int32_t block_size)
+{
+    struct stat st;
+    u_int8_t key[8];
+    u_int64_t source_hash;
+    void *source;
+    std::string file;
+    int fd, status, i;
+
+    hit = false;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode) || (st.st_size == 0) || (st.st_size > 0xFFFFFFFFLL))
+    {
+        close(fd);
+        return (base >= 0) ? image.loadBinary(path, base) : image.load(path);
+    }
+
+    // the same bytes loaded at another base are another image
+    for (i = 0; i < 8; i++)
+        key[i] = (u_int64_t)base >> (8 * i);
+    source_hash = hash(key, sizeof(key), FNV_OFFSET);
+
+    source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (source == MAP_FAILED)
+        return (base >= 0) ? image.loadBinary(path, base) : image.load(path);
+    source_hash = hash((const u_int8_t *)source, st.st_size, source_hash);
+    munmap(source, st.st_size);
+
+    file = cachePath(source_hash);
+    if (readCache(file, source_hash, st.st_size, sector_size, block_size, image))
+    {
+        hit = true;
+        utimes(file.c_str(), NULL);		// most recently used, pruned last
+        return NO_ERROR;
+    }
+
+    status = (base >= 0) ? image.loadBinary(path, base) : image.load(path);
+    if (status != NO_ERROR)
+        return status;
+
+    image.precomputeChecksums(sector_size, block_size);
+    writeCache(file, source_hash, st.st_size, image);
+    prune();
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Fill the image from a cache file.  The file is mapped and
+ *             checked as a whole before anything is taken from it.
+ *
+ * @return     true if the file exists, matches the source and is intact.
+ */
+bool ImageCache::readCache(const std::string &file, u_int64_t source_hash, u_int32_t source_size,
+                           u_int32_t sector_size, u_int32_t block_size, FlashImage &image)
+{
+    const ImageCacheHeader *hdr;
+    const ImageCacheEntry *table;
+    const u_int8_t *map, *data;
+    struct stat st;
+    u_int32_t i, entries, total = 0;
+    bool ok = false;
+    int fd;
+
+    fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(ImageCacheHeader)))
+    {
+        close(fd);
+        return false;
+    }
+    map = (const u_int8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    hdr = (const ImageCacheHeader *)map;
+    entries = hdr->runs + hdr->sectors + hdr->blocks;
+    if (!memcmp(hdr->magic, IMAGECACHE_MAGIC, sizeof(hdr->magic)) && (hdr->version == IMAGECACHE_VERSION) &&
+        (hdr->source_hash == source_hash) && (hdr->source_size == source_size) &&
+        (hdr->sector_size == sector_size) && (hdr->block_size == block_size) &&
+        ((u_int64_t)st.st_size == sizeof(ImageCacheHeader) + (u_int64_t)entries * sizeof(ImageCacheEntry) + hdr->data_size) &&
+        (hash(map + sizeof(ImageCacheHeader), st.st_size - sizeof(ImageCacheHeader), FNV_OFFSET) == hdr->payload_hash))
+    {
+        table = (const ImageCacheEntry *)(map + sizeof(ImageCacheHeader));
+        data = (const u_int8_t *)(table + entries);
+
+        image.clear();
+        for (i = 0; i < hdr->runs; i++)
+        {
+            // runs are stored in address order, every insert goes to the end
+            image.runs.insert(image.runs.end(), std::make_pair(table[i].address,
+                              std::vector<u_int8_t>(data + total, data + total + table[i].value)));
+            total += table[i].value;
+        }
+        table += hdr->runs;
+        for (i = 0; i < hdr->sectors; i++)
+            image.sector_sums.insert(image.sector_sums.end(), std::make_pair(table[i].address, (u_int16_t)table[i].value));
+        table += hdr->sectors;
+        for (i = 0; i < hdr->blocks; i++)
+            image.block_sums.insert(image.block_sums.end(), std::make_pair(table[i].address, (u_int16_t)table[i].value));
+
+        image.data_size = total;
+        image.records = hdr->records;
+        image.file_format = (IMAGE_FORMAT)hdr->format;
+        image.has_start = hdr->has_start;
+        image.start_address = hdr->start_address;
+        image.sums_sector_size = sector_size;
+        image.sums_block_size = block_size;
+        image.content_crc = hdr->content_crc;
+        image.content_known = true;
+        ok = (total == hdr->data_size);
+        if (!ok)
+            image.clear();
+    }
+
+    munmap((void *)map, st.st_size);
+    return ok;
+}
+
+/**
+ * @brief      Write an image with its precomputed checksums as a cache
+ *             file.  It is written under a temporary name and renamed, so
+ *             an interrupted write never leaves a partial cache file.
+ */
+void ImageCache::writeCache(const std::string &file, u_int64_t source_hash, u_int32_t source_size,
+                            const FlashImage &image)
+{
+    std::vector<ImageCacheEntry> table;
+    FlashImage::BlockMap::const_iterator run;
+    FlashImage::SectorMap::const_iterator sum;
+    ImageCacheHeader hdr;
+    ImageCacheEntry entry;
+    std::string tmp = file + ".tmp";
+    bool ok;
+    FILE *fp;
+
+    if (image.runs.empty() || ((mkdir(cache_dir.c_str(), 0755) < 0) && (errno != EEXIST)))
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGECACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGECACHE_VERSION;
+    hdr.format = image.file_format;
+    hdr.source_hash = source_hash;
+    hdr.source_size = source_size;
+    hdr.runs = image.runs.size();
+    hdr.data_size = image.data_size;
+    hdr.records = image.records;
+    hdr.sector_size = image.sums_sector_size;
+    hdr.sectors = image.sector_sums.size();
+    hdr.block_size = image.sums_block_size;
+    hdr.blocks = image.block_sums.size();
+    hdr.start_address = image.start_address;
+    hdr.content_crc = image.content_crc;
+    hdr.has_start = image.has_start;
+
+    for (run = image.runs.begin(); run != image.runs.end(); ++run)
+    {
+        entry.address = run->first;
+        entry.value = run->second.size();
+        table.push_back(entry);
+    }
+    for (sum = image.sector_sums.begin(); sum != image.sector_sums.end(); ++sum)
+    {
+        entry.address = sum->first;
+        entry.value = sum->second;
+        table.push_back(entry);
+    }
+    for (sum = image.block_sums.begin(); sum != image.block_sums.end(); ++sum)
+    {
+        entry.address = sum->first;
+        entry.value = sum->second;
+        table.push_back(entry);
+    }
+
+    hdr.payload_hash = hash((const u_int8_t *)&table[0], table.size() * sizeof(ImageCacheEntry), FNV_OFFSET);
+    for (run = image.runs.begin(); run != image.runs.end(); ++run)
+        hdr.payload_hash = hash(&run->second[0], run->second.size(), hdr.payload_hash);
+
+    fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL)
+        return;
+    ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1) &&
+         (fwrite(&table[0], sizeof(ImageCacheEntry), table.size(), fp) == table.size());
+    for (run = image.runs.begin(); ok && (run != image.runs.end()); ++run)
+        ok = (fwrite(&run->second[0], 1, run->second.size(), fp) == run->second.size());
+    if (fclose(fp) != 0)
+        ok = false;
+
+    if (!ok || (rename(tmp.c_str(), file.c_str()) < 0))
+        unlink(tmp.c_str());
+}
+
+/**
+ * @brief      Keep the IMAGECACHE_KEEP most recently used cache files.
+ */
+void ImageCache::prune(void)
+{
+    std::vector<std::pair<time_t, std::string> > files;
+    struct dirent *entry;
+    struct stat st;
+    std::string file;
+    size_t len, i;
+    DIR *dir;
+
+    dir = opendir(cache_dir.c_str());
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        len = strlen(entry->d_name);
+        if ((len <= strlen(IMAGECACHE_SUFFIX)) ||
+            strcmp(entry->d_name + len - strlen(IMAGECACHE_SUFFIX), IMAGECACHE_SUFFIX))
+            continue;
+        file = cache_dir + "/" + entry->d_name;
+        if (stat(file.c_str(), &st) == 0)
+            files.push_back(std::make_pair(st.st_mtime, file));
+    }
+    closedir(dir);
+
+    if (files.size() <= IMAGECACHE_KEEP)
+        return;
+    std::sort(files.begin(), files.end());
+    for (i = 0; i + IMAGECACHE_KEEP < files.size(); i++)
+        unlink(files[i].second.c_str());
+}
+
+/*! @} */
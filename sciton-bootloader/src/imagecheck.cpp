@@ -0,0 +1,221 @@
+/**
+  *****************************************************************************
+  * @file imagecheck.cpp
+  * @brief Offline check of a firmware file, no module needed.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "imagecheck.h"
+#include "phytecprotocol.h"
+#include "phytecdefs.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * @brief      Text of a record error for the report.
+ */
+static const char *errorText(int status)
+{
+    switch (status)
+    {
+    case ERR_FW_BAD_LINE: return "no record mark or wrong length";
+    case ERR_FW_DECODE: return "bad record type or layout";
+    case ERR_FW_CHKSUM: return "bad checksum";
+    case ERR_FW_CHAR: return "non-hex character";
+    default: return "invalid";
+    }
+}
+
+/**
+ * @brief      The file ended with its end or termination record.
+ */
+static bool hasEndRecord(const FlashImage &image)
+{
+    if (image.format() == IMAGE_SREC)
+        return image.recordsOfType(7) + image.recordsOfType(8) + image.recordsOfType(9) > 0;
+    return image.recordsOfType(1) > 0;
+}
+
+/**
+ * @brief      Count the write commands of a full update: every run cut into
+ *             blocks of up to block_size bytes, never across a sector, and
+ *             erased blocks left out.
+ *
+ * @param[in]  image       The parsed image
+ * @param[in]  block_size  The loader's write block size
+ * @param      plan        Receives the counts
+ */
+void planWrites(const FlashImage &image, int block_size, WritePlan *plan)
+{
+    FlashImage::BlockMap::const_iterator run;
+    u_int32_t address, end, limit, sector = 0, i;
+    bool any = false;
+
+    plan->blocks = 0;
+    plan->blank = 0;
+    plan->line_bytes = 0;
+    plan->sectors = 0;
+
+    for (run = image.blocks().begin(); run != image.blocks().end(); ++run)
+    {
+        end = run->first + run->second.size();
+        for (address = run->first; address < end; address = limit)
+        {
+            limit = (address & ~(PHYTEC_SECTOR_SIZE - 1)) + PHYTEC_SECTOR_SIZE;
+            if (limit > end)
+                limit = end;
+            if (limit - address > (u_int32_t)block_size)
+                limit = address + block_size;
+
+            if (!any || ((address & ~(PHYTEC_SECTOR_SIZE - 1)) != sector))
+            {
+                sector = address & ~(PHYTEC_SECTOR_SIZE - 1);
+                plan->sectors++;
+                any = true;
+            }
+
+            for (i = address; (i < limit) && (run->second[i - run->first] == 0xFF); i++)
+                ;
+            if (i == limit)
+            {
+                plan->blank++;
+                continue;
+            }
+            plan->blocks++;
+            plan->line_bytes += limit - address + CHECK_FRAME_BYTES;
+        }
+    }
+}
+
+/**
+ * @brief      Msec a number of bytes takes on the line, 8N1.
+ */
+u_int32_t lineTime(u_int32_t bytes, int baud)
+{
+    return (baud > 0) ? (u_int32_t)((unsigned long long)bytes * 10 * 1000 / baud) : 0;
+}
+
+/**
+ * @brief      Parse a firmware file without touching the module and print
+ *             what an update would do with it: bad records, record types,
+ *             the address coverage per segment with its gaps, data written
+ *             twice, the payload and the expected flashing time.
+ *
+ * @param[in]  path        The firmware file
+ * @param[in]  base        The address of a raw binary, negative for a
+ *                         text format
+ * @param[in]  baud        The line rate the estimate assumes
+ * @param[in]  block_size  The write block size the estimate assumes
+ *
+ * @return     NO_ERROR if every record is valid, -1 if the file can not be
+ *             read, else the _GLOBAL_ERROR_CODES of the first bad record.
+ */
+int checkImage(const char *path, long base, int baud, int block_size)
+{
+    std::vector<FlashImage::RecordError> errors;
+    FlashImage::BlockMap::const_iterator run, next, after;
+    FlashImage::RangeList::const_iterator overlap;
+    FlashImage image;
+    WritePlan plan, legacy;
+    struct timespec t0, t1;
+    u_int32_t end, seg_bytes, seg_runs, outside = 0, program_ms, legacy_ms;
+    int status, parse_us;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (base >= 0)
+        status = image.loadBinary(path, base);
+    else
+        status = image.load(path, &errors);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    parse_us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+    if (status < 0)
+    {
+        printf("%s: can not be read\n", path);
+        return status;
+    }
+
+    printf("%s: %s, parsed in %d.%03d ms\n", path, image.formatName(), parse_us / 1000, parse_us % 1000);
+    if (image.format() != IMAGE_BINARY)
+    {
+        printf("records:");
+        for (i = 0; i < FLASHIMAGE_RECORD_TYPES; i++)
+        {
+            if (image.recordsOfType(i) == 0)
+                continue;
+            if (image.format() == IMAGE_SREC)
+                printf(" %u S%d", image.recordsOfType(i), (int)i);
+            else
+                printf(" %u type %02d", image.recordsOfType(i), (int)i);
+        }
+        printf("\n");
+    }
+    if (image.hasStartAddress())
+        printf("start address: %06X\n", image.startAddress());
+    for (i = 0; i < errors.size(); i++)
+    {
+        if ((i + 1 == errors.size()) && !hasEndRecord(image))
+            printf("ERROR line %d: end record missing, file truncated\n", errors[i].line);
+        else
+            printf("ERROR line %d: %s\n", errors[i].line, errorText(errors[i].status));
+    }
+    if (errors.empty() && (image.format() != IMAGE_BINARY))
+        printf("all record checksums and types valid\n");
+
+    // coverage per segment, runs never cross a segment
+    for (run = image.blocks().begin(); run != image.blocks().end(); run = next)
+    {
+        seg_bytes = 0;
+        seg_runs = 0;
+        for (next = run; (next != image.blocks().end()) &&
+             (FlashImage::segmentOf(next->first) == FlashImage::segmentOf(run->first)); ++next)
+        {
+            seg_bytes += next->second.size();
+            seg_runs++;
+        }
+        printf("segment %02X: %u bytes in %u runs\n", FlashImage::segmentOf(run->first), seg_bytes, seg_runs);
+
+        for (; run != next; ++run)
+        {
+            end = run->first + run->second.size();
+            printf("  %06X..%06X  %u bytes\n", run->first, end - 1, (u_int32_t)run->second.size());
+            if (end > PHYTEC_FLASH_SIZE)
+                outside += end - ((run->first > PHYTEC_FLASH_SIZE) ? run->first : PHYTEC_FLASH_SIZE);
+
+            after = run;
+            if ((++after != next) && (after->first > end))
+                printf("  gap %06X..%06X  %u bytes\n", end, after->first - 1, after->first - end);
+        }
+    }
+
+    for (overlap = image.overlaps().begin(); overlap != image.overlaps().end(); ++overlap)
+        printf("WARNING %06X..%06X written twice ( %u bytes ), the later record is kept\n",
+               overlap->first, overlap->first + overlap->second - 1, overlap->second);
+    if (outside)
+        printf("WARNING %u bytes above the %06X flash end\n", outside, PHYTEC_FLASH_SIZE);
+
+    planWrites(image, block_size, &plan);
+    planWrites(image, PHYTEC_LEGACY_BLOCK, &legacy);
+    program_ms = lineTime(plan.line_bytes, baud);
+    legacy_ms = lineTime(legacy.line_bytes, baud) + legacy.blocks * (CHECK_LEGACY_GAP_US / 1000);
+
+    printf("payload: %u bytes in %u runs, %u sectors of %u bytes, content crc %04X\n",
+           image.size(), (u_int32_t)image.blocks().size(), plan.sectors, PHYTEC_SECTOR_SIZE,
+           image.contentChecksum());
+    printf("estimate at %d baud: %u blocks of up to %d bytes ( %u erased ones skipped ), %u bytes on the line\n",
+           baud, plan.blocks, block_size, plan.blank, plan.line_bytes);
+    printf("  %u ms programming, %u ms with connect, erase extra\n",
+           program_ms, program_ms + CHECK_CONNECT_MS);
+    printf("legacy loader at %d baud: %u blocks of %d bytes, %u ms programming\n",
+           baud, legacy.blocks, PHYTEC_LEGACY_BLOCK, legacy_ms);
+
+    return errors.empty() ? NO_ERROR : status;
+}
+
+/*! @} */
@@ -0,0 +1,337 @@
+/**
+  *****************************************************************************
+  * @file imagedelta.cpp
+  * @brief Sector delta between two firmware revisions, built on the host
+  *        and applied by the flasher.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "imagedelta.h"
+#include "phytecdefs.h"
+#include "crc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void put16(std::vector<u_int8_t> &out, u_int16_t value)
+{
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+static void put32(std::vector<u_int8_t> &out, u_int32_t value)
+{
+    put16(out, value >> 16);
+    put16(out, value);
+}
+
+static u_int16_t get16(const u_int8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static u_int32_t get32(const u_int8_t *p)
+{
+    return ((u_int32_t)get16(p) << 16) | get16(p + 2);
+}
+
+ImageDelta::ImageDelta()
+{
+    sector_size = 0;
+    base_crc = 0;
+    target_crc = 0;
+}
+
+/**
+ * @brief      Compare two images sector by sector.  Sectors are compared
+ *             byte for byte, not by CRC, so no change can hide behind a
+ *             CRC collision; the new contents of every sector that differs
+ *             are kept, a sector the new image no longer uses is carried
+ *             as changed with no data so that it gets erased.
+ *
+ * @param[in]  base         The revision the target runs now
+ * @param[in]  target       The revision to go to
+ * @param[in]  sector_size  The flash sector size, a power of two up to 64k
+ */
+void ImageDelta::build(const FlashImage &base, const FlashImage &target, u_int32_t sector_size)
+{
+    FlashImage::SectorMap base_sums, target_sums;
+    FlashImage::SectorMap::const_iterator s;
+    FlashImage::BlockMap::const_iterator run;
+    std::vector<u_int8_t> old_bytes(sector_size), new_bytes(sector_size, 0xFF);
+    SectorTable::iterator entry;
+    u_int32_t end, lo, hi;
+    u_int16_t erased;
+
+    this->sector_size = sector_size;
+    base_crc = base.contentChecksum();
+    target_crc = target.contentChecksum();
+    table.clear();
+    data.clear();
+
+    erased = crc16_update(CRC16_INIT, &new_bytes[0], sector_size);
+    base.sectorChecksums(sector_size, base_sums);
+    target.sectorChecksums(sector_size, target_sums);
+
+    for (s = base_sums.begin(); s != base_sums.end(); ++s)
+    {
+        table[s->first].base_crc = s->second;
+        table[s->first].target_crc = erased;
+        table[s->first].flags = DELTA_IN_BASE;
+    }
+    for (s = target_sums.begin(); s != target_sums.end(); ++s)
+    {
+        entry = table.find(s->first);
+        if (entry == table.end())
+        {
+            entry = table.insert(std::make_pair(s->first, DeltaSector())).first;
+            entry->second.base_crc = erased;
+            entry->second.flags = 0;
+        }
+        entry->second.target_crc = s->second;
+        entry->second.flags |= DELTA_IN_TARGET;
+    }
+
+    for (entry = table.begin(); entry != table.end(); ++entry)
+    {
+        base.copyRange(entry->first, sector_size, &old_bytes[0]);
+        target.copyRange(entry->first, sector_size, &new_bytes[0]);
+        if (!memcmp(&old_bytes[0], &new_bytes[0], sector_size))
+            continue;
+        entry->second.flags |= DELTA_CHANGED;
+
+        // the new image's own runs, so the flasher skips what it leaves erased
+        end = entry->first + sector_size;
+        run = target.blocks().upper_bound(entry->first);
+        if (run != target.blocks().begin())
+            --run;
+        for (; (run != target.blocks().end()) && (run->first < end); ++run)
+        {
+            lo = (run->first > entry->first) ? run->first : entry->first;
+            hi = run->first + run->second.size();
+            if (hi > end)
+                hi = end;
+            if (hi > lo)
+                data.addData(lo, &run->second[lo - run->first], hi - lo);
+        }
+    }
+}
+
+/**
+ * @brief      Read a delta file.  Nothing is kept unless the file is intact
+ *             and the data of every changed sector gives the sector CRC the
+ *             table names for it.
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be read,
+ *             ERR_FW_CHKSUM if its CRC is wrong, ERR_FW_DECODE if it is not
+ *             a delta or its contents do not add up.
+ */
+int ImageDelta::load(const char *path)
+{
+    std::vector<u_int8_t> file, blank;
+    u_int8_t chunk[FLASHIMAGE_BINARY_CHUNK];
+    FlashImage::SectorMap sums;
+    FlashImage::SectorMap::const_iterator s;
+    SectorTable::const_iterator entry;
+    const u_int8_t *p, *end;
+    u_int32_t sectors, runs, address, len, sector, i;
+    u_int16_t erased, expected;
+    size_t n;
+    FILE *fp;
+
+    sector_size = 0;
+    table.clear();
+    data.clear();
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        file.insert(file.end(), chunk, chunk + n);
+    n = ferror(fp);
+    fclose(fp);
+    if (n)
+        return -1;
+
+    if ((file.size() < IMAGEDELTA_HEADER + 2) || memcmp(&file[0], IMAGEDELTA_MAGIC, 8) ||
+        (get16(&file[8]) != IMAGEDELTA_VERSION))
+        return ERR_FW_DECODE;
+    if (crc16_update(CRC16_INIT, &file[0], file.size() - 2) != get16(&file[file.size() - 2]))
+        return ERR_FW_CHKSUM;
+
+    p = &file[12];
+    end = &file[0] + file.size() - 2;
+    sector_size = get32(p);
+    base_crc = get16(p + 4);
+    target_crc = get16(p + 6);
+    sectors = get32(p + 8);
+    runs = get32(p + 12);
+    p += 16;
+    if ((sector_size == 0) || (sector_size > 0x10000) || (sector_size & (sector_size - 1)) ||
+        ((u_int32_t)(end - p) / IMAGEDELTA_SECTOR_ENTRY < sectors))
+        return ERR_FW_DECODE;
+
+    for (i = 0; i < sectors; i++, p += IMAGEDELTA_SECTOR_ENTRY)
+    {
+        address = get32(p);
+        if ((address & (sector_size - 1)) || !(p[8] & (DELTA_IN_BASE | DELTA_IN_TARGET)))
+            break;
+        table[address].base_crc = get16(p + 4);
+        table[address].target_crc = get16(p + 6);
+        table[address].flags = p[8];
+    }
+
+    for (i = 0; (i < runs) && (table.size() == sectors); i++)
+    {
+        if (end - p < IMAGEDELTA_RUN_ENTRY)
+            break;
+        address = get32(p);
+        len = get32(p + 4);
+        p += IMAGEDELTA_RUN_ENTRY;
+        if ((len == 0) || ((u_int32_t)(end - p) < len))
+            break;
+
+        // data may only go to sectors the flasher erases
+        for (sector = address & ~(sector_size - 1); sector < address + len; sector += sector_size)
+        {
+            entry = table.find(sector);
+            if ((entry == table.end()) || !(entry->second.flags & DELTA_CHANGED))
+                break;
+        }
+        if (sector < address + len)
+            break;
+        data.addData(address, p, len);
+        p += len;
+    }
+
+    // the data of every changed sector must be what the table says
+    blank.assign(sector_size, 0xFF);
+    erased = crc16_update(CRC16_INIT, &blank[0], sector_size);
+    data.sectorChecksums(sector_size, sums);
+    for (entry = table.begin(); (i == runs) && (p == end) && (entry != table.end()); ++entry)
+    {
+        s = sums.find(entry->first);
+        expected = (s != sums.end()) ? s->second : erased;
+        if ((entry->second.flags & DELTA_CHANGED) && (expected != entry->second.target_crc))
+            break;
+    }
+    if ((table.size() != sectors) || (i != runs) || (p != end) || (entry != table.end()))
+    {
+        sector_size = 0;
+        table.clear();
+        data.clear();
+        return ERR_FW_DECODE;
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Write the delta file.
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be written.
+ */
+int ImageDelta::save(const char *path) const
+{
+    std::vector<u_int8_t> out;
+    SectorTable::const_iterator entry;
+    FlashImage::BlockMap::const_iterator run;
+    int status;
+    FILE *fp;
+
+    out.insert(out.end(), IMAGEDELTA_MAGIC, IMAGEDELTA_MAGIC + 8);
+    put16(out, IMAGEDELTA_VERSION);
+    put16(out, 0);						// flags, none defined
+    put32(out, sector_size);
+    put16(out, base_crc);
+    put16(out, target_crc);
+    put32(out, table.size());
+    put32(out, data.blocks().size());
+
+    for (entry = table.begin(); entry != table.end(); ++entry)
+    {
+        put32(out, entry->first);
+        put16(out, entry->second.base_crc);
+        put16(out, entry->second.target_crc);
+        out.push_back(entry->second.flags);
+        out.insert(out.end(), 3, 0);
+    }
+    for (run = data.blocks().begin(); run != data.blocks().end(); ++run)
+    {
+        put32(out, run->first);
+        put32(out, run->second.size());
+        out.insert(out.end(), run->second.begin(), run->second.end());
+    }
+    put16(out, crc16_update(CRC16_INIT, &out[0], out.size()));
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+        return -1;
+    status = (fwrite(&out[0], 1, out.size(), fp) == out.size()) ? NO_ERROR : -1;
+    if (fclose(fp) != 0)
+        status = -1;
+    return status;
+}
+
+u_int32_t ImageDelta::sectorSize(void) const
+{
+    return sector_size;
+}
+
+u_int16_t ImageDelta::baseChecksum(void) const
+{
+    return base_crc;
+}
+
+u_int16_t ImageDelta::targetChecksum(void) const
+{
+    return target_crc;
+}
+
+const ImageDelta::SectorTable &ImageDelta::sectors(void) const
+{
+    return table;
+}
+
+u_int32_t ImageDelta::changedSectors(void) const
+{
+    SectorTable::const_iterator entry;
+    u_int32_t n = 0;
+
+    for (entry = table.begin(); entry != table.end(); ++entry)
+    {
+        if (entry->second.flags & DELTA_CHANGED)
+            n++;
+    }
+    return n;
+}
+
+/**
+ * @brief      The new contents of the changed sectors, as an image the
+ *             flasher programs.
+ */
+const FlashImage &ImageDelta::changes(void) const
+{
+    return data;
+}
+
+/**
+ * @brief      Sector CRCs of the new image, what the manifest records once
+ *             the delta is applied.
+ */
+void ImageDelta::targetChecksums(FlashImage::SectorMap &sums) const
+{
+    SectorTable::const_iterator entry;
+
+    sums.clear();
+    for (entry = table.begin(); entry != table.end(); ++entry)
+    {
+        if (entry->second.flags & DELTA_IN_TARGET)
+            sums[entry->first] = entry->second.target_crc;
+    }
+}
+
+/*! @} */
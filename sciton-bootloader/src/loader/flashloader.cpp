@@ -0,0 +1,144 @@
+/**
+  *****************************************************************************
+  * @file flashloader.cpp
+  * @brief Packs boot code into the versioned files sciton-bootloader loads.
+  *
+  * Wraps the level 1 code and level 2 loader assembled for one derivative
+  * into a boot code file with its bootstrap ID, version and CRC.  Copied to
+  * /application/loaders, or named with --loader, it is sent to every target
+  * that identifies as that derivative, as long as no newer one is there.
+  *
+  *   flash-loader --id D5 --version 2 loader_v2.bin loader_v2.bsl
+  *   flash-loader --builtin builtin.bsl
+  *   flash-loader --show loader_v2.bsl
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phytecprotocol.h"
+#include "phytecdefs.h"
+#include "bootcode.h"
+
+#define LOADER_NAME "flash-loader"
+
+static void usage(void)
+{
+    printf("Usage: " LOADER_NAME " [--id HEX] --version N CODE LOADER\n");
+    printf("       " LOADER_NAME " --builtin LOADER\n");
+    printf("       " LOADER_NAME " --show LOADER\n");
+    printf("       CODE is the raw boot code, level 1 in the first %d bytes, whole chunks up to %d bytes\n",
+           PHYTEC_BOOT_CHUNK, BOOTCODE_MAX_SIZE);
+    printf("       --id is the bootstrap loader's answer on the target, %02X by default\n", PHYTEC_BSL_ID);
+}
+
+static void showLoader(const BootCode &code)
+{
+    printf("bootstrap id %02X, version %d, %u bytes ( %u of level 2 ), crc %04X\n", code.bslId(),
+           code.version(), code.size(), code.levelTwoSize(), code.checksum());
+}
+
+/**
+ * @brief      Read the raw boot code.
+ *
+ * @return     NO_ERROR on success, -1 if it can not be read or is too large.
+ */
+static int readCode(const char *path, std::vector<u_int8_t> &code)
+{
+    u_int8_t chunk[256];
+    size_t n;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    while (((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) && (code.size() <= BOOTCODE_MAX_SIZE))
+        code.insert(code.end(), chunk, chunk + n);
+    n = ferror(fp);
+    fclose(fp);
+    return (n || (code.size() > BOOTCODE_MAX_SIZE)) ? -1 : NO_ERROR;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *paths[2];
+    std::vector<u_int8_t> raw;
+    BootCode code;
+    char *end;
+    long id = PHYTEC_BSL_ID, version = -1;
+    int i, n = 0, status;
+    bool show = false, builtin = false;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--show"))
+            show = true;
+        else if (!strcmp(argv[i], "--builtin"))
+            builtin = true;
+        else if (!strcmp(argv[i], "--id") && (i + 1 < argc))
+        {
+            id = strtol(argv[++i], &end, 16);
+            if ((*end != 0) || (id < 0) || (id > 0xFF))
+                n = -1;
+        }
+        else if (!strcmp(argv[i], "--version") && (i + 1 < argc))
+        {
+            version = strtol(argv[++i], &end, 0);
+            if ((*end != 0) || (version < 0) || (version > 0xFFFF))
+                n = -1;
+        }
+        else if ((argv[i][0] != '-') && (n >= 0) && (n < 2))
+            paths[n++] = argv[i];
+        else
+            n = -1;
+    }
+    if ((show && (builtin || (n != 1))) || (builtin && (n != 1)) ||
+        (!show && !builtin && ((n != 2) || (version < 0))))
+    {
+        usage();
+        return -1;
+    }
+
+    if (show)
+    {
+        status = code.load(paths[0]);
+        if (status != NO_ERROR)
+        {
+            printf("%s: %s\n", paths[0], (status < 0) ? "can not be read" : "not a valid boot code file");
+            return status;
+        }
+        showLoader(code);
+        return 0;
+    }
+
+    if (!builtin)
+    {
+        if (readCode(paths[0], raw) != NO_ERROR)
+        {
+            printf("%s: can not be read\n", paths[0]);
+            return -1;
+        }
+        if (code.assign(&raw[0], raw.size(), id, version) != NO_ERROR)
+        {
+            printf("%s: %u bytes, boot code is sent in whole %d byte chunks, at least two, up to %d bytes\n",
+                   paths[0], (u_int32_t)raw.size(), PHYTEC_BOOT_CHUNK, BOOTCODE_MAX_SIZE);
+            return -1;
+        }
+    }
+
+    showLoader(code);
+    if (code.save(paths[n - 1]) != NO_ERROR)
+    {
+        printf("%s: can not be written\n", paths[n - 1]);
+        return -1;
+    }
+    return 0;
+}
+
+/*! @} */
@@ -24,82 +24,498 @@
 #include <unistd.h>
 #include <QThread>
 #include <phytecmodule.h>
+#include <flashgroup.h>
+#include <eventlog.h>
+#include <imagecheck.h>
+#include <imagecache.h>
+#include <imagedelta.h>
+#include <bootcode.h>
 #include <stdexcept>
-
-#include <sys/time.h>		/* for setitimer */
-#include <signal.h>		/* for signal */
+#include <string.h>
+#include <sys/stat.h>
 
 
 #define SCITON_BOOT_LOADER_NAME "sciton_bootloader"
-#define EXECUTABLE_ARG 0
-#define FW_PATH_ARG 1
-#define REQUIRED_ARG_NUM 2
+
+/**
+ * What --dump reads back from the module and where it goes.
+ */
+typedef struct
+{
+    const char *path;				// output file, NULL for a normal update
+    bool raw;						// raw binary instead of Intel HEX
+    u_int32_t start;				// first address read
+    u_int32_t len;					// bytes read
+} DumpOptions;
 
 void usage(const char* msg)
 {
-    qDebug() << "Usage: " << SCITON_BOOT_LOADER_NAME << "FWPATH";
+    qDebug() << "Usage: " << SCITON_BOOT_LOADER_NAME << "[--port DEVICE] [--boot-pin GPIO] [--reset-pin GPIO] [--base ADDR] FWPATH";
+    qDebug() << "       " << SCITON_BOOT_LOADER_NAME << "--target DEVICE,BOOTPIN,RESETPIN [--target ...] [--base ADDR] FWPATH";
+    qDebug() << "       " << SCITON_BOOT_LOADER_NAME << "[--port DEVICE] [--boot-pin GPIO] [--reset-pin GPIO] --dump FILE [--raw] [--range START,LEN]";
+    qDebug() << "       " << SCITON_BOOT_LOADER_NAME << "[--port DEVICE | --target ...] --delta FILE";
+    qDebug() << "       " << SCITON_BOOT_LOADER_NAME << "--check [--baud RATE] [--base ADDR] FWPATH";
+    qDebug() << "       " << "FWPATH is Intel HEX or S-records, or a raw binary loaded at --base ADDR";
+    qDebug() << "       " << "a --delta FILE from flash-delta is only applied to a module holding its base revision";
+    qDebug() << "       " << "the update and dump forms take --events FILE or --events-fd FD for a JSON lines record of the run";
+    qDebug() << "       " << "and --loader FILE or DIR for boot code besides" << PHYTEC_LOADER_DIR << ", the newest made for the target is sent";
 	qDebug() << msg;
 }
 
-void errorMsg(const char* msg)
+/**
+ * @brief      Parse a GPIO number.
+ *
+ * @return     0 on success, -1 if the argument is not a number.
+ */
+int parsePin(const char *arg, u_int16_t *pin)
 {
-    qDebug() << "Error: " << SCITON_BOOT_LOADER_NAME << " - " << msg;
+    char *end;
+
+    *pin = strtoul(arg, &end, 10);
+    return ((end == arg) || (*end != 0)) ? -1 : 0;
+}
+
+/**
+ * @brief      Open the event log named by --events or --events-fd.
+ *
+ * @return     0 on success, -1 if the file can not be opened or the
+ *             descriptor is not a number.
+ */
+int parseEvents(const char *option, const char *arg, EventLog *events)
+{
+    char *end;
+    long fd;
+
+    if (!strcmp(option, "--events"))
+        return events->open(arg);
+
+    fd = strtol(arg, &end, 10);
+    if ((end == arg) || (*end != 0) || (fd < 0) || (fcntl(fd, F_GETFD) < 0))
+        return -1;
+    events->attach(fd);
+    return 0;
+}
+
+/**
+ * @brief      Parse a --baud argument, a line rate in bits per second.
+ *
+ * @return     0 on success, -1 if the argument is not a positive number.
+ */
+int parseBaud(const char *arg, int *baud)
+{
+    char *end;
+
+    *baud = strtol(arg, &end, 10);
+    return ((end == arg) || (*end != 0) || (*baud <= 0)) ? -1 : 0;
+}
+
+/**
+ * @brief      Parse a --base argument, the address of a raw binary image in
+ *             C notation.
+ *
+ * @return     0 on success, -1 if the argument is malformed.
+ */
+int parseBase(const char *arg, long *base)
+{
+    char *end;
+
+    *base = strtol(arg, &end, 0);
+    return ((end == arg) || (*end != 0) || (*base < 0) || (*base >= PHYTEC_FLASH_SIZE)) ? -1 : 0;
+}
+
+/**
+ * @brief      Parse a --range argument, START,LEN in C notation.
+ *
+ * @return     0 on success, -1 if the argument is malformed.
+ */
+int parseRange(const char *arg, DumpOptions *dump)
+{
+    char *end;
+
+    dump->start = strtoul(arg, &end, 0);
+    if ((end == arg) || (*end != ','))
+        return -1;
+    arg = end + 1;
+    dump->len = strtoul(arg, &end, 0);
+    if ((end == arg) || (*end != 0) || (dump->len == 0))
+        return -1;
+    return 0;
 }
 
-struct itimerval it_val;	/* for setting itimer */
-void timeoutCallback(void);
-int timerInit(unsigned int interval);
+/**
+ * @brief      Parse a --target argument, DEVICE,BOOTPIN,RESETPIN.
+ *
+ * @return     0 on success, -1 if the argument is malformed.
+ */
+int parseTarget(const char *arg, std::vector<FlashTarget> *targets)
+{
+    FlashTarget target;
+    const char *comma = strchr(arg, ',');
+    char *end;
 
-int ret = -1;
-int init = 0;
+    if ((comma == NULL) || (comma == arg))
+        return -1;
+    target.port.assign(arg, comma - arg);
+    target.boot_pin = strtoul(comma + 1, &end, 10);
+    if ((end == comma + 1) || (*end != ','))
+        return -1;
+    comma = end;
+    target.reset_pin = strtoul(comma + 1, &end, 10);
+    if ((end == comma + 1) || (*end != 0))
+        return -1;
+
+    targets->push_back(target);
+    return 0;
+}
+
+/**
+ * @brief      Pick the firmware path and options out of the command line.
+ *
+ * @return     0 on success, -1 if the arguments are not usable.
+ */
+int parseArgs(int argc, char *argv[], const char **fw_path, const char **port,
+              u_int16_t *boot_pin, u_int16_t *reset_pin, std::vector<FlashTarget> *targets,
+              DumpOptions *dump, EventLog *events, bool *check, int *baud, long *base,
+              const char **delta_path, const char **loader_path)
+{
+    *fw_path = NULL;
+    *delta_path = NULL;
+    *loader_path = NULL;
+    *port = PHYTEC_DEBUG_PORT;
+    *boot_pin = PHYTEC_BOOT_PIN;
+    *reset_pin = PHYTEC_RESET_PIN;
+    dump->path = NULL;
+    dump->raw = false;
+    dump->start = 0;
+    dump->len = PHYTEC_FLASH_SIZE;
+    *check = false;
+    *base = -1;
+    *baud = speedToRate(PHYTEC_DEFAULT_BAUD);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--port") && (i + 1 < argc))
+            *port = argv[++i];
+        else if (!strcmp(argv[i], "--boot-pin") && (i + 1 < argc))
+        {
+            if (parsePin(argv[++i], boot_pin) < 0)
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--reset-pin") && (i + 1 < argc))
+        {
+            if (parsePin(argv[++i], reset_pin) < 0)
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--target") && (i + 1 < argc))
+        {
+            if (parseTarget(argv[++i], targets) < 0)
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--dump") && (i + 1 < argc))
+            dump->path = argv[++i];
+        else if (!strcmp(argv[i], "--raw"))
+            dump->raw = true;
+        else if (!strcmp(argv[i], "--range") && (i + 1 < argc))
+        {
+            if (parseRange(argv[++i], dump) < 0)
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--base") && (i + 1 < argc))
+        {
+            if (parseBase(argv[++i], base) < 0)
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--delta") && (i + 1 < argc))
+            *delta_path = argv[++i];
+        else if (!strcmp(argv[i], "--loader") && (i + 1 < argc))
+            *loader_path = argv[++i];
+        else if (!strcmp(argv[i], "--check"))
+            *check = true;
+        else if (!strcmp(argv[i], "--baud") && (i + 1 < argc))
+        {
+            if (parseBaud(argv[++i], baud) < 0)
+                return -1;
+        }
+        else if ((!strcmp(argv[i], "--events") || !strcmp(argv[i], "--events-fd")) && (i + 1 < argc))
+        {
+            if (parseEvents(argv[i], argv[i + 1], events) < 0)
+                return -1;
+            i++;
+        }
+        else if ((argv[i][0] != '-') && (*fw_path == NULL))
+            *fw_path = argv[i];
+        else
+            return -1;
+    }
+    if (*delta_path != NULL)
+        return ((*fw_path == NULL) && (dump->path == NULL) && !*check && (*base < 0)) ? 0 : -1;
+    if (*check)
+        return ((*fw_path != NULL) && (dump->path == NULL) && targets->empty() && (*loader_path == NULL)) ? 0 : -1;
+    if (dump->path != NULL)
+        return ((*fw_path == NULL) && targets->empty() && (*base < 0)) ? 0 : -1;
+    return (*fw_path != NULL) ? 0 : -1;
+}
+
+/**
+ * @brief      Read the module's flash back into a file, a rollback image
+ *             of what it runs now.
+ *
+ * @return     0 on success, else the result of the failed step.
+ */
+int dumpModule(QCoreApplication &app, const char *port, u_int16_t boot_pin, u_int16_t reset_pin,
+               const DumpOptions &dump, const BootCodeSet *loaders, EventLog *events)
+{
+    PhytecModule module((const FlashImage *)NULL, port, boot_pin, reset_pin);
+    int ret;
+
+    module.setProgressLog(false);
+    module.setLoaders(loaders);
+    module.setDump(dump.start, dump.len);
+    module.setEventLog(events);
+    QObject::connect(&module, &PhytecModule::finished, &QCoreApplication::exit);
+    QTimer::singleShot(0, &module, SLOT(start()));
+
+    ret = app.exec();
+    if (ret != 0)
+    {
+        qDebug("Flash dump failed. ( status = %d )", ret);
+        return ret;
+    }
+
+    if (dump.raw)
+        ret = module.firmware().saveBinary(dump.path, dump.start, dump.len);
+    else
+        ret = module.firmware().save(dump.path);
+    if (ret != NO_ERROR)
+    {
+        qDebug("Could not write %s", dump.path);
+        return -1;
+    }
+    qDebug("Flash %06X..%06X saved to %s", dump.start, dump.start + dump.len, dump.path);
+    return 0;
+}
+
+/**
+ * @brief      Read the firmware file for modules sharing one image: a raw
+ *             binary if a base address is given, else a text format, from
+ *             the image cache if it was flashed before.
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be used.
+ */
+int loadImage(FlashImage &image, const char *fw_path, long base)
+{
+    ImageCache cache;
+    int ret = cache.load(fw_path, base, image, PHYTEC_SECTOR_SIZE, PHYTEC_VERIFY_BLOCK);
+
+    if (ret != NO_ERROR)
+    {
+        if (ret < 0)
+            qDebug ("Could not open FW file.\n");
+        else
+            qDebug ("FW File invalid at line %d ( status = %d )", image.errorLine(), ret);
+        return -1;
+    }
+    qDebug ("FW File Loaded. ( %u bytes in %u blocks, %s%s )", image.size(),
+            (unsigned int)image.blocks().size(), image.formatName(), cache.wasHit() ? ", cached" : "");
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Read a delta file written by flash-delta.
+ *
+ * @return     NO_ERROR on success, -1 if the file can not be used.
+ */
+int loadDelta(ImageDelta &delta, const char *delta_path)
+{
+    int ret = delta.load(delta_path);
+
+    if (ret != NO_ERROR)
+    {
+        if (ret < 0)
+            qDebug ("Could not open delta file.\n");
+        else
+            qDebug ("Delta file invalid ( status = %d )", ret);
+        return -1;
+    }
+    if (delta.sectorSize() != PHYTEC_SECTOR_SIZE)
+    {
+        qDebug ("Delta file made for %X byte sectors, the module has %X", delta.sectorSize(), PHYTEC_SECTOR_SIZE);
+        return -1;
+    }
+    qDebug ("Delta Loaded. ( %04X -> %04X, %u of %u sectors, %u bytes )", delta.baseChecksum(),
+            delta.targetChecksum(), delta.changedSectors(), (unsigned int)delta.sectors().size(),
+            delta.changes().size());
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Collect the boot code variants: the built-in one, those in
+ *             PHYTEC_LOADER_DIR and those named by --loader.  A file that
+ *             fails in the directory is left out; one given by --loader
+ *             stops the run.
+ *
+ * @return     NO_ERROR on success, -1 if a --loader file can not be used.
+ */
+int loadLoaders(BootCodeSet &loaders, const char *loader_path)
+{
+    struct stat st;
+    int ret;
+
+    if (stat(PHYTEC_LOADER_DIR, &st) == 0)
+    {
+        ret = loaders.add(PHYTEC_LOADER_DIR);
+        if (ret != NO_ERROR)
+            qDebug ("Boot code in %s partly unusable ( status = %d ), skipped", PHYTEC_LOADER_DIR, ret);
+    }
+    if (loader_path != NULL)
+    {
+        ret = loaders.add(loader_path);
+        if (ret != NO_ERROR)
+        {
+            if (ret < 0)
+                qDebug ("Could not open boot code %s.\n", loader_path);
+            else
+                qDebug ("Boot code %s invalid ( status = %d )", loader_path, ret);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < loaders.variants().size(); i++)
+    {
+        const BootCode &variant = loaders.variants()[i];
+
+        qDebug ("Boot code: id %02X version %d, %u bytes, crc %04X ( %s )", variant.bslId(),
+                variant.version(), variant.size(), variant.checksum(), variant.origin());
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief      Flash several modules at once with one copy of the image, or
+ *             apply one delta to all of them.
+ *
+ * @return     0 if every target was flashed, else the result of the first
+ *             target that failed.
+ */
+int flashGroup(QCoreApplication &app, const char *fw_path, long base, const char *delta_path,
+               const std::vector<FlashTarget> &targets, const BootCodeSet *loaders, EventLog *events)
+{
+    FlashImage image;
+    ImageDelta delta;
+
+    if (delta_path ? (loadDelta(delta, delta_path) != NO_ERROR) : (loadImage(image, fw_path, base) != NO_ERROR))
+        return -1;
+    qDebug ("Flashing %d targets", (int)targets.size());
+
+    FlashGroup group(delta_path ? &delta.changes() : &image, targets);
+    if (delta_path)
+        group.setDelta(&delta);
+    group.setLoaders(loaders);
+    group.setEventLog(events);
+    QObject::connect(&group, &FlashGroup::finished, &QCoreApplication::exit);
+    QTimer::singleShot(0, &group, SLOT(start()));
+
+    if (app.exec() == 0)
+        return 0;
+    for (int i = 0; i < group.count(); i++)
+    {
+        if (group.result(i) != NO_ERROR)
+            return group.result(i);
+    }
+    return -1;
+}
+
+void errorMsg(const char* msg)
+{
+    qDebug() << "Error: " << SCITON_BOOT_LOADER_NAME << " - " << msg;
+}
 
 PhytecModule* ptec;
 
 /**
- * @brief      Entry point to Sciton Bootloader
+ * @brief      Entry point to Sciton Bootloader.  The connect and update run
+ *             as a state machine in the application event loop; the module
+ *             reports the result through finished().
  *
  * @param[in]  argc  The argc
  * @param      argv  The argv
  *
- * @return     None
+ * @return     0 on success, else the result of the failed step.
  */
 int main(int argc, char *argv[])
 {    
-    if(argc == REQUIRED_ARG_NUM)
+    const char *fw_path, *port, *delta_path, *loader_path;
+    std::vector<FlashTarget> targets;
+    u_int16_t boot_pin, reset_pin;
+    DumpOptions dump;
+    EventLog events;
+    FlashImage binary;
+    ImageDelta delta;
+    BootCodeSet loaders;
+    bool check;
+    long base;
+    int ret = -1, args, baud;
+
+    QCoreApplication sciton_app(argc, argv);
+
+    args = parseArgs(argc, argv, &fw_path, &port, &boot_pin, &reset_pin, &targets, &dump, &events,
+                     &check, &baud, &base, &delta_path, &loader_path);
+    if((args == 0) && !check && (loadLoaders(loaders, loader_path) != NO_ERROR))
+    {
+        return -1;
+    }
+    if((args == 0) && check)
+    {
+        // no hardware is touched, the image is only parsed and described
+        ret = checkImage(fw_path, base, baud, PHYTEC_MAX_BLOCK);
+    }
+    else if((args == 0) && (dump.path != NULL))
+    {
+        ret = dumpModule(sciton_app, port, boot_pin, reset_pin, dump, &loaders, &events);
+    }
+    else if((args == 0) && !targets.empty())
+    {
+        ret = flashGroup(sciton_app, fw_path, base, delta_path, targets, &loaders, &events);
+    }
+    else if(args == 0)
 	{
 	    qDebug() << "Creating Phytec Module";
         try
         {
-            ptec = new PhytecModule(argv[FW_PATH_ARG]);
-            if (!ptec->bIsFileOpened())
+            if (delta_path != NULL)
+            {   // only the changed sectors are written, an empty delta is fine
+                if (loadDelta(delta, delta_path) != NO_ERROR)
+                    return -1;
+                ptec = new PhytecModule(&delta.changes(), port, boot_pin, reset_pin);
+                ptec->setDelta(&delta);
+            }
+            else if (base >= 0)
+            {   // a raw binary needs its address, the module takes the parsed image
+                if (loadImage(binary, fw_path, base) != NO_ERROR)
+                    return -1;
+                ptec = new PhytecModule(&binary, port, boot_pin, reset_pin);
+            }
+            else
+                ptec = new PhytecModule(fw_path, port, boot_pin, reset_pin);
+            if ((delta_path == NULL) && !ptec->bIsFileOpened())
             {
                 qDebug(" File open error. Abort");
                 delete ptec;
                 return -1;
             }
 
-            init = timerInit(400);    // about 6+ minutes
+            ptec->setLoaders(&loaders);
+            ptec->setEventLog(&events);
+
+            // about 6+ minutes for the whole run, see PHYTEC_RUN_TIMEOUT
+            QObject::connect(ptec, &PhytecModule::finished, &QCoreApplication::exit);
+            QTimer::singleShot(0, ptec, SLOT(start()));
 
             qDebug() << "Connect to the Module";
-            ret = ptec->connectModule();
-            if (ret < 0)
+            ret = sciton_app.exec();
+            if ((ret < 0) && (ptec->stats().connect_ms == 0))
             {   // -1: polling timeout. -2: no data or invalid data received
                 qDebug() << "main: no connection response from the Host.\n";
-                delete ptec;
-                return ret;
-            }
-
-            if (0x31 == ret)
-            {
-                delete ptec;
-                qDebug() << " conenction: invalid level 1 reponse. Abort.\n";
-                return ret;
             }
-
-            // if the connection was established within max. 5 second then continue
-            ret = -1;
-            qDebug() << " Update the Module\n";
-            ret = ptec->updateModule();
             delete ptec;
         }
         catch(std::runtime_error &e)
@@ -110,43 +526,9 @@ int main(int argc, char *argv[])
 	}
 	else
 	{
-        usage("Incorrect number of arguments\n");
+        usage("Incorrect arguments\n");
 	}
-    //return sciton_app.exec();
     return ret;   // 0: success
 }
 
-void timeoutCallback(void)
-{
-    if (init < 0)
-        return;
-
-    qDebug() << " Time out in update process! Exit.";
-    if (ptec)
-        delete ptec;
-    exit(-4);
-}
-
-int timerInit(unsigned int interval)
-{
-    // Upon SIGALRM, call timeoutCallback().
-    if (signal(SIGALRM, (void (*)(int)) timeoutCallback) == SIG_ERR) {
-      perror("Unable to catch SIGALRM");
-      qDebug() << " Unable to catch SIGALRM.";
-      return -1;
-    }
-    it_val.it_interval.tv_sec =     0;
-    it_val.it_interval.tv_usec =    0;
-    it_val.it_value.tv_sec = interval; /* set timer for 'INTERVAL' */
-    it_val.it_value.tv_usec = 0;
-    if (setitimer(ITIMER_REAL, &it_val, NULL) == -1) {
-      perror(" error calling setitimer()");
-      qDebug() << " Terror calling setitimer().";
-      return -1;
-    }
-    qDebug() << " Timer is set to go ...";
-    return 0;
-}
-
-
 /*! @} */
@@ -12,41 +12,36 @@
   */
 #include <termios.h>
 #include "phytecmodule.h"
-#include "bootcode.cpp"
 #include "math.h"
 #include <stdexcept>
 #include <poll.h>
+#include <errno.h>
+#include "crc.h"
+#include "rle.h"
+#include "imagecache.h"
+
+// rates tried by the baud switch, fastest first
+static const struct { speed_t speed; int rate; } baud_rates[] = {
+    { B921600, 921600 },
+    { B460800, 460800 },
+};
+
+// boot code of a module no other variants were handed to
+static const BootCodeSet builtin_loaders;
+
+// names of the FLASH_STATE values in the event log
+static const char *const state_names[] = {
+    "idle", "reset", "wake", "bsl_id", "boot_l1", "boot_l2", "l2_sync", "connected",
+    "query", "baud_request", "baud_settle", "baud_test", "baud_fallback", "baud_recheck",
+    "resume_check", "sector_crc", "erase", "sector_erase", "program", "verify", "dump", "release", "done"
+};
 
-u_int16_t PhytecModule::hex2short(u_int8_t* ptr)
-{
-    u_int16_t b;
-
-    b = hex2nibble(ptr[0]);
-    b <<= 4;
-    b |= hex2nibble(ptr[1]);
-    b <<= 4;
-    b |= hex2nibble(ptr[2]);
-    b <<= 4;
-    b |= hex2nibble(ptr[3]);
-    return b;
-}
-
-u_int8_t PhytecModule::hex2nibble(u_int8_t c)
-{
-	if (c>0x60) c-= 0x20; 	// convert to upper case
-							// numbers are 0x30-0x39
-							// ascii letters are 0x41-0x5? or 0x61-0x7?
-	if (c>='0' && c<='9') 
-		return (c-'0');
-	else 
-		return (c - 'A'+ 0x0A) ;
-}
-
-u_int8_t PhytecModule::hex2byte(u_int8_t *ptr)
+/**
+ * @brief      Bytes per second of a phase, 0 if it took no measurable time.
+ */
+static long long throughput(u_int32_t bytes, qint64 ms)
 {
-    u_int8_t b;
-	b = hex2nibble(ptr[1]) + (hex2nibble(ptr[0])<<4);
-	return b;
+    return (ms > 0) ? (long long)bytes * 1000 / ms : 0;
 }
 
 void PhytecModule::add_checksum(u_int8_t *buffer, u_int8_t len)
@@ -59,243 +54,58 @@ void PhytecModule::add_checksum(u_int8_t *buffer, u_int8_t len)
 	buffer[len] = (u_int8_t)(-checksum);
 }
 
-int	PhytecModule::read_fw_hex_line( char *line )
-{
-    char *ln = NULL;
-    size_t len = 0;
-	ssize_t read = -1;
-
-	if (fw_file_ptr != NULL)
-	{
-        read = getline(&ln, &len, fw_file_ptr);
-        strcpy(line,ln);
-        if(ln){free(ln);}
-	}
-	else
-	{
-        qDebug("PhytecModule::Could not open file\n");
-	}
-
-	return read;
-}
-
-u_int8_t PhytecModule::write_fw_hex_record(u_int8_t *record)
-{
-    u_int8_t i, chksum, status = NO_ERROR;	// Assume OK, line will be written
-    u_int8_t len, record_type;
-    u_int8_t line[22];
-    u_int16_t offset;
-
-    // Record Format:
-    //
-    // +--------+--------+------+-------+--------+------(n bytes)------+----------+
-    // | RECORD | RECLEN |    OFFSET    | RECORD |                     | CHECKSUM |
-    // |  MARK  |  (n)   |   (2 BYTES)  |  TYPE  |        DATA         |          |
-    // |  ':'   |        |              |        |                     |          |
-    // +--------+--------+------+-------+--------+------(n bytes)------+----------+
-    //
-    if(record[0] == ':')
-    {
-        chksum = len = hex2byte(record + 1);	// get the record length, initialize checksum
-        offset = hex2short(record + 3);  		// get the starting address (offset field in HEX record)
-        record_type = hex2byte(record + 7);		// get the record type
-        // only 0, 1 and 4 are valid types
-        if((record_type == 0) || (record_type == 1) || (record_type == 4))
-        {
-        	for(i=2; i<len + 6; i++)
-                chksum += line[i] = hex2byte(record + (2*i - 1));	// check if checksum is OK
-            if(chksum)
-                    status = ERR_FW_CHKSUM;			// checksum should be 0
-            else									// checksum is OK
-            {
-                if(record_type == 1)				// record type '1' is final record
-                    status = STATUS_FW_SUCCESS;		// indicate success
-                else if	(record_type == 4)			// record type '4'
-                {
-                	if((len != 2) || (offset != 0))
-                        status = ERR_FW_DECODE;		// Bad record type
-                    else
-                    {
-                    	Current_Segment = line[6];
-                        status = STATUS_NO_WRITE;	// NO Line Written
-                    }
-                }
-                else								// record type '0'
-                {
-                    // Re-arrange the line a bit to make up a Phytec command
-                    // Offset and Data stay in place
-                    line[0] = 0x0B;					// Write command
-                    line[1] = Current_Segment;
-                    line[4] = len;					// replace the offset with length byte
-                    if(len < 17)
-                    {
-                        add_checksum(line, len + 5);	// Add Checksum to command
-                        sendSerial(line, len + 6);	// Write the command
-                    }
-                    else
-                    status = ERR_FW_DECODE;
-                line_nr++;
-            }
-        }
-    }
-    else
-            status = ERR_FW_DECODE;					// Bad record type
-    }
-    else
-        status = ERR_FW_BAD_LINE;					// ':' missing from record
-
-    return status;
-}
-
-/**
- * @brief      Export sysfs gpio pin
- *
- * @param[in]  pin_number  The pin number
- */
-void PhytecModule::gpio_export(u_int16_t pin_number)
-{
-	int fd, len;
-	char buf[MAX_BUF];
-
-	fd = open(SYSFS_GPIO_DIR "/export", O_WRONLY);
-	len = snprintf(buf, sizeof(buf), "%d", pin_number );
-	write(fd, buf, len);
-	close(fd);
-}
-
-/**
- * @brief      Unexport sysfs gpio pin
- *
- * @param[in]  pin_number  The pin number
- */
-void PhytecModule::gpio_unexport(u_int16_t pin_number)
-{
-	int fd, len;
-	char buf[MAX_BUF];
-
-	fd = open(SYSFS_GPIO_DIR "/unexport", O_WRONLY);
-	len = snprintf(buf, sizeof(buf), "%d", pin_number );
-	write(fd, buf, len);
-	close(fd);
-}
-
 /**
- * @brief      Set sysfs pin direction.
+ * @brief      The held line driving a pin of this module.
  *
- * @param[in]  pin_number  The pin number
- * @param[in]  pin_dir     The pin dir
+ * @return     The line, NULL if the pin is neither the boot nor the reset pin.
  */
-void PhytecModule::gpio_set_direction(u_int16_t pin_number, PIN_DIRECTION pin_dir )
+GpioLine *PhytecModule::lineFor(u_int16_t pin_number)
 {
-	int fd, len;
-	char buf[MAX_BUF];
-
-	len = snprintf(buf, sizeof(buf), "%s/gpio%d/direction", SYSFS_GPIO_DIR, pin_number );
-	fd = open(buf, O_WRONLY);
-
-	if (pin_dir == PIN_OUTPUT)
-	{
-		len = snprintf(buf, sizeof(buf), "%s", "out" );
-	}
-	else
-	{
-		len = snprintf(buf, sizeof(buf), "%s", "in" );
-	}
-
-	write(fd, buf, len);
-	close(fd);
+    if (pin_number == boot_pin)
+        return &boot_line;
+    if (pin_number == reset_pin)
+        return &reset_line;
+    return NULL;
 }
 
 /**
- * @brief      Set sysfs pin value.
- *
- * @param[in]  pin_number  The pin number
- * @param[in]  pin_val     The pin value
+ * @brief      Open the link to the module: the UART, the emulator's pty or a
+ *             TCP bridge, see Transport::create().  The purpose of this port
+ *             is to send commands to the phytec module, and to receive
+ *             acknowledgements.
  */
-void PhytecModule::gpio_set_value(u_int16_t pin_number, PIN_VALUE pin_val )
+void PhytecModule::initSerial( const char* port )
 {
-	int fd, len;
-	char buf[MAX_BUF];
-
-	len = snprintf(buf, sizeof(buf), "%s/gpio%d/value", SYSFS_GPIO_DIR, pin_number );
-	fd = open(buf, O_WRONLY);
-
-	if (pin_val == PIN_HIGH)
-	{
-		len = snprintf(buf, sizeof(buf), "%d", 1 );
-	}
-	else
-	{
-		len = snprintf(buf, sizeof(buf), "%d", 0 );
-	}
-
-	write(fd, buf, len);
-	close(fd);
+    link = Transport::create(port);
+    link_owned = true;
+    initLink();
 }
 
 /**
- * @brief      Get sysfs pin value.  Pin directinon must be an input.
- *
- * @param[in]  pin_number  The pin number
- *
- * @return     Current value of the pin.
+ * @brief      Open the link unless the caller already did, and watch it.
  */
-int PhytecModule::gpio_get_value(u_int16_t pin_number )
+void PhytecModule::initLink( void )
 {
-	char pin_val;
-	int fd, result;
-	char buf[MAX_BUF];
-
-	snprintf(buf, sizeof(buf), "%s/gpio%d/value", SYSFS_GPIO_DIR, pin_number );
-	fd = open(buf, O_RDONLY);
-	read(fd, &pin_val, 1);
-
-	if (pin_val == '0')
-	{
-		result = 0;
-	}
-	else
-	{
-		result = 1;
-	}
-
-	close(fd);
+    if ((link->fd() < 0) && (link->open() < 0))
+    {
+        qDebug(" initSerial: could not open %s", link->name());
+        return;
+    }
+    link->setRate(PHYTEC_DEFAULT_BAUD);
 
-	return result;
+    rx_notifier = new QSocketNotifier(link->fd(), QSocketNotifier::Read, this);
+    tx_notifier = new QSocketNotifier(link->fd(), QSocketNotifier::Write, this);
+    tx_notifier->setEnabled(false);
+    connect(rx_notifier, &QSocketNotifier::activated, this, &PhytecModule::onReadable);
+    connect(tx_notifier, &QSocketNotifier::activated, this, &PhytecModule::onWritable);
 }
 
 /**
- * @brief      Initialize the serial port.  This acquire a termios file
- *             descriptor and opens the port as read write.  The purpose of
- *             this port is to send commands to the phytec module, and to receive
- *             acknowledgements.
+ * @brief      True once the link to the module is open.
  */
-void PhytecModule::initSerial( void )
+bool PhytecModule::linkOpen(void) const
 {
-	sciton_sio_fd = -1;
-    sioTtyRate =  B230400;
-
-	memset(&tio, 0, sizeof(tio));
-	tio.c_iflag = 0;
-	tio.c_oflag = 0;
-	tio.c_cflag = CS8 | CREAD | CLOCAL;
-	tio.c_lflag = 0;
-	tio.c_cc[VMIN] = 1;
-	tio.c_cc[VTIME] = 5;
-
-	sciton_sio_fd = posix_openpt(O_RDWR | O_NOCTTY);
-	tcsetattr(sciton_sio_fd, TCSANOW, &tio);
-
-	grantpt(sciton_sio_fd);
-	unlockpt(sciton_sio_fd);
-
-    sciton_sio_fd = open(PHYTEC_DEBUG_PORT, O_RDWR);
-
-    //qDebug() << "sciton_sio_fd == " << sciton_sio_fd << "\n";
-
-	cfsetospeed(&tio, sioTtyRate);
-	cfsetispeed(&tio, sioTtyRate);
-	tcsetattr(sciton_sio_fd, TCSANOW, &tio);
+    return link && (link->fd() > -1);
 }
 
 /**
@@ -308,14 +118,12 @@ u_int16_t PhytecModule::sendSerial(const char *str)
 	char   buf[MAX_BUF];
     size_t len = -1, wrote = -1;
 
-    if(sciton_sio_fd > -1 )
+    if(linkOpen())
     {	
     	sprintf(buf, "%s\r\n", str);
     	len = strlen(buf);
 
-    	//qDebug() << "sciton_sio_fd == " << sciton_sio_fd << "length = " << len << "\n";
-
-    	wrote = write(sciton_sio_fd, buf, len );
+    	wrote = write(link->fd(), buf, len );
 
     	//qDebug() << "buf = " << buf << "\n";
     	//qDebug() << "wrote = " << wrote << "\n";
@@ -332,9 +140,9 @@ u_int16_t PhytecModule::sendSerial( u_int8_t *str, int len)
 {
     size_t wrote = -1;
 
-    if(sciton_sio_fd > -1 )
+    if(linkOpen())
     {	
-    	wrote = write(sciton_sio_fd, str, len );
+    	wrote = write(link->fd(), str, len );
     	//qDebug() << "wrote = " << wrote << "\n";
     }
     else
@@ -357,9 +165,9 @@ u_int16_t PhytecModule::readSerial( char *buf, u_int16_t num_bytes )
 {
     size_t len = -1;
 
-    if(sciton_sio_fd > -1 )
+    if(linkOpen())
     {	
-    	len 	= read(sciton_sio_fd, buf, num_bytes );
+    	len 	= link->receive((u_int8_t *)buf, num_bytes );
     	//qDebug("read buf = %x\n", buf[0]);
     	//qDebug() << "read len = " << len << "\n";
     }
@@ -380,9 +188,14 @@ u_int16_t PhytecModule::readSerial( char *buf, u_int16_t num_bytes )
  */
 void PhytecModule::initGPIOPin( u_int16_t pin_number, PIN_DIRECTION pin_dir, PIN_VALUE pin_val )
 {
-	gpio_export(pin_number);
-	gpio_set_direction(pin_number, pin_dir);
-    gpio_set_value(pin_number, pin_val);
+    GpioLine *line = lineFor(pin_number);
+
+    if (line == NULL)
+        return;
+    if (line->request(pin_number, pin_dir, pin_val) < 0)
+        qDebug(" initGPIOPin: GPIO %d not available", pin_number);
+    else if (!line->isCharDev())
+        qDebug(" initGPIOPin: GPIO %d driven through sysfs", pin_number);
 }
 
 /**
@@ -392,7 +205,10 @@ void PhytecModule::initGPIOPin( u_int16_t pin_number, PIN_DIRECTION pin_dir, PIN
  */
 void PhytecModule::setGPIOPin( u_int16_t pin_number )
 {
-    gpio_set_value(pin_number, PIN_HIGH);
+    GpioLine *line = lineFor(pin_number);
+
+    if (line)
+        line->set(PIN_HIGH);
 }
 
 /**
@@ -402,7 +218,10 @@ void PhytecModule::setGPIOPin( u_int16_t pin_number )
  */
 void PhytecModule::resetGPIOPin( u_int16_t pin_number )
 {
-    gpio_set_value(pin_number, PIN_LOW);
+    GpioLine *line = lineFor(pin_number);
+
+    if (line)
+        line->set(PIN_LOW);
 }
 
 /**
@@ -413,7 +232,10 @@ void PhytecModule::resetGPIOPin( u_int16_t pin_number )
  */
 void PhytecModule::releaseGPIOPin( u_int16_t pin_number )
 {
-	gpio_unexport(pin_number);
+    GpioLine *line = lineFor(pin_number);
+
+    if (line)
+        line->release();
     qDebug(" PhytecModule::releaseGPIOPin\n");
 }
 
@@ -422,8 +244,8 @@ void PhytecModule::releaseGPIOPin( u_int16_t pin_number )
  */
 void PhytecModule::initGPIO( void )
 {
-	initGPIOPin(PHYTEC_BOOT_PIN, PIN_OUTPUT, PIN_HIGH);
-	initGPIOPin(PHYTEC_RESET_PIN, PIN_OUTPUT, PIN_LOW);
+	initGPIOPin(boot_pin, PIN_OUTPUT, PIN_HIGH);
+	initGPIOPin(reset_pin, PIN_OUTPUT, PIN_LOW);
 }
 
 /**
@@ -435,14 +257,14 @@ void PhytecModule::toggleGPIO( void )
 
 	if(tog)
 	{
-		setGPIOPin(PHYTEC_BOOT_PIN);
-		resetGPIOPin(PHYTEC_RESET_PIN);
+		setGPIOPin(boot_pin);
+		resetGPIOPin(reset_pin);
 		tog = false;
 	}
 	else
 	{
-		resetGPIOPin(PHYTEC_BOOT_PIN);
-		setGPIOPin(PHYTEC_RESET_PIN);
+		resetGPIOPin(boot_pin);
+		setGPIOPin(reset_pin);
 		tog = true;
 	}
 }
@@ -452,265 +274,2337 @@ void PhytecModule::toggleGPIO( void )
  */
 void PhytecModule::releaseGPIO( void )
 {
-    resetGPIOPin(PHYTEC_BOOT_PIN);
-    resetGPIOPin(PHYTEC_RESET_PIN);
-    QThread::msleep( 1000 );
-    setGPIOPin(PHYTEC_RESET_PIN);
+    holdReset();
+    QThread::msleep( PHYTEC_RESET_HOLD );
+    endReset();
+
+    //releaseGPIOPin(boot_pin);
+    //releaseGPIOPin(reset_pin);
+}
+
+/**
+ * @brief      First half of releaseGPIO(): boot pin low, reset held.  A
+ *             run that releases the module on finish waits PHYTEC_RESET_HOLD
+ *             in FLASH_RELEASE before endReset() instead of sleeping.
+ */
+void PhytecModule::holdReset( void )
+{
+    resetGPIOPin(boot_pin);
+    resetGPIOPin(reset_pin);
+}
 
-    //releaseGPIOPin(PHYTEC_BOOT_PIN);
-    //releaseGPIOPin(PHYTEC_RESET_PIN);
+/**
+ * @brief      Second half of releaseGPIO(): let the module start its
+ *             application.  The destructor then leaves the pins alone.
+ */
+void PhytecModule::endReset( void )
+{
+    setGPIOPin(reset_pin);
+    gpio_released = true;
 }
 
 /**
  * @brief      Establish a connection with the phytec module, and upload the
- *             bootcode.
+ *             bootcode.  Runs the state machine in a local event loop until
+ *             the level 2 loader is up.
+ *
+ * @return     0 once connected, else the result of the failed step.
  */
 int PhytecModule::connectModule( void )
 {
-    int ret, rd_status = -1;
-    char   buf[MAX_BUF];
-    u_int8_t command[] = {0x00};
-    int fd = sciton_sio_fd;
-    // Connect State 0, reset low, boot high
-	setGPIOPin(PHYTEC_BOOT_PIN);
-	resetGPIOPin(PHYTEC_RESET_PIN);
-
-	// Wait 10 ms, raise RESET, keep BOOT high
-    QThread::msleep( 10 );
-	setGPIOPin(PHYTEC_RESET_PIN);
-
-    //-------------------- phase 1 -------------------
-    QThread::msleep( 500 );
-    qDebug(" connectModule: Waited 500 ms for phytec to wake up, now send first test command '00'");
-    write( sciton_sio_fd, command, 1 );
-
-    qDebug(" connectModule: now wait 100 msec for reponse D5h");
-    ret = -1;
-	// Wait 100 ms for a phytec response
-    QThread::msleep( 100 );
-
-    rd_status = pollRx(fd, 2000);    // 2000 msec
-    if (rd_status == 1) // 1: incoming data is available, 0: no data at time out
-        ret = readSerial(buf,64);   // good response in buf[0] is D5h, else some value
-    else {
-        qDebug(" phase 1. first read time out");
+    if ((state != FLASH_IDLE) && (state != FLASH_DONE))
         return -1;
-    }
-    qDebug(" connectModule: first reponse to command 00 is: %0X", buf[0]);  // D5h
-    if ((int)(buf[0]) != 0xD5) {
-        qDebug(" phase 1. response to command 00 is invalid (%0X). Abort connection.\n", buf[0]);
-        return -2;
-    }
 
-    //-------------------- phase 2 -------------------
-    qDebug(" connectModule: phase 2. now send level 1 boot code");
-    write( sciton_sio_fd, boot_code, 32 );
-    // Wait 100 ms for a phytec response
-    QThread::msleep( 100 );
-
-    qDebug(" connectModule: waited 100 msec, and now expect reponse 31h");
+    update_requested = false;
+    beginBootstrap();
+    return runUntil(FLASH_CONNECTED);
+}
 
-    rd_status = pollRx(fd, 2000);    // 2000 msec
-    if (rd_status == 1) // 1: incoming data is available, 0: no data at time out
-        ret = readSerial(buf,1);   // good response in buf[0] is 31h, else some value
-    else {
-        qDebug(" phase 2. 2nd read time out\n");
+/**
+ * @brief      Erase the firmware, and update the module.  With a loader that
+ *             can erase single sectors only the sectors whose contents
+ *             differ from the image are erased and programmed.  Runs the
+ *             state machine in a local event loop until the update is done.
+ *
+ * @return     NO_ERROR on success, else the result of the failed step.
+ */
+int PhytecModule::updateModule( void )
+{
+    if (state != FLASH_CONNECTED)
         return -1;
-    }
-    // check if the Host returns at least 1 (number of bytes)
-    if (ret < 1) {
-        qDebug(" connectModule: phase 2. No response from serial port");
-        return ret;
-    }
-    // The Phytec CPU should response 0x31 to acknowledge the boot code
-    qDebug(" connectModule: phase 2. reponse 1: %0X", buf[0]);
-    if(0x31 != buf[0]) {
-        qDebug(" connectModule: phase 2. level 1 bootcode response (%0X) not valid", buf[0]);
-        return (int)(buf[0]);
-    }
 
-    //-------------------- phase 3 -------------------
-    int repeat_count = (sizeof(boot_code)/32);
-    qDebug(" phase 3. send number of bytes: %d", repeat_count-1);
-    for(int x = 1; x < repeat_count; x++)
-    {
-        write( sciton_sio_fd, boot_code+(32*x), 32 );
-    }
+    update_requested = true;
+    beginUpdate();
+    return runUntil(FLASH_DONE);
+}
 
-    // Wait 500 ms for phytec to wake up, send first test command byte '00'
-    QThread::msleep( 500 );
-    write( sciton_sio_fd, command, 1 );
+/**
+ * @brief      Connect and update without waiting; finished() reports the
+ *             result.  The caller's event loop drives the whole run.
+ */
+void PhytecModule::start( void )
+{
+    if ((state != FLASH_IDLE) && (state != FLASH_DONE))
+        return;
 
-    // Wait 100 ms for a phytec response then read
-    QThread::msleep( 100 );
+    update_requested = true;
+    beginBootstrap();
+}
 
-    // The Phytec CPU should response 0x01 to acknowledge       
-    rd_status = pollRx(fd, 2000);   // 2000 msec
-    if (rd_status == 1) // 1: incoming data is available, 0: no data at time out
-        ret = readSerial(buf,1);   // good response in buf[0] is 1, else some value
-    else {
-        qDebug(" phase 3. 3rd read time out");
-        return -1;
-    }
-    qDebug(" connectModule: phase 3. final reponse 2: %0X", buf[0]);
+/**
+ * @brief      Abandon the run.  finished() reports PHYTEC_RESULT_CANCELLED.
+ */
+void PhytecModule::cancel( void )
+{
+    qDebug(" cancel: run abandoned in state %d", state);
+    finish(PHYTEC_RESULT_CANCELLED);
+}
 
-    if (1 != (int)(buf[0]))
-        return -1;
+FLASH_STATE PhytecModule::currentState( void ) const
+{
+    return state;
+}
 
-    return 0;   // 0: success connection, boot code is ready. It's time to do update
+/**
+ * @brief      Run the local event loop until the state machine reaches stop
+ *             or finishes.
+ *
+ * @return     0 if stop was reached, else the result of the run.
+ */
+int PhytecModule::runUntil(FLASH_STATE stop)
+{
+    QEventLoop loop;
+
+    if ((state != stop) && (state != FLASH_DONE))
+    {
+        waiting_loop = &loop;
+        waiting_for = stop;
+        loop.exec();
+        waiting_loop = NULL;
+    }
+    return (state == FLASH_DONE) ? result : 0;
 }
 
 /**
- * @brief      Erase the firmware, and update the module.
+ * @brief      Move to a new state and arm its deadline.
+ *
+ * @param[in]  next        The new state
+ * @param[in]  timeoutVal  The msec before onDeadline() fires, 0 for none
  */
-int PhytecModule::updateModule( void )
+void PhytecModule::enterState(FLASH_STATE next, int timeoutVal)
 {
-	u_int8_t status = NO_ERROR;
-    static char   buf[MAX_BUF];
-    static char   record[MAX_BUF];
-	float percent_done = (float)0.0;
-	int bytes_remaining = fw_file_size;
-    int rd_status = -1;
-    int fd = sciton_sio_fd;
-    qDebug(" updateModule: Erasing Flash");
+    bool changed = (next != state);
 
-    u_int8_t command[] = {0x09, 0xF7};
-    write( sciton_sio_fd, command , 2 );
+    state = next;
+    state_timer.stop();
+    if (timeoutVal > 0)
+        state_timer.start(timeoutVal);
+    if (changed)
+        emit stateChanged(state);
 
-    qDebug(" updateModule: Waiting for Erase Completion...");
+    if (waiting_loop && ((state == waiting_for) || (state == FLASH_DONE)))
+        waiting_loop->quit();
+}
 
-    QThread::msleep( 30000 );
-    rd_status = pollRx(fd, 2000);
-    if (rd_status == 1) // 1: incoming data is available, 0: no data at time out
-        readSerial(buf,3);   // good response in buf[2] is 0x06, else some value
-    else {
-        qDebug(" updateModule: Eraser read time out");
-        return -5;
+/**
+ * @brief      End the run with a result and report it, after the reset
+ *             hold if the run releases the module.
+ */
+void PhytecModule::finish(int code)
+{
+    if ((state == FLASH_DONE) || (state == FLASH_IDLE) || (state == FLASH_RELEASE))
+        return;
+
+    run_timer.stop();
+    pace_timer.stop();
+    tx_frames.clear();
+    tx_pos = 0;
+    tx_timer.stop();
+    if (journal_active)
+    {
+        writeJournal();				// the next run resumes from here
+        journal_active = false;
     }
-
-    if(buf[2]==0x06)
+    if (tx_notifier)
+        tx_notifier->setEnabled(false);
+    logEvent(event("result").num("code", code).str("state", state_names[state])
+             .num("ms", run_clock.elapsed()));
+    result = code;
+    if (release_on_finish)
     {
-        qDebug("Flash Erase Completed.\n");
-        qDebug("buf = %x, %x, %x\n" ,buf[0], buf[1],buf[2]);
-        qDebug("Read FW Hex File.\n");
-        qDebug(" percent done: %2.2f", percent_done);
-        qDebug(" bytes_remaining: %d", bytes_remaining);
+        // the reset hold runs off state_timer, the caller's thread goes on
+        holdReset();
+        enterState(FLASH_RELEASE, PHYTEC_RESET_HOLD);
+        return;
+    }
+    enterState(FLASH_DONE, 0);
+    emit finished(code);
+}
+
+/**
+ * @brief      Queue a frame for the link.  It is written as the link
+ *             accepts it; the caller never waits.
+ */
+void PhytecModule::queueTx(const u_int8_t *data, int len)
+{
+    tx_frames.push_back(std::vector<u_int8_t>(data, data + len));
+    onWritable();
+}
 
-        while( read_fw_hex_line(record) > 0 )
+/**
+ * @brief      Hand queued frames to the link, several per write, but keep
+ *             no more than PHYTEC_TX_HIGH_WATER bytes in the driver: what
+ *             sits there can not be called back by a flush and delays the
+ *             replies the state deadlines are timed against.
+ */
+void PhytecModule::onWritable(void)
+{
+    struct iovec iov[PHYTEC_TX_BATCH];
+    std::deque<std::vector<u_int8_t> >::const_iterator frame;
+    size_t room, bytes, offset;
+    int count, queued;
+    ssize_t n;
+
+    tx_timer.stop();
+    while (!tx_frames.empty())
+    {
+        queued = link->outQueue();
+        if (queued >= PHYTEC_TX_HIGH_WATER)
         {
-            //qDebug("Line Retrieved: %s\n", record);
-            //qDebug("Write line to Module.\n");
-            status = write_fw_hex_record((u_int8_t *)record);
-            QThread::msleep( 3 );   // this value achieve download in 6 minutes (from 20 minutes)
+            // the notifier would fire all along, wait for the line instead
+            tx_timer.start(drainTime(queued - PHYTEC_TX_HIGH_WATER / 2));
+            break;
+        }
+        room = (queued < 0) ? (size_t)-1 : (size_t)(PHYTEC_TX_HIGH_WATER - queued);
 
-            bytes_remaining-=1;
-			percent_done = 100.0 * ((float)bytes_remaining)/((float)fw_file_size);
-            qDebug() << "\033[2K" << "Percent Remaining: " << qSetRealNumberPrecision(3)
-                     << percent_done << "%";
+        count = 0;
+        bytes = 0;
+        for (frame = tx_frames.begin(); (frame != tx_frames.end()) && (count < PHYTEC_TX_BATCH) && (bytes < room); ++frame)
+        {
+            offset = count ? 0 : tx_pos;
+            iov[count].iov_base = (void *)&(*frame)[offset];
+            iov[count].iov_len = frame->size() - offset;
+            if (iov[count].iov_len > room - bytes)
+                iov[count].iov_len = room - bytes;
+            bytes += iov[count].iov_len;
+            count++;
+        }
 
-        	if(status != NO_ERROR)
-        	{
-                qDebug("writing to Module. status:%0X\n", status);
-        	}
-        };
+        n = link->send(iov, count);
+        if (n < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EINTR))
+            {
+                qDebug(" onWritable: write failed, errno %d", errno);
+                tx_frames.clear();			// the state deadline reports the failure
+                tx_pos = 0;
+            }
+            break;
+        }
 
-        qDebug("FW Hex File Read Completed.");
-    }
-    else {
-        status = -6;
-        qDebug(" Flash Erase NOT Completed. Code: %0X\n", buf[2]);
+        tx_pos += n;
+        while (!tx_frames.empty() && (tx_pos >= tx_frames.front().size()))
+        {
+            tx_pos -= tx_frames.front().size();
+            tx_frames.pop_front();
+        }
+        if ((size_t)n < bytes)
+            break;						// the driver is full
     }
-    if (status == 2)    // writer state machine returns 2 on success
-        status = 0;
 
-    return status;
+    if (tx_notifier)
+        tx_notifier->setEnabled(!tx_frames.empty() && !tx_timer.isActive());
+
+    // the level 2 boot code starts once all of it has gone out
+    if (tx_frames.empty() && (state == FLASH_BOOT_L2) && !state_timer.isActive())
+        state_timer.start(PHYTEC_WAKE_DELAY);
 }
 
-int countLinesInFile( FILE * fp )
+/**
+ * @brief      Msec the line needs to send bytes at the current rate, at
+ *             least 1.
+ */
+int PhytecModule::drainTime(int bytes)
 {
-	unsigned int number_of_lines = 0;
-    int ch;
+    int ms;
 
-    while (EOF != (ch=getc(fp)))
-	{
-		if ('\n' == ch)
-        ++number_of_lines;
-	}
-
-    return number_of_lines;
+    if (link->rate() <= 0)
+        return 1;
+    ms = (int)((long long)bytes * 10 * 1000 / link->rate());	// 8N1, ten bits per byte
+    return (ms > 0) ? ms : 1;
 }
 
-int PhytecModule::initFWFile( const char* path  )
+/**
+ * @brief      Collect what the target sent and hand it to the current state.
+ */
+void PhytecModule::onReadable(void)
 {
-    int result = -1;
+    u_int8_t buf[MAX_BUF];
+    ssize_t n;
+    bool got = false, closed;
 
-	fw_file_ptr = fopen( path , "r");
+    while ((n = link->receive(buf, sizeof(buf))) > 0)
+    {
+        rx_buf.insert(rx_buf.end(), buf, buf + n);
+        got = true;
+    }
+    closed = (n == 0) || ((errno != EAGAIN) && (errno != EINTR));
 
-	if (fw_file_ptr != NULL)
-	{
-		fw_file_size = countLinesInFile(fw_file_ptr);
-		rewind(fw_file_ptr);
-        result = 0;
-        qDebug ("FW File Open for Reading. ( size = %d )", fw_file_size );
-	}
-	else
-	{
-        qDebug ("Could not open FW file.\n");
-	}
-    return result;
+    if (got)
+        processRx();
+
+    if (closed)
+    {
+        qDebug(" onReadable: serial port closed");
+        if (rx_notifier)
+            rx_notifier->setEnabled(false);
+        finish(-1);
+    }
 }
 
-bool PhytecModule::bIsFileOpened(void)
+/**
+ * @brief      Take a reply of known length from the received bytes.  Bytes
+ *             beyond the reply are dropped.
+ *
+ * @return     true if the whole reply is in.
+ */
+bool PhytecModule::takeReply(u_int8_t *reply, int len)
 {
-    if (fw_file_ptr != NULL)
-        return  true;
-    return false;
+    if ((int)rx_buf.size() < len)
+        return false;
+
+    memcpy(reply, &rx_buf[0], len);
+    rx_buf.clear();
+    return true;
 }
 
-void PhytecModule::releaseFWFile( void )
+/**
+ * @brief      Drop received data, in the driver and in rx_buf.
+ *
+ * @param[in]  queue  TCIFLUSH or TCIOFLUSH
+ */
+void PhytecModule::flushRx(int queue)
 {
-	if (fw_file_ptr != NULL)
-	{
-		fclose(fw_file_ptr);
-	}
-    qDebug(" PhytecModule::releaseFWFile\n");
+    link->flush(queue);
+    rx_buf.clear();
 }
 
 /**
- * @brief      Phytec Module Constructor.  Initialize GPIO and serial port.
+ * @brief      Act on the received bytes according to the current state.
  */
-PhytecModule::PhytecModule(const char* path)
+void PhytecModule::processRx(void)
 {
-    // Initialize GPIO
-    initGPIO();
-    // Initialize Serial Port
-    initSerial();
-	// Initialize FW File
-    if( initFWFile( path ) != 0 )
+    u_int8_t reply[3];
+
+    switch (state)
     {
-         throw std::runtime_error( "Invalid FW Path" );
+    case FLASH_BSL_ID:
+        qDebug(" connectModule: first reponse to command 00 is: %0X", rx_buf[0]);  // D5h
+        // the answer identifies the derivative, which picks the boot code
+        boot_code = loaders->select(rx_buf[0]);
+        if (boot_code == NULL)
+        {
+            qDebug(" phase 1. response to command 00 is invalid (%0X), no boot code for it. Abort connection.\n", rx_buf[0]);
+            finish(-2);
+            return;
+        }
+        rx_buf.clear();
+        logEvent(event("boot_code").hex("bsl_id", boot_code->bslId()).num("version", boot_code->version())
+                 .hex("crc", boot_code->checksum()).num("bytes", boot_code->size()).str("origin", boot_code->origin()));
+
+        qDebug(" connectModule: phase 2. now send level 1 boot code, version %d (%s)", boot_code->version(), boot_code->origin());
+        enterState(FLASH_BOOT_L1, PHYTEC_BSL_TIMEOUT);
+        queueTx(boot_code->levelOne(), PHYTEC_BOOT_CHUNK);
+        break;
+
+    case FLASH_BOOT_L1:
+        // The Phytec CPU should response 0x31 to acknowledge the boot code
+        qDebug(" connectModule: phase 2. reponse 1: %0X", rx_buf[0]);
+        if (rx_buf[0] != PHYTEC_BSL_L1_ACK)
+        {
+            qDebug(" connectModule: phase 2. level 1 bootcode response (%0X) not valid", rx_buf[0]);
+            finish(rx_buf[0]);
+            return;
+        }
+        rx_buf.clear();
+
+        qDebug(" phase 3. send number of bytes: %d", (int)(boot_code->levelTwoSize() / PHYTEC_BOOT_CHUNK));
+        enterState(FLASH_BOOT_L2, 0);
+        queueTx(boot_code->levelTwo(), boot_code->levelTwoSize());
+        break;
+
+    case FLASH_L2_SYNC:
+        qDebug(" connectModule: phase 3. final reponse 2: %0X", rx_buf[0]);
+        if (rx_buf[0] != PHYTEC_L2_READY)
+        {
+            finish(-1);
+            return;
+        }
+        rx_buf.clear();
+        loaderReady();
+        break;
+
+    case FLASH_QUERY:
+        if (takeReply(reply, 3))
+            queryReply(reply);
+        break;
+
+    case FLASH_BAUD_REQUEST:
+        if (!takeReply(reply, 1))
+            break;
+        if (reply[0] != PHYTEC_ACK)
+        {
+            qDebug(" upgradeBaud: %d baud refused", baud_rates[baud_step].rate);
+            logBaud("refused");
+            baud_step++;
+            tryBaud();					// still talking at the old rate
+            break;
+        }
+        // the ack means the whole command went out, the line is idle
+        setSerialRate(baud_rates[baud_step].speed);
+        enterState(FLASH_BAUD_SETTLE, PHYTEC_BAUD_SETTLE);
+        break;
+
+    case FLASH_BAUD_TEST:
+    case FLASH_BAUD_RECHECK:
+        if (takeReply(reply, 3))
+            baudTestReply(reply);
+        break;
+
+    case FLASH_RESUME_CHECK:
+    case FLASH_VERIFY:
+        if (takeReply(reply, 3))
+            rangeCrcReply(reply);
+        break;
+
+    case FLASH_SECTOR_CRC:
+        if (takeReply(reply, 3))
+            sectorCrcReply(reply);
+        break;
+
+    case FLASH_ERASE:
+        if (!takeReply(reply, 3))		// good response in reply[2] is 0x06, else some value
+            break;
+        if (reply[2] != PHYTEC_ACK)
+        {
+            qDebug(" Flash Erase NOT Completed. Code: %0X\n", reply[2]);
+            finish(-6);
+            return;
+        }
+        qDebug("Flash Erase Completed in %d ms.\n", (int)reply_timer.elapsed());
+        qDebug("buf = %x, %x, %x\n", reply[0], reply[1], reply[2]);
+        beginProgram();
+        break;
+
+    case FLASH_SECTOR_ERASE:
+        if (!takeReply(reply, 1))
+            break;
+        if (reply[0] != PHYTEC_ACK)
+        {
+            qDebug(" eraseSector: sector %06X not erased", *erase_next);
+            finish(-5);
+            return;
+        }
+        qDebug(" eraseSector: sector %06X erased in %d ms", *erase_next, (int)reply_timer.elapsed());
+        ++erase_next;
+        eraseNextSector();
+        break;
+
+    case FLASH_PROGRAM:
+        takeAcks();
+        break;
+
+    case FLASH_DUMP:
+        takeReads();
+        break;
+
+    default:
+        rx_buf.clear();					// nothing expected, line noise
+        break;
     }
 }
 
 /**
- * @brief      Phytec Module Destructor.  Release all resources.
+ * @brief      The deadline of the current state has passed.  For the delay
+ *             states this is the next step, for the others a time out.
  */
-PhytecModule::~PhytecModule()
+void PhytecModule::onDeadline(void)
 {
-	// Release GPIO
-	releaseGPIO();	
-	// Release FW File
-	releaseFWFile();
+    u_int8_t command[] = {PHYTEC_BSL_SYNC};
+
+    switch (state)
+    {
+    case FLASH_RESET:
+        // raise RESET, keep BOOT high
+        setGPIOPin(reset_pin);
+        enterState(FLASH_WAKE, PHYTEC_WAKE_DELAY);
+        break;
+
+    case FLASH_WAKE:
+        qDebug(" connectModule: Waited 500 ms for phytec to wake up, now send first test command '00'");
+        flushRx(TCIFLUSH);
+        enterState(FLASH_BSL_ID, PHYTEC_BSL_TIMEOUT);
+        queueTx(command, 1);
+        break;
+
+    case FLASH_BSL_ID:
+        qDebug(" phase 1. first read time out");
+        finish(-1);
+        break;
+
+    case FLASH_BOOT_L1:
+        qDebug(" phase 2. 2nd read time out\n");
+        finish(-1);
+        break;
+
+    case FLASH_BOOT_L2:
+        // level 2 boot code had its time to start, send the sync byte
+        enterState(FLASH_L2_SYNC, PHYTEC_BSL_TIMEOUT);
+        queueTx(command, 1);
+        break;
+
+    case FLASH_L2_SYNC:
+        qDebug(" phase 3. 3rd read time out");
+        finish(-1);
+        break;
+
+    case FLASH_QUERY:
+        flushRx(TCIFLUSH);				// drop whatever a legacy loader sent back
+        qDebug(" queryLoader: no capability report, legacy loader assumed");
+        tryBaud();
+        break;
+
+    case FLASH_BAUD_REQUEST:
+        qDebug(" upgradeBaud: %d baud refused", baud_rates[baud_step].rate);
+        logBaud("refused");
+        baud_step++;
+        tryBaud();
+        break;
+
+    case FLASH_BAUD_SETTLE:
+        flushRx(TCIFLUSH);
+        sendQuery();					// test exchange at the new rate
+        enterState(FLASH_BAUD_TEST, PHYTEC_QUERY_TIMEOUT);
+        break;
+
+    case FLASH_BAUD_TEST:
+        qDebug(" upgradeBaud: %d baud failed, falling back", baud_rates[baud_step].rate);
+        logBaud("failed");
+        enterState(FLASH_BAUD_FALLBACK, PHYTEC_BAUD_FALLBACK);
+        break;
+
+    case FLASH_BAUD_FALLBACK:
+        setSerialRate(PHYTEC_DEFAULT_BAUD);
+        flushRx(TCIOFLUSH);
+        sendQuery();
+        enterState(FLASH_BAUD_RECHECK, PHYTEC_QUERY_TIMEOUT);
+        break;
+
+    case FLASH_BAUD_RECHECK:
+        qDebug(" upgradeBaud: target lost after fallback");
+        finish(-7);
+        break;
+
+    case FLASH_VERIFY:
+        qDebug(" verify: no CRC for block %06X", check_ranges[check_next].first);
+        finish(ERR_FW_VERIFY);
+        break;
+
+    case FLASH_RESUME_CHECK:
+        qDebug(" resume: no CRC for %06X, starting over", check_ranges[check_next].first);
+        resume_address = 0;
+        beginPlan();
+        break;
+
+    case FLASH_SECTOR_CRC:
+        if (delta)
+        {
+            qDebug(" delta: no CRC for sector %06X, base revision not confirmed", crc_next->first);
+            finish(PHYTEC_RESULT_WRONG_BASE);
+            break;
+        }
+        qDebug(" planSectors: no CRC for sector %06X, full erase", crc_next->first);
+        dirty.clear();
+        differential = false;
+        beginErase();
+        break;
+
+    case FLASH_ERASE:
+        qDebug(" updateModule: Eraser read time out");
+        finish(-5);
+        break;
+
+    case FLASH_SECTOR_ERASE:
+        qDebug(" eraseSector: sector %06X not erased", *erase_next);
+        finish(-5);
+        break;
+
+    case FLASH_PROGRAM:
+        qDebug(" drainAcks: no acknowledge for block %06X", ack_records[ack_head]);
+        endProgram();
+        break;
+
+    case FLASH_DUMP:
+        qDebug(" dump: no data for block %06X", ack_records[ack_head]);
+        finish(ERR_FW_ACK);
+        break;
+
+    case FLASH_RELEASE:
+        endReset();
+        enterState(FLASH_DONE, 0);
+        emit finished(result);
+        break;
+
+    default:
+        break;
+    }
 }
 
 /**
- * @brief      poll the serial port input
+ * @brief      The whole run took too long, the guard main.cpp used to keep
+ *             with SIGALRM.
  */
-int PhytecModule::pollRx(int fd, int timeoutVal)
+void PhytecModule::onRunTimeout(void)
 {
-    int rd_status = -1;
-    struct pollfd poll_struct = {fd, POLLIN, 0};
-    rd_status = poll(&poll_struct, 1, timeoutVal);
-    return rd_status;
+    qDebug(" Time out in update process! Exit.");
+    finish(PHYTEC_RESULT_TIMEOUT);
 }
 
+/**
+ * @brief      Reset the module into its bootstrap loader.  The level 1 and
+ *             level 2 boot code follow as the module answers.
+ */
+void PhytecModule::beginBootstrap(void)
+{
+    result = 0;
+    run_stats.connect_ms = 0;
+    run_stats.setup_ms = 0;
+    run_stats.erase_ms = 0;
+    run_stats.program_ms = 0;
+    run_stats.verify_ms = 0;
+    run_stats.dump_ms = 0;
+    phase.start();
+    run_clock.start();
+    run_timer.start(PHYTEC_RUN_TIMEOUT);
+    logEvent(event("start").str("mode", dump_requested ? "dump" : "update")
+             .num("image_bytes", fw->size()).num("parse_ms", run_stats.parse_ms));
+
+    if (!linkOpen())
+    {
+        qDebug() << "Serial Port has not been initialized.\n";
+        state = FLASH_RESET;
+        finish(-1);
+        return;
+    }
+    if (!dump_requested && !delta && (fw->size() == 0))
+    {   // nothing to write would leave every sector to be erased
+        qDebug(" updateModule: no firmware image to write. Abort");
+        state = FLASH_RESET;
+        finish(-1);
+        return;
+    }
+
+    // Connect State 0, reset low, boot high
+	setGPIOPin(boot_pin);
+	resetGPIOPin(reset_pin);
+    gpio_released = false;
+    enterState(FLASH_RESET, PHYTEC_RESET_PULSE);
+}
+
+/**
+ * @brief      The level 2 loader answered the sync byte.
+ */
+void PhytecModule::loaderReady(void)
+{
+    run_stats.connect_ms = phase.elapsed();
+    logEvent(event("phase").str("phase", "connect").num("ms", run_stats.connect_ms));
+
+    if (update_requested)
+        beginUpdate();
+    else
+        enterState(FLASH_CONNECTED, 0);
+}
+
+/**
+ * @brief      Ask the level 2 loader for its capabilities.  A loader that
+ *             supports the query answers with the largest write block it
+ *             accepts, its feature flags and an ACK.  The original loader
+ *             does not answer; it is then driven with 16 byte blocks.
+ */
+void PhytecModule::beginUpdate(void)
+{
+    phase.restart();
+    max_block = PHYTEC_LEGACY_BLOCK;
+    loader_features = 0;
+    baud_step = 0;
+
+    sendQuery();
+    enterState(FLASH_QUERY, PHYTEC_QUERY_TIMEOUT);
+}
+
+/**
+ * @brief      Send the capability query.
+ */
+void PhytecModule::sendQuery(void)
+{
+    u_int8_t command[] = {PHYTEC_CMD_QUERY, 0};
+
+    add_checksum(command, 1);
+    queueTx(command, sizeof(command));
+}
+
+/**
+ * @brief      Capability report: block size, feature flags and ACK.
+ */
+void PhytecModule::queryReply(const u_int8_t *reply)
+{
+    if ((reply[2] != PHYTEC_ACK) || (reply[0] < PHYTEC_LEGACY_BLOCK))
+    {
+        flushRx(TCIFLUSH);
+        qDebug(" queryLoader: no capability report, legacy loader assumed");
+    }
+    else
+    {
+        loader_features = reply[1];
+        max_block = (reply[0] > PHYTEC_MAX_BLOCK) ? PHYTEC_MAX_BLOCK : reply[0];
+        qDebug(" queryLoader: block size %d, features %0X", reply[0], reply[1]);
+    }
+    qDebug(" updateModule: writing blocks of up to %d bytes", max_block);
+    tryBaud();
+}
+
+/**
+ * @brief      Set the host side of the serial line to a new rate.
+ */
+void PhytecModule::setSerialRate(speed_t rate)
+{
+    link->setRate(rate);
+}
+
+/**
+ * @brief      Move the serial line to the fastest rate both sides can run,
+ *             trying baud_rates in order.  The loader acknowledges the baud
+ *             command at the current rate and then switches; if no valid
+ *             command reaches it at the new rate within
+ *             PHYTEC_BAUD_FALLBACK msec it returns to the default rate by
+ *             itself.  Once every rate is tried, planning starts.
+ */
+void PhytecModule::tryBaud(void)
+{
+    u_int8_t command[3];
+
+    if (!(loader_features & PHYTEC_FEATURE_BAUD) || (baud_step >= sizeof(baud_rates) / sizeof(baud_rates[0])))
+    {
+        linkReady();
+        return;
+    }
+
+    command[0] = PHYTEC_CMD_BAUD;
+    command[1] = baud_rates[baud_step].rate / 115200;	// rate in multiples of 115200
+    add_checksum(command, 2);
+    queueTx(command, sizeof(command));
+    enterState(FLASH_BAUD_REQUEST, PHYTEC_QUERY_TIMEOUT);
+}
+
+/**
+ * @brief      Reply to the test query after a rate change or a fallback.
+ */
+void PhytecModule::baudTestReply(const u_int8_t *reply)
+{
+    bool ok = (reply[1] == loader_features) && (reply[2] == PHYTEC_ACK);
+
+    if (state == FLASH_BAUD_TEST)
+    {
+        if (ok)
+        {
+            qDebug(" upgradeBaud: running at %d baud", baud_rates[baud_step].rate);
+            logBaud("running");
+            linkReady();
+        }
+        else
+        {
+            qDebug(" upgradeBaud: %d baud failed, falling back", baud_rates[baud_step].rate);
+            logBaud("failed");
+            enterState(FLASH_BAUD_FALLBACK, PHYTEC_BAUD_FALLBACK);
+        }
+        return;
+    }
+
+    // FLASH_BAUD_RECHECK, back at the default rate
+    if (reply[2] != PHYTEC_ACK)
+    {
+        qDebug(" upgradeBaud: target lost after fallback");
+        finish(-7);
+        return;
+    }
+    baud_step++;
+    tryBaud();
+}
+
+/**
+ * @brief      The line runs at its final rate; read the flash back or go on
+ *             with the update.
+ */
+void PhytecModule::linkReady(void)
+{
+    logEvent(event("loader").num("block", max_block).num("features", loader_features)
+             .num("baud", link->rate()));
+    if (dump_requested)
+        beginDump();
+    else if (delta)
+        beginDeltaCheck();
+    else
+        beginResume();
+}
+
+/**
+ * @brief      Pick up an update that was interrupted while programming.  The
+ *             journal names, per segment, how far the target acknowledged
+ *             the image; once the loader's range CRCs confirm that region
+ *             programming goes on from there without an erase.  Anything
+ *             else starts a normal update.
+ */
+void PhytecModule::beginResume(void)
+{
+    std::map<u_int8_t, u_int32_t> ends;
+    std::map<u_int8_t, u_int32_t>::const_iterator seg;
+    FlashImage::BlockMap::const_iterator run;
+    u_int32_t start, stop, len;
+
+    fw->sectorChecksums(PHYTEC_SECTOR_SIZE, sums);
+    image_crc = fw->contentChecksum();
+    resume_address = 0;
+    check_ranges.clear();
+
+    if (!(loader_features & PHYTEC_FEATURE_RANGE_CRC) || !readJournal(ends))
+    {
+        beginPlan();
+        return;
+    }
+
+    for (seg = ends.begin(); seg != ends.end(); ++seg)
+    {
+        run = fw->blocks().lower_bound((u_int32_t)seg->first << 16);
+        if ((run == fw->blocks().end()) || (FlashImage::segmentOf(run->first) != seg->first))
+            continue;
+        stop = ((u_int32_t)seg->first << 16) + seg->second;
+        for (start = run->first; start < stop; start += len)
+        {
+            len = (stop - start > PHYTEC_RANGE_CHUNK) ? PHYTEC_RANGE_CHUNK : stop - start;
+            check_ranges.push_back(std::make_pair(start, len));
+        }
+        if (stop > resume_address)
+            resume_address = stop;
+    }
+
+    if (check_ranges.empty())
+    {
+        beginPlan();
+        return;
+    }
+    qDebug(" resume: interrupted update found, checking up to %06X", resume_address);
+    journal_ends = ends;
+    check_next = 0;
+    requestRangeCrc(FLASH_RESUME_CHECK);
+}
+
+/**
+ * @brief      Ask the loader for the CRC of the next range in check_ranges,
+ *             or move on once all of them are in.
+ *
+ * @param[in]  purpose  FLASH_RESUME_CHECK or FLASH_VERIFY
+ */
+void PhytecModule::requestRangeCrc(FLASH_STATE purpose)
+{
+    u_int8_t command[7];
+    u_int32_t start;
+    u_int16_t len;
+
+    if ((check_next == check_ranges.size()) && (purpose == FLASH_VERIFY))
+    {
+        endVerify();
+        return;
+    }
+    if (check_next == check_ranges.size())
+    {
+        qDebug(" resume: continuing at %06X", resume_address);
+        run_stats.setup_ms = phase.restart();
+        logEvent(event("resume").hex("address", resume_address).flag("ok", true));
+        logEvent(event("phase").str("phase", "setup").num("ms", run_stats.setup_ms));
+        differential = false;
+        bytes_total = fw->size();
+        beginProgram();
+        return;
+    }
+
+    start = check_ranges[check_next].first;
+    len = check_ranges[check_next].second;
+    command[0] = PHYTEC_CMD_RANGE_CRC;
+    command[1] = FlashImage::segmentOf(start);
+    command[2] = FlashImage::offsetOf(start) >> 8;
+    command[3] = FlashImage::offsetOf(start) & 0xFF;
+    command[4] = len >> 8;
+    command[5] = len & 0xFF;
+    add_checksum(command, 6);
+    queueTx(command, sizeof(command));
+    enterState(purpose, PHYTEC_SECTOR_TIMEOUT);
+}
+
+/**
+ * @brief      Range CRC reply: CRC high, CRC low, ACK.  A mismatch ends a
+ *             resume check; during verification it is recorded and the
+ *             next block is checked.
+ */
+void PhytecModule::rangeCrcReply(const u_int8_t *reply)
+{
+    u_int32_t start = check_ranges[check_next].first;
+    u_int32_t len = check_ranges[check_next].second;
+    FlashImage::SectorMap::const_iterator found = verify_sums.find(start);
+    u_int16_t expected = ((state == FLASH_VERIFY) && (found != verify_sums.end())) ?
+                         found->second : fw->rangeChecksum(start, len);
+    bool match = (reply[2] == PHYTEC_ACK) && (((reply[0] << 8) | reply[1]) == expected);
+
+    if (!match && (state == FLASH_RESUME_CHECK))
+    {
+        qDebug(" resume: %06X..%06X does not match the image, starting over", start, start + len);
+        logEvent(event("resume").hex("address", start).flag("ok", false));
+        resume_address = 0;
+        journal_ends.clear();
+        beginPlan();
+        return;
+    }
+    if (!match)
+    {
+        qDebug(" verify: block %06X..%06X differs ( flash %02X%02X, image %04X )",
+               start, start + len, reply[0], reply[1], expected);
+        logEvent(event("verify_fail").hex("address", start).num("len", len)
+                 .num("flash_crc", (reply[0] << 8) | reply[1]).num("image_crc", expected));
+        run_stats.verify_failed.push_back(start);
+    }
+    check_next++;
+    requestRangeCrc(state);
+}
+
+/**
+ * @brief      Work out which sectors differ between the image and the
+ *             target.  The target contents come from the loader's sector
+ *             CRCs or, failing that, from the manifest of the last image
+ *             flashed.  Sectors the previous image used and the new one
+ *             does not are included so that they get wiped.  Without
+ *             either source the whole flash is erased.
+ */
+void PhytecModule::beginPlan(void)
+{
+    FlashImage::SectorMap old;
+    FlashImage::SectorMap::const_iterator s, found, image_sum;
+    std::vector<u_int8_t> erased(PHYTEC_SECTOR_SIZE, 0xFF);
+    bool have_manifest;
+
+    dirty.clear();
+    differential = false;
+
+    if (!(loader_features & PHYTEC_FEATURE_SECTOR_ERASE))
+    {
+        beginErase();
+        return;
+    }
+
+    have_manifest = readManifest(old);
+    if (!have_manifest && !(loader_features & PHYTEC_FEATURE_SECTOR_CRC))
+    {
+        qDebug(" planSectors: target contents unknown, full erase");
+        beginErase();
+        return;
+    }
+    crc_candidates = sums;
+    crc_candidates.insert(old.begin(), old.end());
+    erased_crc = crc16_update(CRC16_INIT, &erased[0], PHYTEC_SECTOR_SIZE);
+
+    if (loader_features & PHYTEC_FEATURE_SECTOR_CRC)
+    {
+        crc_next = crc_candidates.begin();
+        requestSectorCrc();
+        return;
+    }
+
+    for (s = crc_candidates.begin(); s != crc_candidates.end(); ++s)
+    {
+        found = old.find(s->first);
+        if (found == old.end())
+        {
+            dirty.insert(s->first);		// not in the manifest, contents unknown
+            continue;
+        }
+        image_sum = sums.find(s->first);
+        if (found->second != ((image_sum != sums.end()) ? image_sum->second : erased_crc))
+            dirty.insert(s->first);
+    }
+    differential = true;
+    beginErase();
+}
+
+/**
+ * @brief      Ask the loader for the CRC of the next candidate sector, or
+ *             go on to erasing once all are in.
+ */
+void PhytecModule::requestSectorCrc(void)
+{
+    if ((crc_next == crc_candidates.end()) && delta)
+    {
+        endDeltaCheck();
+        return;
+    }
+    if (crc_next == crc_candidates.end())
+    {
+        differential = true;
+        beginErase();
+        return;
+    }
+    sendSectorCommand(PHYTEC_CMD_SECTOR_CRC, crc_next->first);
+    enterState(FLASH_SECTOR_CRC, PHYTEC_SECTOR_TIMEOUT);
+}
+
+/**
+ * @brief      Sector CRC reply: CRC high, CRC low, ACK.
+ */
+void PhytecModule::sectorCrcReply(const u_int8_t *reply)
+{
+    FlashImage::SectorMap::const_iterator found;
+    u_int16_t expected;
+
+    if ((reply[2] != PHYTEC_ACK) && delta)
+    {
+        qDebug(" delta: no CRC for sector %06X, base revision not confirmed", crc_next->first);
+        finish(PHYTEC_RESULT_WRONG_BASE);
+        return;
+    }
+    if (delta)
+    {
+        checkDeltaSector(crc_next->first, true, (reply[0] << 8) | reply[1]);
+        ++crc_next;
+        requestSectorCrc();
+        return;
+    }
+    if (reply[2] != PHYTEC_ACK)
+    {
+        qDebug(" planSectors: no CRC for sector %06X, full erase", crc_next->first);
+        dirty.clear();
+        differential = false;
+        beginErase();
+        return;
+    }
+
+    found = sums.find(crc_next->first);
+    expected = (found != sums.end()) ? found->second : erased_crc;
+    if (((reply[0] << 8) | reply[1]) != expected)
+        dirty.insert(crc_next->first);
+
+    ++crc_next;
+    requestSectorCrc();
+}
+
+/**
+ * @brief      Confirm the target holds the base revision of the delta
+ *             being applied, by the loader's sector CRCs or, failing that,
+ *             by the manifest of the last image flashed.  Only the sectors
+ *             the delta leaves alone have to match: the delta carries the
+ *             complete new contents of every changed sector, so a changed
+ *             sector holding neither revision, as an interrupted apply
+ *             leaves it, is simply written again.
+ */
+void PhytecModule::beginDeltaCheck(void)
+{
+    ImageDelta::SectorTable::const_iterator entry;
+    FlashImage::SectorMap old;
+    FlashImage::SectorMap::const_iterator found;
+    std::vector<u_int8_t> erased(PHYTEC_SECTOR_SIZE, 0xFF);
+
+    delta->targetChecksums(sums);
+    image_crc = fw->contentChecksum();
+    resume_address = 0;
+    dirty.clear();
+    differential = false;
+    base_mismatches = 0;
+    erased_crc = crc16_update(CRC16_INIT, &erased[0], PHYTEC_SECTOR_SIZE);
+
+    if (!(loader_features & PHYTEC_FEATURE_SECTOR_ERASE))
+    {
+        qDebug(" delta: the loader can not erase single sectors");
+        finish(PHYTEC_RESULT_UNSUPPORTED);
+        return;
+    }
+    qDebug(" delta: base %04X -> %04X, %d of %d sectors changed", delta->baseChecksum(),
+           delta->targetChecksum(), (int)delta->changedSectors(), (int)delta->sectors().size());
+
+    if (loader_features & PHYTEC_FEATURE_SECTOR_CRC)
+    {
+        crc_candidates.clear();
+        for (entry = delta->sectors().begin(); entry != delta->sectors().end(); ++entry)
+            crc_candidates[entry->first] = entry->second.target_crc;
+        crc_next = crc_candidates.begin();
+        requestSectorCrc();
+        return;
+    }
+
+    if (!readManifest(old))
+    {
+        qDebug(" delta: target contents unknown, base revision not confirmed");
+        finish(PHYTEC_RESULT_WRONG_BASE);
+        return;
+    }
+    for (entry = delta->sectors().begin(); entry != delta->sectors().end(); ++entry)
+    {
+        found = old.find(entry->first);
+        checkDeltaSector(entry->first, found != old.end(), (found != old.end()) ? found->second : 0);
+    }
+    endDeltaCheck();
+}
+
+/**
+ * @brief      Compare one sector of the target with the delta: a sector
+ *             that already holds the new revision is left alone, a changed
+ *             one is marked for erasing, and an unchanged one must hold the
+ *             base revision.
+ *
+ * @param[in]  sector  The sector address
+ * @param[in]  known   The target's CRC of the sector is known
+ * @param[in]  crc     The target's CRC of the sector
+ */
+void PhytecModule::checkDeltaSector(u_int32_t sector, bool known, u_int16_t crc)
+{
+    const DeltaSector &entry = delta->sectors().find(sector)->second;
+
+    // a sector neither revision uses is erased in the manifest's view
+    if (!known && !(entry.flags & DELTA_IN_BASE) && !(entry.flags & DELTA_CHANGED))
+    {
+        known = true;
+        crc = erased_crc;
+    }
+
+    if (known && (crc == entry.target_crc))
+        return;
+    if (entry.flags & DELTA_CHANGED)
+    {
+        if (known && (crc != entry.base_crc))
+            qDebug(" delta: sector %06X holds neither revision, rewriting it", sector);
+        dirty.insert(sector);
+        return;
+    }
+    qDebug(" delta: sector %06X does not hold the base revision", sector);
+    base_mismatches++;
+}
+
+/**
+ * @brief      Every sector compared.  Only a target found on the base
+ *             revision has its changed sectors erased and written.
+ */
+void PhytecModule::endDeltaCheck(void)
+{
+    logEvent(event("delta").num("base_crc", delta->baseChecksum()).num("target_crc", delta->targetChecksum())
+             .num("sectors", delta->sectors().size()).num("changed", delta->changedSectors())
+             .num("to_write", dirty.size()).flag("base", base_mismatches == 0));
+
+    if (base_mismatches)
+    {
+        qDebug(" delta: %d sectors differ from the base revision, delta not applied", base_mismatches);
+        finish(PHYTEC_RESULT_WRONG_BASE);
+        return;
+    }
+    qDebug(" delta: base revision confirmed");
+    differential = true;
+    beginErase();
+}
+
+/**
+ * @brief      Send a command addressing one sector.
+ */
+void PhytecModule::sendSectorCommand(u_int8_t cmd, u_int32_t sector)
+{
+    u_int8_t command[5];
+
+    command[0] = cmd;
+    command[1] = FlashImage::segmentOf(sector);
+    command[2] = FlashImage::offsetOf(sector) >> 8;
+    command[3] = FlashImage::offsetOf(sector) & 0xFF;
+    add_checksum(command, 4);
+    queueTx(command, sizeof(command));
+    reply_timer.start();
+}
+
+/**
+ * @brief      Erase the changed sectors, or the whole flash.
+ */
+void PhytecModule::beginErase(void)
+{
+    std::set<u_int32_t>::const_iterator sector;
+    u_int8_t command[] = {PHYTEC_CMD_ERASE, PHYTEC_ERASE_ALL};
+
+    // the manifest describes the target again only once this update completes,
+    // and a journal of an earlier attempt is void once the flash is erased
+    unlink(manifest_path.c_str());
+    unlink(journal_path.c_str());
+    journal_ends.clear();
+    run_stats.setup_ms = phase.restart();
+    logEvent(event("phase").str("phase", "setup").num("ms", run_stats.setup_ms));
+
+    if (differential)
+    {
+        qDebug(" updateModule: %d sectors changed", (int)dirty.size());
+        bytes_total = 0;
+        for (sector = dirty.begin(); sector != dirty.end(); ++sector)
+            bytes_total += fw->bytesIn(*sector, PHYTEC_SECTOR_SIZE);
+        erase_next = dirty.begin();
+        eraseNextSector();
+        return;
+    }
+
+    qDebug(" updateModule: Erasing Flash");
+    bytes_total = fw->size();
+    queueTx(command, sizeof(command));
+    reply_timer.start();
+    qDebug(" updateModule: Waiting for Erase Completion...");
+    enterState(FLASH_ERASE, PHYTEC_ERASE_TIMEOUT);
+}
+
+/**
+ * @brief      Erase the next changed sector, or start programming once all
+ *             are erased.
+ */
+void PhytecModule::eraseNextSector(void)
+{
+    if (erase_next == dirty.end())
+    {
+        beginProgram();
+        return;
+    }
+    sendSectorCommand(PHYTEC_CMD_SECTOR_ERASE, *erase_next);
+    enterState(FLASH_SECTOR_ERASE, PHYTEC_SECTOR_TIMEOUT);
+}
+
+/**
+ * @brief      Start sending the fw->
+ */
+void PhytecModule::beginProgram(void)
+{
+    run_stats.erase_ms = phase.restart();
+    logEvent(event("phase").str("phase", "erase").num("ms", run_stats.erase_ms)
+             .str("mode", resume_address ? "none" : (differential ? "sectors" : "full"))
+             .num("sectors", differential ? dirty.size() : 0));
+
+    bytes_remaining = bytes_total;
+    bytes_done = 0;
+    qDebug("Write FW Image.\n");
+    qDebug(" percent done: %2.2f", 0.0);
+    qDebug(" bytes_remaining: %d", bytes_remaining);
+
+    acks_pending = 0;
+    ack_head = 0;
+    ack_errors = 0;
+    run_stats.bytes_programmed = 0;
+    run_stats.bytes_sent = 0;
+    run_stats.commands = 0;
+    run_stats.ack_us.clear();
+    run_stats.retries = 0;
+
+    // one block at a time until the target's turnaround is known
+    window = 1;
+    pace_us = 0;
+    last_sent = 0;
+    turnaround_us = 0;
+    round_acks = 0;
+    round_worst = 0;
+    pace_hold = 0;
+    block_naks.clear();
+    write_retry.clear();
+    write_failed = 0xFFFFFFFF;
+    acked_ends.clear();
+
+    prog_run = fw->blocks().begin();
+    if (prog_run != fw->blocks().end())
+        prog_address = prog_run->first;
+
+    // a resumed update skips what the target already acknowledged
+    if (resume_address)
+    {
+        prog_run = fw->blocks().upper_bound(resume_address);
+        if (prog_run != fw->blocks().begin())
+            --prog_run;
+        prog_address = (prog_run->first > resume_address) ? prog_run->first : resume_address;
+        bytes_remaining -= fw->bytesIn(0, resume_address);
+    }
+    bytes_done = bytes_total - bytes_remaining;
+
+    // only a full update can be resumed, a differential one is planned again
+    journal_active = !differential;
+    journal_timer.start();
+
+    enterState(FLASH_PROGRAM, 0);
+    fillWindow();
+}
+
+/**
+ * @brief      Find the next block to program.  The image is already parsed
+ *             and coalesced; each run is cut into the largest blocks the
+ *             loader accepts, never across a sector boundary, and sectors
+ *             left alone by a differential update are skipped.
+ *
+ * @param      address  Receives the block address
+ * @param      len      Receives the block length
+ *
+ * @return     false once the whole image is done.
+ */
+bool PhytecModule::nextBlock(u_int32_t *address, int *len)
+{
+    u_int32_t end, limit;
+
+    for (; prog_run != fw->blocks().end(); )
+    {
+        end = prog_run->first + prog_run->second.size();
+        if (prog_address >= end)
+        {
+            if (++prog_run != fw->blocks().end())
+                prog_address = prog_run->first;
+            continue;
+        }
+
+        limit = (prog_address & ~(PHYTEC_SECTOR_SIZE - 1)) + PHYTEC_SECTOR_SIZE;
+        if (limit > end)
+            limit = end;
+        if (differential && !dirty.count(prog_address & ~(PHYTEC_SECTOR_SIZE - 1)))
+        {
+            prog_address = limit;			// sector unchanged, skip it
+            continue;
+        }
+
+        *address = prog_address;
+        *len = limit - prog_address;
+        if (*len > max_block)
+            *len = max_block;
+        prog_address += *len;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief      Keep up to window write commands in flight, pace_us apart.
+ *             Blocks the target answered with NAK go first.
+ */
+void PhytecModule::fillWindow(void)
+{
+    FlashImage::BlockMap::const_iterator run;
+    u_int32_t address;
+    int len, wait_us;
+    float percent_done;
+
+    if (state != FLASH_PROGRAM)
+        return;							// the gap ended after the run did
+
+    while (acks_pending < window)
+    {
+        wait_us = pace_us - (int)((ack_clock.nsecsElapsed() - last_sent) / 1000);
+        if (last_sent && (wait_us > 0))
+        {
+            if (!pace_timer.isActive())
+                pace_timer.start((wait_us + 999) / 1000);
+            break;
+        }
+
+        if (!write_retry.empty())
+        {
+            address = write_retry.back().first;
+            len = write_retry.back().second - address;
+            write_retry.pop_back();
+            run = fw->blocks().upper_bound(address);
+            --run;
+            writeBlock(address, &run->second[address - run->first], len);
+            run_stats.retries++;
+            continue;
+        }
+        if (!nextBlock(&address, &len))
+            break;
+
+        if (!writeBlock(address, &prog_run->second[address - prog_run->first], len))
+        {
+            bytes_done += len;			// erased already, done as it is
+            emit transferred(bytes_done, bytes_total);
+        }
+        run_stats.bytes_programmed += len;
+
+        bytes_remaining -= len;
+        percent_done = 100.0 * ((float)bytes_remaining)/((float)bytes_total);
+        if (progress_log)
+            qDebug() << "\033[2K" << "Percent Remaining: " << qSetRealNumberPrecision(3)
+                     << percent_done << "%";
+        emit progress(100 - (int)percent_done);
+        if (state != FLASH_PROGRAM)
+            return;						// cancelled from a progress slot
+    }
+
+    if ((acks_pending == 0) && !pace_timer.isActive())
+        endProgram();					// nothing in flight and nothing left
+    else if (acks_pending && !state_timer.isActive())
+        state_timer.start(PHYTEC_ACK_TIMEOUT);
+}
+
+/**
+ * @brief      Consume the level 2 loader acknowledges, one status byte per
+ *             write command in the order the commands were sent, and refill
+ *             the window.
+ */
+void PhytecModule::takeAcks(void)
+{
+    u_int32_t sample;
+    u_int8_t seg;
+    size_t i;
+
+    for (i = 0; i < rx_buf.size(); i++)
+    {
+        if (acks_pending == 0)
+        {
+            qDebug(" drainAcks: unexpected byte %0X from the target", rx_buf[i]);
+            ack_errors++;
+            break;
+        }
+        sample = (ack_clock.nsecsElapsed() - ack_sent[ack_head]) / 1000;
+        run_stats.ack_us.push_back(sample);
+        adjustPace(rx_buf[i] != PHYTEC_ACK, sample, ack_ends[ack_head] - ack_records[ack_head]);
+        if (events)
+            logEvent(event("block").hex("address", ack_records[ack_head])
+                     .num("len", ack_ends[ack_head] - ack_records[ack_head])
+                     .num("us", sample).flag("ack", rx_buf[i] == PHYTEC_ACK));
+        if (rx_buf[i] != PHYTEC_ACK)
+        {
+            // every block has its own budget, a noisy stretch of the
+            // update does not use up the retries of the blocks after it
+            int naks = ++block_naks[ack_records[ack_head]];
+
+            qDebug(" drainAcks: block %06X not acknowledged (%0X), window %d, gap %d us",
+                   ack_records[ack_head], rx_buf[i], window, pace_us);
+            logEvent(event("retry").hex("address", ack_records[ack_head]).num("naks", naks)
+                     .num("window", window).num("gap_us", pace_us));
+            if (naks > PHYTEC_WRITE_RETRIES)
+            {
+                ack_errors++;
+                if (ack_records[ack_head] < write_failed)
+                    write_failed = ack_records[ack_head];
+            }
+            else
+                write_retry.push_back(std::make_pair(ack_records[ack_head], ack_ends[ack_head]));
+        }
+        else
+        {
+            seg = FlashImage::segmentOf(ack_records[ack_head]);
+            if (ack_ends[ack_head] - (ack_records[ack_head] & ~0xFFFF) > acked_ends[seg])
+                acked_ends[seg] = ack_ends[ack_head] - (ack_records[ack_head] & ~0xFFFF);
+            bytes_done += ack_ends[ack_head] - ack_records[ack_head];
+            emit transferred(bytes_done, bytes_total);
+        }
+        ack_head = (ack_head + 1) % PHYTEC_WRITE_WINDOW;
+        acks_pending--;
+    }
+    rx_buf.clear();
+    advanceJournal();
+
+    if (journal_active && (journal_timer.elapsed() >= PHYTEC_JOURNAL_INTERVAL))
+    {
+        writeJournal();
+        journal_timer.restart();
+    }
+
+    // the deadline covers the oldest command still in flight
+    state_timer.stop();
+    fillWindow();
+}
+
+/**
+ * @brief      Move the journal up to the first block the target has not
+ *             acknowledged: one in flight, one waiting to be sent again
+ *             after a NAK, one that failed for good, or the next one to
+ *             send.  Everything below it is programmed, so a NAK holds the
+ *             journal back only until the block is written after all.
+ */
+void PhytecModule::advanceJournal(void)
+{
+    std::map<u_int8_t, u_int32_t>::const_iterator seg;
+    u_int32_t frontier = write_failed, base, end;
+    size_t i;
+
+    if (prog_address < frontier)
+        frontier = prog_address;
+    for (i = 0; i < (size_t)acks_pending; i++)
+    {
+        if (ack_records[(ack_head + i) % PHYTEC_WRITE_WINDOW] < frontier)
+            frontier = ack_records[(ack_head + i) % PHYTEC_WRITE_WINDOW];
+    }
+    for (i = 0; i < write_retry.size(); i++)
+    {
+        if (write_retry[i].first < frontier)
+            frontier = write_retry[i].first;
+    }
+
+    for (seg = acked_ends.begin(); seg != acked_ends.end(); ++seg)
+    {
+        base = (u_int32_t)seg->first << 16;
+        if (base >= frontier)
+            break;
+        end = (frontier - base < seg->second) ? frontier - base : seg->second;
+        if (end > journal_ends[seg->first])
+            journal_ends[seg->first] = end;
+    }
+}
+
+/**
+ * @brief      Fit the write window and the gap between write commands to
+ *             how fast the target answers.  The first PHYTEC_PACE_PROBE
+ *             blocks go one at a time and give the turnaround of a single
+ *             block; the window then grows by one per clean round of
+ *             acknowledges while they stay within what the blocks queued
+ *             ahead of them explain, and shrinks when the target falls
+ *             behind.  A NAK halves the window and doubles the gap; the
+ *             gap then stays for PHYTEC_PACE_HOLD clean rounds, and every
+ *             clean round after that halves it again.
+ *
+ * @param[in]  nak        The command was not acknowledged
+ * @param[in]  sample_us  Send to acknowledge time of the command
+ * @param[in]  len        Data bytes of the command
+ */
+void PhytecModule::adjustPace(bool nak, u_int32_t sample_us, int len)
+{
+    u_int32_t line_us, expected_us;
+
+    if (nak)
+    {
+        window = (window > 1) ? window / 2 : 1;
+        pace_us = (pace_us * 2 > PHYTEC_PACE_STEP) ? pace_us * 2 : PHYTEC_PACE_STEP;
+        if (pace_us > PHYTEC_PACE_MAX)
+            pace_us = PHYTEC_PACE_MAX;
+        pace_hold = PHYTEC_PACE_HOLD;
+        round_acks = 0;
+        round_worst = 0;
+        return;
+    }
+
+    if ((turnaround_us == 0) || (sample_us < turnaround_us))
+        turnaround_us = sample_us;
+    if (sample_us > round_worst)
+        round_worst = sample_us;
+    if ((++round_acks < window) || (run_stats.ack_us.size() < PHYTEC_PACE_PROBE))
+        return;
+
+    // a target that keeps up answers within its own turnaround plus the
+    // line time of the commands queued ahead of this one
+    line_us = (link->rate() > 0) ? (u_int32_t)((long long)(len + 6) * 10 * 1000000 / link->rate()) : 0;
+    expected_us = 2 * (turnaround_us + (window - 1) * line_us);
+
+    if (round_worst > expected_us)
+    {
+        if (window > 1)
+            window--;
+    }
+    else if (pace_hold > 0)
+        pace_hold--;
+    else if (pace_us > 0)
+        pace_us = (pace_us / 2 >= PHYTEC_PACE_STEP / 2) ? pace_us / 2 : 0;
+    else if (window < PHYTEC_WRITE_WINDOW)
+        window++;
+
+    round_acks = 0;
+    round_worst = 0;
+}
+
+/**
+ * @brief      All blocks sent and acknowledged, or the target stopped
+ *             answering.
+ */
+void PhytecModule::endProgram(void)
+{
+    int status = NO_ERROR;
+
+    if (acks_pending)
+        status = ERR_FW_ACK;			// target stopped answering, give up
+    if (ack_errors)
+    {
+        qDebug(" updateModule: %d blocks not acknowledged", ack_errors);
+        status = ERR_FW_ACK;
+    }
+
+    run_stats.program_ms = phase.restart();
+    run_stats.turnaround_us = turnaround_us;
+    run_stats.window = window;
+    run_stats.pace_us = pace_us;
+    pace_timer.stop();
+    qDebug("FW Image Write Completed. ( %u bytes sent for %u bytes of data )", run_stats.bytes_sent, bytes_total);
+    qDebug(" pacing: turnaround %u us, window %d, gap %d us, %u blocks sent again",
+           turnaround_us, window, pace_us, run_stats.retries);
+    logEvent(event("phase").str("phase", "program").num("ms", run_stats.program_ms)
+             .num("bytes", run_stats.bytes_programmed).num("line_bytes", run_stats.bytes_sent)
+             .num("commands", run_stats.commands).num("retries", run_stats.retries)
+             .num("failed", ack_errors + acks_pending)
+             .num("bytes_per_s", throughput(run_stats.bytes_programmed, run_stats.program_ms))
+             .num("line_bytes_per_s", throughput(run_stats.bytes_sent, run_stats.program_ms))
+             .num("turnaround_us", turnaround_us).num("window", window).num("gap_us", pace_us));
+
+    if (status != NO_ERROR)
+    {
+        finish(status);
+        return;
+    }
+
+    // every block is acknowledged, there is nothing left to resume
+    unlink(journal_path.c_str());
+    journal_active = false;
+    beginVerify();
+}
+
+/**
+ * @brief      Compare what the flash holds with the image, one CRC per
+ *             PHYTEC_VERIFY_BLOCK of image data, covering everything this
+ *             update programmed.  Loaders without the range CRC command are
+ *             trusted on their acknowledges.
+ */
+void PhytecModule::beginVerify(void)
+{
+    FlashImage::BlockMap::const_iterator run;
+    u_int32_t address, end, limit;
+
+    run_stats.blocks_verified = 0;
+    run_stats.verify_failed.clear();
+    check_ranges.clear();
+    check_next = 0;
+    fw->blockChecksums(PHYTEC_VERIFY_BLOCK, verify_sums);	// precomputed for a cached image
+
+    if (!(loader_features & PHYTEC_FEATURE_RANGE_CRC))
+    {
+        endVerify();
+        return;
+    }
+
+    for (run = fw->blocks().begin(); run != fw->blocks().end(); ++run)
+    {
+        end = run->first + run->second.size();
+        for (address = run->first; address < end; address = limit)
+        {
+            limit = (address & ~(PHYTEC_VERIFY_BLOCK - 1)) + PHYTEC_VERIFY_BLOCK;
+            if (limit > end)
+                limit = end;
+            if (differential && !dirty.count(address & ~(PHYTEC_SECTOR_SIZE - 1)))
+                continue;				// sector left alone, its CRC matched before
+            check_ranges.push_back(std::make_pair(address, limit - address));
+        }
+    }
+    qDebug(" verify: checking %d blocks", (int)check_ranges.size());
+    requestRangeCrc(FLASH_VERIFY);
+}
+
+/**
+ * @brief      All blocks compared.  The manifest is only written for a
+ *             target that holds the image.
+ */
+void PhytecModule::endVerify(void)
+{
+    run_stats.verify_ms = phase.elapsed();
+    run_stats.blocks_verified = check_next;
+    logEvent(event("phase").str("phase", "verify").num("ms", run_stats.verify_ms)
+             .num("blocks", check_next).num("failed", run_stats.verify_failed.size()));
+
+    if (!run_stats.verify_failed.empty())
+    {
+        qDebug(" verify: %d of %d blocks differ", (int)run_stats.verify_failed.size(), (int)check_next);
+        finish(ERR_FW_VERIFY);
+        return;
+    }
+    if (check_next)
+        qDebug(" verify: %d blocks match ( %d ms )", (int)check_next, (int)run_stats.verify_ms);
+
+    writeManifest(sums);
+    finish(NO_ERROR);
+}
+
+/**
+ * @brief      Send one block of image data as a write command.
+ *
+ * @param[in]  address  The linear address of the data
+ * @param      data     The data
+ * @param[in]  len      The data length, at most max_block
+ *
+ * @return     true if a command was sent, false if the block is blank.
+ */
+bool PhytecModule::writeBlock(u_int32_t address, const u_int8_t *data, int len)
+{
+    int i, packed = -1;
+
+    // the flash has just been erased, blocks of 0xFF are there already
+    for (i = 0; (i < len) && (data[i] == 0xFF); i++)
+        ;
+    if (i == len)
+        return false;
+
+    block[1] = FlashImage::segmentOf(address);
+    block[2] = FlashImage::offsetOf(address) >> 8;
+    block[3] = FlashImage::offsetOf(address) & 0xFF;
+    block[4] = len;
+
+    if (loader_features & PHYTEC_FEATURE_RLE)
+        packed = rle_pack(data, len, block + 6, len - 2);
+
+    if (packed > 0)
+    {
+        // compressed write: 0x1B, segment, offset (2 bytes), length, packed length, packed data, checksum
+        block[0] = PHYTEC_CMD_WRITE_RLE;
+        block[5] = packed;
+        len = packed + 1;
+    }
+    else
+    {
+        // Phytec write command: 0x0B, segment, offset (2 bytes), length, data, checksum
+        block[0] = PHYTEC_CMD_WRITE;
+        memcpy(block + 5, data, len);
+    }
+    add_checksum(block, len + 5);
+    run_stats.bytes_sent += len + 6;
+    run_stats.commands++;
+
+    ack_records[(ack_head + acks_pending) % PHYTEC_WRITE_WINDOW] = address;
+    ack_ends[(ack_head + acks_pending) % PHYTEC_WRITE_WINDOW] = address + block[4];
+    ack_sent[(ack_head + acks_pending) % PHYTEC_WRITE_WINDOW] = ack_clock.nsecsElapsed();
+    last_sent = ack_sent[(ack_head + acks_pending) % PHYTEC_WRITE_WINDOW];
+    acks_pending++;
+    queueTx(block, len + 6);
+    return true;
+}
+
+/**
+ * @brief      Read the dump range back, keeping up to PHYTEC_WRITE_WINDOW
+ *             read commands in flight so the reply direction of the line
+ *             never idles.  Every reply carries the CRC-16 of its data.
+ */
+void PhytecModule::beginDump(void)
+{
+    run_stats.setup_ms = phase.restart();
+    logEvent(event("phase").str("phase", "setup").num("ms", run_stats.setup_ms));
+
+    if (!(loader_features & PHYTEC_FEATURE_READ))
+    {
+        qDebug(" dump: the loader can not read the flash");
+        finish(PHYTEC_RESULT_UNSUPPORTED);
+        return;
+    }
+    qDebug(" dump: reading %06X..%06X", dump_start, dump_end);
+
+    image.clear();
+    dump_next = dump_start;
+    dump_retry.clear();
+    read_errors = 0;
+    acks_pending = 0;
+    ack_head = 0;
+    run_stats.bytes_read = 0;
+    run_stats.commands = 0;
+    bytes_total = dump_end - dump_start;
+    bytes_remaining = bytes_total;
+    bytes_done = 0;
+
+    enterState(FLASH_DUMP, 0);
+    fillReads();
+}
+
+/**
+ * @brief      Find the next block to read: blocks that failed first, then
+ *             the largest block the loader sends, never across a segment.
+ *
+ * @return     false once the whole range is requested.
+ */
+bool PhytecModule::nextRead(u_int32_t *address, int *len)
+{
+    u_int32_t limit;
+
+    if (!dump_retry.empty())
+    {
+        *address = dump_retry.back().first;
+        *len = dump_retry.back().second - *address;
+        dump_retry.pop_back();
+        return true;
+    }
+    if (dump_next >= dump_end)
+        return false;
+
+    limit = (dump_next & ~0xFFFF) + 0x10000;
+    if (limit > dump_end)
+        limit = dump_end;
+    *address = dump_next;
+    *len = ((int)(limit - dump_next) > max_block) ? max_block : limit - dump_next;
+    dump_next += *len;
+    return true;
+}
+
+/**
+ * @brief      Keep the read window full, or finish once every block is in.
+ */
+void PhytecModule::fillReads(void)
+{
+    u_int8_t command[6];
+    u_int32_t address;
+    int len, slot;
+
+    while ((acks_pending < PHYTEC_WRITE_WINDOW) && nextRead(&address, &len))
+    {
+        // read command: 0x10, segment, offset (2 bytes), length, checksum
+        command[0] = PHYTEC_CMD_READ;
+        command[1] = FlashImage::segmentOf(address);
+        command[2] = FlashImage::offsetOf(address) >> 8;
+        command[3] = FlashImage::offsetOf(address) & 0xFF;
+        command[4] = len;
+        add_checksum(command, 5);
+
+        slot = (ack_head + acks_pending) % PHYTEC_WRITE_WINDOW;
+        ack_records[slot] = address;
+        ack_ends[slot] = address + len;
+        acks_pending++;
+        run_stats.commands++;
+        queueTx(command, sizeof(command));
+    }
+
+    if (acks_pending == 0)
+        endDump();
+    else if (!state_timer.isActive())
+        state_timer.start(PHYTEC_ACK_TIMEOUT);
+}
+
+/**
+ * @brief      Consume read replies, data followed by its CRC-16 and ACK, in
+ *             the order the commands were sent.  Erased blocks are not kept;
+ *             a block with a bad CRC is read again.
+ */
+void PhytecModule::takeReads(void)
+{
+    u_int32_t address, len, i;
+    u_int16_t crc;
+    const u_int8_t *data;
+    float percent_done;
+
+    while (acks_pending)
+    {
+        address = ack_records[ack_head];
+        len = ack_ends[ack_head] - address;
+        if (rx_buf.size() < len + 3)
+            return;						// the deadline still covers this block
+
+        data = &rx_buf[0];
+        crc = crc16_update(CRC16_INIT, data, len);
+        if ((data[len + 2] != PHYTEC_ACK) || (((data[len] << 8) | data[len + 1]) != crc))
+        {
+            qDebug(" dump: block %06X..%06X failed ( %02X )", address, address + len, data[len + 2]);
+            logEvent(event("retry").hex("address", address).num("len", len).num("errors", read_errors + 1));
+            if (++read_errors > PHYTEC_READ_RETRIES)
+            {
+                finish(ERR_FW_CHKSUM);
+                return;
+            }
+            dump_retry.push_back(std::make_pair(address, address + len));
+        }
+        else
+        {
+            for (i = 0; (i < len) && (data[i] == 0xFF); i++)
+                ;
+            if (i < len)
+                image.addData(address, data, len);
+            run_stats.bytes_read += len;
+            bytes_remaining -= len;
+            bytes_done += len;
+            emit transferred(bytes_done, bytes_total);
+        }
+        rx_buf.erase(rx_buf.begin(), rx_buf.begin() + len + 3);
+        ack_head = (ack_head + 1) % PHYTEC_WRITE_WINDOW;
+        acks_pending--;
+
+        percent_done = 100.0 * ((float)bytes_remaining) / ((float)bytes_total);
+        emit progress(100 - (int)percent_done);
+        if (state != FLASH_DUMP)
+            return;						// cancelled from a progress slot
+    }
+
+    state_timer.stop();
+    fillReads();
+}
+
+/**
+ * @brief      The whole range is in.  What was read is also the best record
+ *             of the target's sectors, so it becomes the manifest the next
+ *             differential update plans from.
+ */
+void PhytecModule::endDump(void)
+{
+    std::vector<u_int8_t> erased(PHYTEC_SECTOR_SIZE, 0xFF);
+    u_int32_t sector;
+
+    run_stats.dump_ms = phase.elapsed();
+    qDebug(" dump: %u bytes read in %d ms, %u bytes in use", run_stats.bytes_read,
+           (int)run_stats.dump_ms, image.size());
+    logEvent(event("phase").str("phase", "dump").num("ms", run_stats.dump_ms)
+             .num("bytes", run_stats.bytes_read).num("in_use", image.size())
+             .num("bytes_per_s", throughput(run_stats.bytes_read, run_stats.dump_ms)));
+
+    image.sectorChecksums(PHYTEC_SECTOR_SIZE, sums);
+    erased_crc = crc16_update(CRC16_INIT, &erased[0], PHYTEC_SECTOR_SIZE);
+    for (sector = (dump_start + PHYTEC_SECTOR_SIZE - 1) & ~(PHYTEC_SECTOR_SIZE - 1);
+         sector + PHYTEC_SECTOR_SIZE <= dump_end; sector += PHYTEC_SECTOR_SIZE)
+    {
+        if (!sums.count(sector))
+            sums[sector] = erased_crc;
+    }
+    // sectors only partly read are unknown
+    if (dump_start & (PHYTEC_SECTOR_SIZE - 1))
+        sums.erase(dump_start & ~(PHYTEC_SECTOR_SIZE - 1));
+    if (dump_end & (PHYTEC_SECTOR_SIZE - 1))
+        sums.erase(dump_end & ~(PHYTEC_SECTOR_SIZE - 1));
+    writeManifest(sums);
+
+    finish(NO_ERROR);
+}
+
+/**
+ * @brief      Parse the firmware file, Intel HEX or S-records, into the
+ *             in-memory image, or take it from the image cache if the same
+ *             file was flashed before.  The whole file is checked before
+ *             the module is touched.
+ */
+int PhytecModule::initFWFile( const char* path  )
+{
+    ImageCache cache;
+    int result = cache.load(path, -1, image, PHYTEC_SECTOR_SIZE, PHYTEC_VERIFY_BLOCK);
+
+	if (result == NO_ERROR)
+	{
+        qDebug ("FW File Loaded. ( %u bytes in %u blocks, %s%s )", image.size(),
+                (unsigned int)image.blocks().size(), image.formatName(), cache.wasHit() ? ", cached" : "");
+	}
+	else if (result < 0)
+	{
+        qDebug ("Could not open FW file.\n");
+	}
+	else
+	{
+        qDebug ("FW File invalid at line %d ( status = %d )", image.errorLine(), result);
+	}
+    return result;
+}
+
+bool PhytecModule::bIsFileOpened(void)
+{
+    return !fw->isEmpty();
+}
+
+void PhytecModule::releaseFWFile( void )
+{
+    image.clear();
+    qDebug(" PhytecModule::releaseFWFile\n");
+}
+
+/**
+ * @brief      Timing of the last connect and update.
+ */
+const FlashStats &PhytecModule::stats( void ) const
+{
+    return run_stats;
+}
+
+/**
+ * @brief      The firmware image being flashed.
+ */
+const FlashImage &PhytecModule::firmware( void ) const
+{
+    return *fw;
+}
+
+/**
+ * @brief      Phytec Module Constructor.  Initialize GPIO and serial port.
+ *
+ * @param[in]  path   The firmware file
+ * @param[in]  port   The serial device the module is attached to
+ * @param[in]  boot   The GPIO driving the module's boot pin
+ * @param[in]  reset  The GPIO driving the module's reset pin
+ */
+PhytecModule::PhytecModule(const char* path, const char* port, u_int16_t boot, u_int16_t reset)
+{
+    init(port, boot, reset);
+    fw = &image;
+
+	// Initialize FW File, a bad image never gets near the module
+    if( initFWFile( path ) != 0 )
+    {
+         throw std::runtime_error( "Invalid FW Path" );
+    }
+    run_stats.parse_ms = ack_clock.elapsed();
+    // Initialize GPIO
+    initGPIO();
+    // Initialize Serial Port
+    initSerial(port);
+}
+
+/**
+ * @brief      Phytec Module Constructor for one of several modules flashed
+ *             with the same image.  The image is parsed once by the caller
+ *             and must outlive the module.
+ *
+ * @param[in]  shared     The parsed firmware image, NULL for a dump
+ * @param[in]  port       The serial device the module is attached to
+ * @param[in]  boot       The GPIO driving the module's boot pin
+ * @param[in]  reset      The GPIO driving the module's reset pin
+ */
+PhytecModule::PhytecModule(const FlashImage *shared, const char* port, u_int16_t boot, u_int16_t reset)
+{
+    init(port, boot, reset);
+    fw = shared ? shared : &image;		// a dump reads into the module's own
+
+    initGPIO();
+    initSerial(port);
+}
+
+/**
+ * @brief      Phytec Module Constructor for a link set up by the caller,
+ *             e.g. a transport of an application that flashes in-process.
+ *             The link is opened if it is not open yet; it stays the
+ *             caller's and must outlive the module.
+ *
+ * @param[in]  shared     The parsed firmware image, NULL for a dump
+ * @param      transport  The link to the module
+ * @param[in]  boot       The GPIO driving the module's boot pin
+ * @param[in]  reset      The GPIO driving the module's reset pin
+ */
+PhytecModule::PhytecModule(const FlashImage *shared, Transport *transport, u_int16_t boot, u_int16_t reset)
+{
+    init(transport->name(), boot, reset);
+    fw = shared ? shared : &image;		// a dump reads into the module's own
+
+    initGPIO();
+    link = transport;
+    link_owned = false;
+    initLink();
+}
+
+/**
+ * @brief      Member set up shared by the constructors.
+ */
+void PhytecModule::init(const char* port, u_int16_t boot, u_int16_t reset)
+{
+    const char *name;
+
+    port_name = port;
+    boot_pin = boot;
+    reset_pin = reset;
+    progress_log = true;
+    gpio_released = false;
+    release_on_finish = false;
+    events = NULL;
+    delta = NULL;
+    base_mismatches = 0;
+    loaders = &builtin_loaders;
+    boot_code = NULL;
+
+    // every port keeps its own record of what was flashed through it
+    if (!strcmp(port, PHYTEC_DEBUG_PORT))
+    {
+        manifest_path = PHYTEC_MANIFEST_PATH;
+        journal_path = PHYTEC_JOURNAL_PATH;
+    }
+    else
+    {
+        name = strrchr(port, '/');
+        manifest_path = PHYTEC_MANIFEST_DIR "/sciton-bootloader.";
+        manifest_path += name ? name + 1 : port;
+        journal_path = manifest_path + ".journal";
+        manifest_path += ".manifest";
+    }
+    journal_active = false;
+    image_crc = 0;
+    resume_address = 0;
+    check_next = 0;
+
+    state = FLASH_IDLE;
+    result = 0;
+    update_requested = false;
+    dump_requested = false;
+    dump_start = 0;
+    dump_end = 0;
+    dump_next = 0;
+    read_errors = 0;
+    link = NULL;
+    link_owned = true;
+    rx_notifier = NULL;
+    tx_notifier = NULL;
+    waiting_loop = NULL;
+    waiting_for = FLASH_IDLE;
+    tx_pos = 0;
+    acks_pending = 0;
+    ack_head = 0;
+    ack_errors = 0;
+    max_block = PHYTEC_LEGACY_BLOCK;
+    loader_features = 0;
+    baud_step = 0;
+    window = 1;
+    pace_us = 0;
+    last_sent = 0;
+    turnaround_us = 0;
+    pace_hold = 0;
+    write_failed = 0xFFFFFFFF;
+    erased_crc = 0;
+    differential = false;
+    prog_address = 0;
+    bytes_total = 0;
+    bytes_remaining = 0;
+    bytes_done = 0;
+    run_stats = FlashStats();
+    ack_clock.start();
+
+    state_timer.setSingleShot(true);
+    run_timer.setSingleShot(true);
+    connect(&state_timer, &QTimer::timeout, this, &PhytecModule::onDeadline);
+    connect(&run_timer, &QTimer::timeout, this, &PhytecModule::onRunTimeout);
+    tx_timer.setSingleShot(true);
+    connect(&tx_timer, &QTimer::timeout, this, &PhytecModule::onWritable);
+    pace_timer.setSingleShot(true);
+    connect(&pace_timer, &QTimer::timeout, this, &PhytecModule::fillWindow);
+}
+
+/**
+ * @brief      Turn the per block "Percent Remaining" log line on or off.
+ *             progress() is emitted either way.
+ */
+void PhytecModule::setProgressLog(bool on)
+{
+    progress_log = on;
+}
+
+/**
+ * @brief      End every run by releasing the module into its application:
+ *             reset is held PHYTEC_RESET_HOLD in FLASH_RELEASE before
+ *             finished() is emitted, and the destructor does not wait.
+ */
+void PhytecModule::setReleaseOnFinish(bool on)
+{
+    release_on_finish = on;
+}
+
+/**
+ * @brief      Make start() read an address range of the target's flash into
+ *             firmware() instead of updating it.  A module built without an
+ *             image takes the data into its own.
+ *
+ * @param[in]  start  The first address to read
+ * @param[in]  len    The number of bytes to read
+ */
+void PhytecModule::setDump(u_int32_t start, u_int32_t len)
+{
+    dump_requested = true;
+    dump_start = start;
+    dump_end = start + len;
+    image.clear();
+    fw = &image;
+}
+
+/**
+ * @brief      Apply a delta instead of writing a whole image: once the
+ *             target is confirmed to hold the delta's base revision only
+ *             the changed sectors are erased and written.  The delta must
+ *             outlive the module.
+ */
+void PhytecModule::setDelta(const ImageDelta *changes)
+{
+    delta = changes;
+    fw = &changes->changes();
+}
+
+/**
+ * @brief      Choose the boot code from these variants instead of sending
+ *             the built-in one; the target's bootstrap identification byte
+ *             selects among them.  The set must outlive the module.
+ */
+void PhytecModule::setLoaders(const BootCodeSet *variants)
+{
+    loaders = variants;
+}
+
+/**
+ * @brief      Write a JSON line per phase, per block and for the result of
+ *             every run to a log, which may be shared with other modules.
+ *             The log must outlive the module; NULL turns it off.
+ */
+void PhytecModule::setEventLog(EventLog *log)
+{
+    events = log;
+}
+
+/**
+ * @brief      Start an event record of this module.
+ */
+EventRecord PhytecModule::event(const char *name) const
+{
+    EventRecord record(name);
+
+    record.str("port", port_name.c_str());
+    return record;
+}
+
+/**
+ * @brief      Write an event record if there is a log.
+ */
+void PhytecModule::logEvent(const EventRecord &record)
+{
+    if (events)
+        events->write(record);
+}
+
+/**
+ * @brief      Record the outcome of the rate the baud switch is trying.
+ */
+void PhytecModule::logBaud(const char *outcome)
+{
+    logEvent(event("baud").num("rate", baud_rates[baud_step].rate).str("outcome", outcome));
+}
+
+/**
+ * @brief      The serial device of this module.
+ */
+const char *PhytecModule::portName( void ) const
+{
+    return port_name.c_str();
+}
+
+/**
+ * @brief      Phytec Module Destructor.  Release all resources.
+ */
+PhytecModule::~PhytecModule()
+{
+	// Release GPIO, unless a group already did
+	if (!gpio_released)
+		releaseGPIO();
+	// Release FW File
+	releaseFWFile();
+    // Close the link, the notifiers go first
+    delete rx_notifier;
+    delete tx_notifier;
+    if (link_owned)
+        delete link;
+}
+
+/**
+ * @brief      Read the sector CRCs of the last image flashed successfully.
+ *
+ * @return     true if a manifest for the current sector size was found.
+ */
+bool PhytecModule::readManifest(FlashImage::SectorMap &sums)
+{
+    FILE *fp;
+    unsigned int sector, crc;
+    bool ok = false;
+
+    sums.clear();
+    fp = fopen(manifest_path.c_str(), "r");
+    if (fp == NULL)
+        return false;
+
+    if ((fscanf(fp, "sector %x", &sector) == 1) && (sector == PHYTEC_SECTOR_SIZE))
+    {
+        while (fscanf(fp, "%x %x", &sector, &crc) == 2)
+            sums[sector] = crc;
+        ok = true;
+    }
+    fclose(fp);
+    return ok;
+}
+
+/**
+ * @brief      Record the sector CRCs of the image just flashed.
+ */
+void PhytecModule::writeManifest(const FlashImage::SectorMap &sums)
+{
+    FlashImage::SectorMap::const_iterator s;
+    FILE *fp;
+
+    fp = fopen(manifest_path.c_str(), "w");
+    if (fp == NULL)
+    {
+        qDebug(" writeManifest: could not write %s", manifest_path.c_str());
+        return;
+    }
+
+    fprintf(fp, "sector %X\n", PHYTEC_SECTOR_SIZE);
+    for (s = sums.begin(); s != sums.end(); ++s)
+        fprintf(fp, "%06X %04X\n", s->first, s->second);
+    fclose(fp);
+}
+
+/**
+ * @brief      Read the journal of an interrupted update of the current
+ *             image.
+ *
+ * @param      ends  Receives, per segment, the end offset of the data the
+ *                   target acknowledged
+ *
+ * @return     true if a journal for this image was found.
+ */
+bool PhytecModule::readJournal(std::map<u_int8_t, u_int32_t> &ends)
+{
+    FILE *fp;
+    unsigned int crc, size, segment, end;
+    bool ok = false;
+
+    ends.clear();
+    fp = fopen(journal_path.c_str(), "r");
+    if (fp == NULL)
+        return false;
+
+    if ((fscanf(fp, "journal %x %x", &crc, &size) == 2) &&
+        (crc == image_crc) && (size == fw->size()))
+    {
+        while ((fscanf(fp, "%x %x", &segment, &end) == 2) && (segment <= 0xFF) && (end <= 0x10000))
+            ends[segment] = end;
+        ok = true;
+    }
+    fclose(fp);
+    return ok;
+}
+
+/**
+ * @brief      Record how far the target acknowledged the image.  The journal
+ *             is written and synced under a temporary name, renamed over the
+ *             old one and the directory synced, so a power loss at any point
+ *             leaves either the old journal or the new one.
+ */
+void PhytecModule::writeJournal(void)
+{
+    std::map<u_int8_t, u_int32_t>::const_iterator seg;
+    std::string tmp = journal_path + ".tmp";
+    std::string dir_path = journal_path.substr(0, journal_path.rfind('/'));
+    bool ok;
+    int dir;
+    FILE *fp;
+
+    fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL)
+    {
+        qDebug(" writeJournal: could not write %s", tmp.c_str());
+        return;
+    }
+
+    ok = (fprintf(fp, "journal %04X %X\n", image_crc, fw->size()) > 0);
+    for (seg = journal_ends.begin(); ok && (seg != journal_ends.end()); ++seg)
+        ok = (fprintf(fp, "%02X %05X\n", seg->first, seg->second) > 0);
+    if (ok)
+        ok = (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok || (rename(tmp.c_str(), journal_path.c_str()) < 0))
+    {
+        qDebug(" writeJournal: could not write %s", journal_path.c_str());
+        unlink(tmp.c_str());
+        return;
+    }
+
+    // the rename is only durable once the directory is
+    dir = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY);
+    if ((dir < 0) || (fsync(dir) < 0))
+        qDebug(" writeJournal: could not sync %s", dir_path.c_str());
+    if (dir >= 0)
+        close(dir);
+}
@@ -0,0 +1,97 @@
+/**
+  *****************************************************************************
+  * @file rle.cpp
+  * @brief Run length coding of write blocks.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "rle.h"
+
+#include <string.h>
+
+/**
+ * @brief      Compress a block.
+ *
+ * @param[in]  in       The data
+ * @param[in]  len      The data length
+ * @param      out      The compressed data
+ * @param[in]  max_out  The size of out
+ *
+ * @return     The compressed length, -1 if it would not fit into out.
+ */
+int rle_pack(const u_int8_t *in, int len, u_int8_t *out, int max_out)
+{
+    int i = 0, o = 0, run, lit;
+
+    while (i < len)
+    {
+        for (run = 1; (i + run < len) && (run < 129) && (in[i + run] == in[i]); run++)
+            ;
+        if (run >= 2)
+        {
+            if (o + 2 > max_out)
+                return -1;
+            out[o++] = 0x7E + run;
+            out[o++] = in[i];
+            i += run;
+            continue;
+        }
+
+        // literals up to the next run of two or more
+        for (lit = 1; (i + lit < len) && (lit < 128); lit++)
+        {
+            if ((i + lit + 1 < len) && (in[i + lit] == in[i + lit + 1]))
+                break;
+        }
+        if (o + 1 + lit > max_out)
+            return -1;
+        out[o++] = lit - 1;
+        memcpy(out + o, in + i, lit);
+        o += lit;
+        i += lit;
+    }
+    return o;
+}
+
+/**
+ * @brief      Expand a block compressed by rle_pack().
+ *
+ * @param[in]  in       The compressed data
+ * @param[in]  len      The compressed length
+ * @param      out      The expanded data
+ * @param[in]  max_out  The size of out
+ *
+ * @return     The expanded length, -1 if the data is corrupt or too long.
+ */
+int rle_unpack(const u_int8_t *in, int len, u_int8_t *out, int max_out)
+{
+    int i = 0, o = 0, n;
+
+    while (i < len)
+    {
+        if (in[i] < 0x80)
+        {
+            n = in[i] + 1;
+            if ((i + 1 + n > len) || (o + n > max_out))
+                return -1;
+            memcpy(out + o, in + i + 1, n);
+            i += 1 + n;
+        }
+        else
+        {
+            n = in[i] - 0x7E;
+            if ((i + 2 > len) || (o + n > max_out))
+                return -1;
+            memset(out + o, in[i + 1], n);
+            i += 2;
+        }
+        o += n;
+    }
+    return o;
+}
+
+/*! @} */
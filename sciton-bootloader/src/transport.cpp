@@ -0,0 +1,299 @@
+/**
+  *****************************************************************************
+  * @file transport.cpp
+  * @brief Serial, pseudo-terminal and TCP links to the Phytec module.
+  *
+  *****************************************************************************
+  */
+
+/*! \addtogroup BootLoader
+  *  @{
+  */
+#include "transport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/serial.h>
+
+#define PTY_SLAVE_MAJOR_FIRST 136		// Unix98 pty slaves use majors 136 to 143
+#define PTY_SLAVE_MAJOR_LAST 143
+
+/**
+ * @brief      Line rate in bits per second of a termios speed.
+ */
+int speedToRate(speed_t speed)
+{
+    switch (speed)
+    {
+    case B9600: return 9600;
+    case B19200: return 19200;
+    case B38400: return 38400;
+    case B57600: return 57600;
+    case B115200: return 115200;
+    case B230400: return 230400;
+    case B460800: return 460800;
+    case B921600: return 921600;
+    default: return 0;
+    }
+}
+
+Transport::Transport(const char *port)
+{
+    handle = -1;
+    port_name = port;
+    bits_per_second = 0;
+}
+
+Transport::~Transport()
+{
+    close();
+}
+
+/**
+ * @brief      Pick the transport for a port name: tcp:HOST:PORT is a TCP
+ *             connection, a pty slave (or a link to one) the emulator, any
+ *             other device a UART.  The transport is not opened yet.
+ */
+Transport *Transport::create(const char *port)
+{
+    struct stat st;
+
+    if (!strncmp(port, TRANSPORT_TCP_PREFIX, strlen(TRANSPORT_TCP_PREFIX)))
+        return new TcpTransport(port + strlen(TRANSPORT_TCP_PREFIX));
+
+    if ((stat(port, &st) == 0) && S_ISCHR(st.st_mode) &&
+        (major(st.st_rdev) >= PTY_SLAVE_MAJOR_FIRST) && (major(st.st_rdev) <= PTY_SLAVE_MAJOR_LAST))
+        return new PtyTransport(port);
+
+    return new SerialTransport(port);
+}
+
+void Transport::close(void)
+{
+    if (handle >= 0)
+        ::close(handle);
+    handle = -1;
+}
+
+int Transport::fd(void) const
+{
+    return handle;
+}
+
+const char *Transport::name(void) const
+{
+    return port_name.c_str();
+}
+
+/**
+ * @brief      Current line rate in bits per second, 0 if unknown.
+ */
+int Transport::rate(void) const
+{
+    return bits_per_second;
+}
+
+/**
+ * @brief      Write queued frames in one call.
+ *
+ * @return     The bytes written, -1 with errno set on failure.
+ */
+ssize_t Transport::send(const struct iovec *iov, int count)
+{
+    return writev(handle, iov, count);
+}
+
+/**
+ * @brief      Read what has arrived.
+ *
+ * @return     The bytes read, 0 once the link is closed, -1 with errno set
+ *             (EAGAIN if nothing is there).
+ */
+ssize_t Transport::receive(u_int8_t *buf, size_t len)
+{
+    return read(handle, buf, len);
+}
+
+/**
+ * @brief      Change the line rate.  Links without one only record it.
+ *
+ * @return     0 on success, -1 on failure.
+ */
+int Transport::setRate(speed_t speed)
+{
+    bits_per_second = speedToRate(speed);
+    return 0;
+}
+
+/**
+ * @brief      Drop received data that was not read yet.  Data already
+ *             handed to a stream can not be called back, so the output
+ *             queue is left alone.
+ */
+void Transport::flush(int queue)
+{
+    u_int8_t buf[256];
+
+    (void)queue;
+    while (read(handle, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/**
+ * @brief      Bytes written but not yet sent on by the driver, TIOCOUTQ for
+ *             ttys and sockets alike.
+ *
+ * @return     The byte count, -1 if the driver does not tell.
+ */
+int Transport::outQueue(void)
+{
+    int queued;
+
+    if ((handle < 0) || (ioctl(handle, TIOCOUTQ, &queued) < 0))
+        return -1;
+    return queued;
+}
+
+SerialTransport::SerialTransport(const char *port) : Transport(port)
+{
+    memset(&tio, 0, sizeof(tio));
+}
+
+/**
+ * @brief      Open the UART raw, 8N1, with the driver's low latency mode
+ *             on so that replies are passed up without delay.  The rate is
+ *             set through setRate().
+ *
+ * @return     0 on success, -1 if the device can not be opened.
+ */
+int SerialTransport::open(void)
+{
+    struct serial_struct serial;
+
+    if (openTty() < 0)
+        return -1;
+
+    if (ioctl(handle, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(handle, TIOCSSERIAL, &serial);
+    }
+    return 0;
+}
+
+/**
+ * @brief      Switch the host side of the line to a new rate.
+ */
+int SerialTransport::setRate(speed_t speed)
+{
+    Transport::setRate(speed);
+    cfsetospeed(&tio, speed);
+    cfsetispeed(&tio, speed);
+    return (tcsetattr(handle, TCSANOW, &tio) < 0) ? -1 : 0;
+}
+
+/**
+ * @brief      Drop data in the tty queues.
+ *
+ * @param[in]  queue  TCIFLUSH or TCIOFLUSH
+ */
+void SerialTransport::flush(int queue)
+{
+    tcflush(handle, queue);
+}
+
+/**
+ * @brief      Open the tty non-blocking with raw line settings.
+ *
+ * @return     0 on success, -1 if the device can not be opened.
+ */
+int SerialTransport::openTty(void)
+{
+    close();
+
+    memset(&tio, 0, sizeof(tio));
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_cflag = CS8 | CREAD | CLOCAL;
+    tio.c_lflag = 0;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 5;
+
+    // non-blocking, the state machine waits on the notifiers instead
+    handle = ::open(port_name.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    return (handle < 0) ? -1 : 0;
+}
+
+PtyTransport::PtyTransport(const char *port) : SerialTransport(port)
+{
+}
+
+/**
+ * @brief      Open the pty slave.  It has no driver latency to tune.
+ *
+ * @return     0 on success, -1 if the device can not be opened.
+ */
+int PtyTransport::open(void)
+{
+    return openTty();
+}
+
+TcpTransport::TcpTransport(const char *port) : Transport(port)
+{
+}
+
+/**
+ * @brief      Connect to HOST:PORT.  Small frames go out at once, batching
+ *             is done by the caller.
+ *
+ * @return     0 on success, -1 if the address is malformed or the
+ *             connection is refused.
+ */
+int TcpTransport::open(void)
+{
+    struct addrinfo hints, *res, *ai;
+    std::string host, service;
+    size_t colon = port_name.rfind(':');
+    int one = 1;
+
+    close();
+    if ((colon == std::string::npos) || (colon == 0))
+        return -1;
+    host = port_name.substr(0, colon);
+    service = port_name.substr(colon + 1);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0)
+        return -1;
+
+    for (ai = res; ai && (handle < 0); ai = ai->ai_next)
+    {
+        handle = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (handle < 0)
+            continue;
+        if (connect(handle, ai->ai_addr, ai->ai_addrlen) < 0)
+            close();
+    }
+    freeaddrinfo(res);
+    if (handle < 0)
+        return -1;
+
+    setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(handle, F_SETFL, fcntl(handle, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/*! @} */